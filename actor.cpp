@@ -84,27 +84,27 @@ bool
 C_Actor::checkCollision(void)
 {
    assert(map);
-   tile *tile_;
+   tile_t tile_ = 0;
 
    switch(movingDirection) {
    case TILE_X_PLUS:
       tile_ = map->getTile(mapCoordinateX + 1, mapCoordinateY);
-//      printf("X_PLUS tile type: %d\n", tile_->getType());
+//      printf("X_PLUS tile type: %d\n", tileType(tile_));
       break;
 
    case TILE_X_MINUS:
       tile_ = map->getTile(mapCoordinateX - 1, mapCoordinateY);
-//      printf("X_MINUS tile type: %d\n", tile_->getType());
+//      printf("X_MINUS tile type: %d\n", tileType(tile_));
       break;
 
    case TILE_Y_PLUS:
       tile_ = map->getTile(mapCoordinateX, mapCoordinateY + 1);
-//      printf("Z_PLUS tile type: %d\n", tile_->getType());
+//      printf("Z_PLUS tile type: %d\n", tileType(tile_));
       break;
 
    case TILE_Y_MINUS:
       tile_ = map->getTile(mapCoordinateX, mapCoordinateY - 1);
-//      printf("Z_MINUS tile type: %d\n", tile_->getType());
+//      printf("Z_MINUS tile type: %d\n", tileType(tile_));
       break;
 
    default:
@@ -112,9 +112,9 @@ C_Actor::checkCollision(void)
       break;
    }
 
-//   assert(tile_->getType() != TILE_WALL);
+//   assert(tileType(tile_) != TILE_WALL);
 
-   return tile_->getType() == TILE_WALL;
+   return tileType(tile_) == TILE_WALL;
 }
 
 bool
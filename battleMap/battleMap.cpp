@@ -33,14 +33,28 @@ C_BattleMap::AddStaticObject(C_BattleStaticObject *o)
 {
 //    o->init();
     m_staticObjectList.push_back(o);
+
+    /// Static objects don't move
+    C_Vertex position = o->GetPosition();
+    C_Vector3 min(position.x - o->GetSize() / 2.0f, position.y, position.z - o->GetSize() / 2.0f);
+    C_Vector3 max(position.x + o->GetSize() / 2.0f, position.y + o->GetHeight(), position.z + o->GetSize() / 2.0f);
+    addFrustumBox(&m_staticObjectBoxes, &min, &max);
 //    pathfinder.addStaticObject(o);
 }
 
 void
 C_BattleMap::Draw(void)
 {
-   for(list<C_BattleStaticObject *>::iterator i = m_staticObjectList.begin(); i != m_staticObjectList.end(); ++i) {
-      (*i)->Draw();
+   m_frustumResults.resize(m_staticObjectList.size());
+   if(m_frustumResults.size()) {
+      m_camera->frustum->boxesInFrustum(&m_staticObjectBoxes, &m_frustumResults[0]);
+   }
+
+   int n = 0;
+   for(list<C_BattleStaticObject *>::iterator i = m_staticObjectList.begin(); i != m_staticObjectList.end(); ++i, ++n) {
+      if(m_frustumResults[n] != FRUSTUM_OUTSIDE) {
+         (*i)->Draw();
+      }
    }
 
    for(list<C_BattleDynamicObject *>::iterator i = m_dynamicObjectList.begin(); i != m_dynamicObjectList.end(); ++i) {
@@ -41,6 +41,9 @@ public:
 private:
    std::list<C_BattleDynamicObject *> m_dynamicObjectList;
    std::list<C_BattleStaticObject *>  m_staticObjectList;
+   /// Boxes of the static objects, in m_staticObjectList's order. Frustum culled in one batch
+   frustumBoxes_t                     m_staticObjectBoxes;
+   std::vector<signed char>           m_frustumResults;
 
 //   Pathfinder pathfinder;
 };
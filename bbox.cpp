@@ -138,6 +138,7 @@ void C_BBox::Draw(void)
 
 void C_BBox::Draw(float r , float g , float b)
 {
+#ifndef BSP_COMPILER
    int polygonMode[2];
    glGetIntegerv(GL_POLYGON_MODE, polygonMode);
 
@@ -181,12 +182,12 @@ void C_BBox::Draw(float r , float g , float b)
 	verts[23].x = max.x, verts[23].y = min.y, verts[23].z = min.z;
 
    shaderManager->pushShader(basicShader);
-      basicShader->setUniform4f("u_v4_color", r, g, b, 1.0f);
+      basicShader->setUniform4f(UNIFORM_COLOR, r, g, b, 1.0f);
 
       glEnableVertexAttribArray(basicShader->verticesAttribLocation);
 
-      basicShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
-      basicShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+      basicShader->setUniformMatrix4fv(UNIFORM_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
+      basicShader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
 
       glEnableVertexAttribArray(basicShader->verticesAttribLocation);
       glVertexAttribPointer(basicShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, verts);
@@ -194,6 +195,7 @@ void C_BBox::Draw(float r , float g , float b)
    shaderManager->popShader();
 
 	glPolygonMode(GL_FRONT_AND_BACK, polygonMode[0]);
+#endif
 }
 
 void C_BBox::Translate(const float x, const float y, const float z)
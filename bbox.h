@@ -17,7 +17,9 @@
 #ifndef _BBOX_H_
 #define _BBOX_H_
 
-#include "glsl/glsl.h"
+#ifndef BSP_COMPILER
+#  include "glsl/glsl.h"
+#endif
 #include "bvolumes.h"
 
 class C_BBox : C_BVolumes {
@@ -0,0 +1,193 @@
+#include "bitSet.h"
+#include "globals.h"
+
+#include <string.h>
+
+C_BitSet::C_BitSet(void)
+{
+   words = NULL;
+   nBits = 0;
+   nWords = 0;
+   ownsWords = false;
+}
+
+C_BitSet::C_BitSet(int nBits)
+{
+   words = NULL;
+   this->nBits = 0;
+   nWords = 0;
+   ownsWords = false;
+
+   Resize(nBits);
+}
+
+C_BitSet::~C_BitSet(void)
+{
+   Release();
+}
+
+void
+C_BitSet::Resize(int nBits)
+{
+   Release();
+
+   this->nBits = nBits;
+   nWords = WordsForBits(nBits);
+
+   if(nWords) {
+      words = new uint32_t[nWords];
+      ownsWords = true;
+      ClearAll();
+   }
+}
+
+void
+C_BitSet::SetStorage(uint32_t *words, int nBits)
+{
+   Release();
+
+   this->words = words;
+   this->nBits = nBits;
+   nWords = WordsForBits(nBits);
+   ownsWords = false;
+}
+
+void
+C_BitSet::Release(void)
+{
+   if(ownsWords) {
+      delete[] words;
+   }
+
+   words = NULL;
+   nBits = 0;
+   nWords = 0;
+   ownsWords = false;
+}
+
+void
+C_BitSet::ClearAll(void)
+{
+   memset(words, 0, nWords * sizeof(uint32_t));
+}
+
+int
+C_BitSet::Count(void) const
+{
+   int count = 0;
+
+   for(int i = 0; i < nWords; i++) {
+      count += __builtin_popcount(words[i]);
+   }
+
+   return count;
+}
+
+int
+C_BitSet::NextSetBit(int bit) const
+{
+   if(bit >= nBits) {
+      return -1;
+   }
+
+   int w = bit >> 5;
+   uint32_t word = words[w] & (~0u << (bit & 31));
+
+   while(!word) {
+      if(++w == nWords) {
+         return -1;
+      }
+      word = words[w];
+   }
+
+   bit = (w << 5) + __builtin_ctz(word);
+
+   return bit < nBits ? bit : -1;
+}
+
+void
+C_BitSet::Or(const C_BitSet *set)
+{
+   assert(nWords == set->nWords);
+
+   for(int i = 0; i < nWords; i++) {
+      words[i] |= set->words[i];
+   }
+}
+
+void
+C_BitSet::And(const C_BitSet *set)
+{
+   assert(nWords == set->nWords);
+
+   for(int i = 0; i < nWords; i++) {
+      words[i] &= set->words[i];
+   }
+}
+
+bool
+C_BitSet::HasBitsNotIn(const C_BitSet *set) const
+{
+   assert(nWords == set->nWords);
+
+   for(int i = 0; i < nWords; i++) {
+      if(words[i] & ~set->words[i]) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+int
+C_BitSet::CompressRLE(unsigned char *out) const
+{
+   const unsigned char *bytes = (const unsigned char *)words;
+   int nBytes = nWords * 4;
+   int size = 0;
+
+   for(int i = 0; i < nBytes; i++) {
+      if(bytes[i]) {
+         out[size++] = bytes[i];
+         continue;
+      }
+
+      int run = 1;
+      while(i + run < nBytes && !bytes[i + run] && run < 255) {
+         run++;
+      }
+
+      out[size++] = 0;
+      out[size++] = run;
+      i += run - 1;
+   }
+
+   return size;
+}
+
+bool
+C_BitSet::DecompressRLE(const unsigned char *in, int size)
+{
+   unsigned char *bytes = (unsigned char *)words;
+   int nBytes = nWords * 4;
+   int b = 0;
+
+   for(int i = 0; i < size; i++) {
+      if(in[i]) {
+         if(b >= nBytes) {
+            return false;
+         }
+         bytes[b++] = in[i];
+         continue;
+      }
+
+      if(++i == size || b + in[i] > nBytes) {
+         return false;
+      }
+
+      memset(&bytes[b], 0, in[i]);
+      b += in[i];
+   }
+
+   return b == nBytes;
+}
@@ -0,0 +1,77 @@
+#ifndef _BITSET_H_
+#define _BITSET_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Fixed size set of bits, stored in 32bit words.
+ * Used for the leaf indexed PVS sets. Storage is either owned by the set (Resize) or
+ * provided from outside (SetStorage), ie. a row of a bigger matrix.
+ * An optional run length compressed form is provided for storage: zero bytes are
+ * stored as a 0 followed by the number of zero bytes in the run (max 255), all other
+ * bytes are stored as they are.
+ */
+class C_BitSet {
+public:
+   C_BitSet(void);
+   C_BitSet(int nBits);
+   ~C_BitSet(void);
+
+   /// Allocates room for nBits (owned by the set) and clears them
+   void Resize(int nBits);
+   /// Use external memory of (nBits + 31) / 32 words. Memory is not freed by the set
+   void SetStorage(uint32_t *words, int nBits);
+   /// Frees owned memory. The set becomes empty
+   void Release(void);
+
+   inline bool Test(int bit) const { return (words[bit >> 5] >> (bit & 31)) & 1u; }
+   inline void Set(int bit) { words[bit >> 5] |= 1u << (bit & 31); }
+   inline void Unset(int bit) { words[bit >> 5] &= ~(1u << (bit & 31)); }
+
+   /// Thread safe versions. Other threads may be setting bits of the same set at the same time
+   inline bool TestAtomic(int bit) const { return (__atomic_load_n(&words[bit >> 5], __ATOMIC_ACQUIRE) >> (bit & 31)) & 1u; }
+   /// Returns the bit's previous value
+   inline bool TestAndSetAtomic(int bit) {
+      uint32_t mask = 1u << (bit & 31);
+      return __atomic_fetch_or(&words[bit >> 5], mask, __ATOMIC_ACQ_REL) & mask;
+   }
+
+   void ClearAll(void);
+   /// Number of bits set
+   int Count(void) const;
+   /// Index of the first set bit greater or equal to bit. -1 if there is none
+   int NextSetBit(int bit) const;
+
+   /// Word wide set operations. Both sets must have the same size
+   void Or(const C_BitSet *set);
+   void And(const C_BitSet *set);
+   /// True if a bit set here isn't set in set
+   bool HasBitsNotIn(const C_BitSet *set) const;
+
+   /// Run length compression. out must have room for MaxRLESize() bytes.
+   /// Returns the number of bytes written
+   int CompressRLE(unsigned char *out) const;
+   /// Decompresses size bytes. Returns false if the data doesn't match the set's size
+   bool DecompressRLE(const unsigned char *in, int size);
+   inline int MaxRLESize(void) const { return nWords * 4 * 2; }
+
+   inline int GetnBits(void) const { return nBits; }
+   inline int GetnWords(void) const { return nWords; }
+   inline uint32_t *GetWords(void) { return words; }
+   inline const uint32_t *GetWords(void) const { return words; }
+
+   static inline int WordsForBits(int nBits) { return (nBits + 31) / 32; }
+
+private:
+   uint32_t    *words;
+   int         nBits;
+   int         nWords;
+   bool        ownsWords;
+
+   /// Not copyable
+   C_BitSet(const C_BitSet &);
+   C_BitSet &operator=(const C_BitSet &);
+};
+
+#endif
@@ -3,20 +3,33 @@
 
 #include <vector>
 
-#include "glsl/glsl.h"
 #include "globals.h"
 #include "plane.h"
 #include "bbox.h"
-#include "mesh.h"
+#include "bitSet.h"
+#ifndef BSP_COMPILER
+#  include "glsl/glsl.h"
+#  include "mesh.h"
+#endif
 
 class C_BspNode;
 class C_BspTree;
+class C_PolygonArena;
 
 #define BACK		   0
 #define FRONT		   1
 #define INTERSECTS	2
 #define COINCIDENT	3
 
+/// Sample points laid along each plane cutting a leaf's bbox (see C_BspNode::DistributePointsAlongPlane)
+#define NPOINTS_U                   5
+#define NPOINTS_V                   5
+/// Leaves with sample points closer than this are connected (see C_BspTree::FindConnectedLeaves)
+#define CONNECTED_LEAVES_DISTANCE   5.0f
+/// Leaves with more triangles than this get a BVH, and BVH leaves hold up to TRIANGLE_BVH_LEAF_SIZE triangles
+#define TRIANGLE_BVH_MIN_TRIANGLES  12
+#define TRIANGLE_BVH_LEAF_SIZE      4
+
 extern int nConvexRooms;
 
 struct poly_t {
@@ -26,16 +39,126 @@ struct poly_t {
 	bool           usedAsDivider;
 };
 
+/// Cached score of a candidate splitting plane
+typedef struct {
+   unsigned int   nSplits;
+   float          relation;
+} partitionScore_t;
+
 struct brush_t {
 	poly_t         *pPolys;
 	int            nPolys;
 };
 
+/// Compact copy of a tree node used by the runtime traversals
+typedef struct {
+   /// Partition plane
+   float          a, b, c, d;
+   /// Children indices into the flat node array. -1 if there is no child
+   int            front, back;
+   /// Index into C_BspTree::leaves or -1 if the node is not a leaf
+   int            leaf;
+} bspFlatNode_t;
+
+/// Box around all the leaves below a flat node. Same indices as the flat nodes
+typedef struct {
+   float          min[3], max[3];
+} bspFlatNodeBounds_t;
+
+/// Hardware occlusion query state of a flat node (see C_BspTree::ReadOcclusionQueries)
+typedef struct {
+   unsigned int   query;
+   /// Outcome of the node's last query. Hidden nodes aren't walked down, their box is queried instead
+   bool           visible;
+   /// Issued but its result isn't available yet
+   bool           pending;
+   /// Last frame the traversal reached the node
+   unsigned int   visitFrame;
+} bspNodeQuery_t;
+
+/// Node of a leaf's triangle BVH. Boxes are padded by the query tolerances
+typedef struct {
+   float          min[3], max[3];
+   /// Leaf nodes hold count records starting at first.
+   /// Inner nodes have count 0, their children are the next node and node first
+   int            first;
+   int            count;
+} bspTriangleBvhNode_t;
+
+/**
+ * Leaf triangles laid out for the ray and point queries (see bspTriangleQuery.cpp).
+ * One array per component. A leaf's records are at the same place as its triangles in
+ * leafTriangles, ordered by its BVH
+ */
 typedef struct {
+   int                     nRecords;
+   /// Vertex 0 and the edges vertex1 - vertex0, vertex2 - vertex0
+   float                   *v0[3];
+   float                   *e1[3];
+   float                   *e2[3];
+   /// Unit plane (a, b, c, d) as C_Plane builds it
+   float                   *plane[4];
+   /// Lines whose Moller-Trumbore determinant is smaller than this are parallel to the triangle
+   float                   *parallel;
+   /// Barycentric terms of the point test (see CalculateUV)
+   float                   *dot00, *dot01, *dot11, *invDenom;
+   float                   *storage;
+
+   int                     nBvhNodes;
+   bspTriangleBvhNode_t    *bvhNodes;
+   /// BVH root of every leaf (by leafIndex). -1 for leaves scanned linearly
+   int                     *leafBvh;
+} bspTriangleRecords_t;
+
+/// How BuildPVS finds out which leaves are visible from each other
+typedef enum {
+   /// Rays cast between sample points distributed in the leaves
+   PVS_RAY_SAMPLING,
+   /// Flow through the portals between adjacent leaves (see bspPortals.cpp)
+   PVS_PORTAL_FLOW
+} pvsMethod_t;
+
+/// Opening between two adjacent leaves.
+/// Leaves span the whole height of the map so a portal is a segment on the XZ plane
+typedef struct {
+   float          x0, z0, x1, z1;
+   /// Indices into C_BspTree::leaves
+   int            leaves[2];
+} bspPortal_t;
+
+/// Area beyond all the portals a flow went through. Portals are axis aligned, so it's
+/// an open box: x > min[0], x < max[0], z > min[1], z < max[1]
+typedef struct {
+   float          min[2], max[2];
+} bspPortalBounds_t;
+
+/// Working sets of one portal flow source
+typedef struct {
+   /// Leaves of the current chain
+   C_BitSet                path;
+   /// Leaves the chain might still reach, one set per recursion depth. Grown as the flow goes deeper
+   vector<C_BitSet *>      mightsee;
+   /// Leaves reached through the first portal of the current chain (see C_BspTree::portalVis)
+   C_BitSet                *reached;
+   /// Portals flowed through so far (see PORTAL_FLOW_MAX_STEPS)
+   int                     steps;
+} bspPortalFlowState_t;
+
+/// The map compiler only passes pointers to them around
+#ifdef BSP_COMPILER
+struct staticTreeObject_t;
+#else
+struct staticTreeObject_t {
    C_MeshGroup    mesh;
    unsigned int   meshID;
    bool           drawn;
+   /// Outside the frustum in the last frame it was tested (see C_BspTree::CullStaticObjects)
+   bool           outsideFrustum;
+   /// Hidden by the bsp geometry in the last frame it was tested (see C_BspTree::CullOccludedObjects)
+   bool           occluded;
+   unsigned int   cullFrame;
 //   C_BBox         bbox;
-} staticTreeObject_t;
+};
+#endif
 
 #endif
@@ -0,0 +1,320 @@
+#include "bspTree.h"
+#include "bspNode.h"
+#include "bspHelperFunctions.h"
+
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Compiled map file.
+ * Holds everything the game needs to render a map, as produced by the offline
+ * compiler (bspc): the flattened tree, the leaves' bboxes, triangles and PVS.
+ *
+ * The file is memory mapped and the node and triangle arrays are used in place, so
+ * every section is stored in the exact in-memory layout (native endianess) and
+ * aligned to COMPILED_MAP_ALIGNMENT bytes.
+ *
+ *    compiledMapHeader_t                 header
+ *    bspFlatNode_t                       flatNodes[nFlatNodes]
+ *    compiledMapLeaf_t                   leaves[nLeaves]
+ *    triangle_vn                         triangles[nLeafTriangles]
+ *    unsigned char                       pvs[pvsSize]
+ *
+ * Bit j of the leaf i's pvs row is set if leaf j is visible from leaf i. Rows are mostly
+ * zeroes on big maps so each one is stored run length compressed (see C_BitSet::CompressRLE)
+ * at leaves[i].pvsOffset bytes from the beginning of the pvs section. The rows are
+ * decompressed into the tree's pvsBits when the map is loaded.
+ */
+
+#define COMPILED_MAP_MAGIC       "BSPC"
+#define COMPILED_MAP_VERSION     4
+#define COMPILED_MAP_ALIGNMENT   16
+
+typedef struct {
+   char        magic[4];
+   int32_t     version;
+   /// Checksum of everything following the header
+   uint32_t    checksum;
+   /// Checksum of the .bsp file the map was compiled from
+   uint32_t    sourceChecksum;
+   uint32_t    fileSize;
+
+   int32_t     nLeaves;
+   int32_t     nNodes;
+   int32_t     nFlatNodes;
+   int32_t     nLeafTriangles;
+   int32_t     pvsRowWords;
+   /// Size in bytes of the compressed pvs section
+   uint32_t    pvsSize;
+   /// pvsMethod_t the PVS was built with
+   int32_t     pvsMethod;
+
+   C_Vertex    bboxMin;
+   C_Vertex    bboxMax;
+
+   /// Section offsets from the beginning of the file
+   uint32_t    flatNodesOffset;
+   uint32_t    leavesOffset;
+   uint32_t    trianglesOffset;
+   uint32_t    pvsOffset;
+} compiledMapHeader_t;
+
+typedef struct {
+   uint32_t    nodeID;
+   int32_t     firstTriangle;
+   int32_t     nTriangles;
+   C_Vertex    bboxMin;
+   C_Vertex    bboxMax;
+   /// Compressed pvs row
+   uint32_t    pvsOffset;
+   uint32_t    pvsSize;
+} compiledMapLeaf_t;
+
+static inline uint32_t
+alignOffset(uint32_t offset)
+{
+   return (offset + COMPILED_MAP_ALIGNMENT - 1) & ~(uint32_t)(COMPILED_MAP_ALIGNMENT - 1);
+}
+
+bool
+C_BspTree::WriteCompiledMap(const char *fileName, const char *sourceFileName)
+{
+   int i;
+   compiledMapHeader_t header;
+
+   printf("%s: Writing compiled map \"%s\"\n", __FUNCTION__, fileName);
+
+   assert(flatNodes);
+   assert(leafTriangles);
+
+   memset((void *)&header, 0, sizeof(header));
+   memcpy(header.magic, COMPILED_MAP_MAGIC, 4);
+   header.version = COMPILED_MAP_VERSION;
+   header.nLeaves = nLeaves;
+   header.nNodes = nNodes;
+   header.nFlatNodes = nFlatNodes;
+   header.nLeafTriangles = nLeafTriangles;
+   header.pvsRowWords = C_BitSet::WordsForBits(nLeaves);
+   header.pvsMethod = pvsMethod;
+   bbox.GetMin(&header.bboxMin);
+   bbox.GetMax(&header.bboxMax);
+
+   if(!FileChecksum(sourceFileName, &header.sourceChecksum)) {
+      printf("Couldn't read \"%s\"\n", sourceFileName);
+      return false;
+   }
+
+   header.flatNodesOffset = alignOffset(sizeof(compiledMapHeader_t));
+   header.leavesOffset = alignOffset(header.flatNodesOffset + nFlatNodes * sizeof(bspFlatNode_t));
+   header.trianglesOffset = alignOffset(header.leavesOffset + nLeaves * sizeof(compiledMapLeaf_t));
+   header.pvsOffset = alignOffset(header.trianglesOffset + nLeafTriangles * sizeof(triangle_vn));
+
+   /// Compress the pvs rows first so that the file size is known
+   unsigned char *pvs = new unsigned char[nLeaves * leaves[0]->PVS.MaxRLESize()];
+   uint32_t *rowOffsets = new uint32_t[nLeaves];
+   uint32_t *rowSizes = new uint32_t[nLeaves];
+
+   header.pvsSize = 0;
+   for(i = 0; i < nLeaves; i++) {
+      assert(leaves[i]->PVS.GetnBits() == nLeaves);
+
+      rowOffsets[i] = header.pvsSize;
+      rowSizes[i] = leaves[i]->PVS.CompressRLE(pvs + header.pvsSize);
+      header.pvsSize += rowSizes[i];
+   }
+
+   header.fileSize = header.pvsOffset + header.pvsSize;
+
+   /// Put the whole file together in memory. Padding stays zeroed
+   char *data = new char[header.fileSize];
+   memset(data, 0, header.fileSize);
+
+   memcpy(data + header.flatNodesOffset, flatNodes, nFlatNodes * sizeof(bspFlatNode_t));
+   memcpy(data + header.trianglesOffset, leafTriangles, nLeafTriangles * sizeof(triangle_vn));
+   memcpy(data + header.pvsOffset, pvs, header.pvsSize);
+
+   compiledMapLeaf_t *cLeaves = (compiledMapLeaf_t *)(data + header.leavesOffset);
+
+   for(i = 0; i < nLeaves; i++) {
+      C_BspNode *leaf = leaves[i];
+
+      cLeaves[i].nodeID = leaf->nodeID;
+      cLeaves[i].firstTriangle = leaf->triangles - leafTriangles;
+      cLeaves[i].nTriangles = leaf->nTriangles;
+      leaf->bbox.GetMin(&cLeaves[i].bboxMin);
+      leaf->bbox.GetMax(&cLeaves[i].bboxMax);
+      cLeaves[i].pvsOffset = rowOffsets[i];
+      cLeaves[i].pvsSize = rowSizes[i];
+   }
+
+   delete[] pvs;
+   delete[] rowOffsets;
+   delete[] rowSizes;
+
+   header.checksum = FNV1a(data + sizeof(compiledMapHeader_t), header.fileSize - sizeof(compiledMapHeader_t), FNV1A_INITIAL);
+   memcpy(data, &header, sizeof(compiledMapHeader_t));
+
+   bool ret = false;
+   ofstream file(fileName, ios::out | ios::binary);
+   if(file.is_open()) {
+      file.write(data, header.fileSize);
+      ret = file.good();
+      file.close();
+   } else {
+      printf("Couldn't open \"%s\"\n", fileName);
+   }
+
+   delete[] data;
+
+   return ret;
+}
+
+/**
+ * Maps a compiled map file and uses it in place.
+ * Returns false if the file is missing, was written by a different version, is corrupted,
+ * was compiled from a different .bsp file than sourceFileName or its PVS wasn't built with
+ * method. The caller should then rebuild the map (and the tree is left empty).
+ */
+bool
+C_BspTree::ReadCompiledMap(const char *fileName, const char *sourceFileName, pvsMethod_t method)
+{
+   int i;
+   struct stat st;
+   uint32_t sourceChecksum;
+
+   printf("%s: Reading compiled map \"%s\"\n", __FUNCTION__, fileName);
+
+   assert(!headNode && !flatNodes && !mappedMap);
+
+   int fd = open(fileName, O_RDONLY);
+   if(fd < 0) {
+      printf("Couldn't open \"%s\"\n", fileName);
+      return false;
+   }
+
+   if(fstat(fd, &st) || st.st_size < (off_t)sizeof(compiledMapHeader_t)) {
+      close(fd);
+      printf("\"%s\" is not a compiled map\n", fileName);
+      return false;
+   }
+
+   void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if(base == MAP_FAILED) {
+      printf("Couldn't map \"%s\"\n", fileName);
+      return false;
+   }
+
+   const char *data = (const char *)base;
+   const compiledMapHeader_t *header = (const compiledMapHeader_t *)data;
+   bool valid = !memcmp(header->magic, COMPILED_MAP_MAGIC, 4) &&
+                header->version == COMPILED_MAP_VERSION &&
+                header->fileSize == (uint32_t)st.st_size &&
+                header->nLeaves > 0 && header->nFlatNodes > 0 && header->nLeafTriangles >= 0 &&
+                header->pvsRowWords == C_BitSet::WordsForBits(header->nLeaves) &&
+                header->flatNodesOffset + header->nFlatNodes * sizeof(bspFlatNode_t) <= header->fileSize &&
+                header->leavesOffset + header->nLeaves * sizeof(compiledMapLeaf_t) <= header->fileSize &&
+                header->trianglesOffset + header->nLeafTriangles * sizeof(triangle_vn) <= header->fileSize &&
+                header->pvsOffset + header->pvsSize <= header->fileSize;
+
+   if(valid) {
+      valid = header->checksum == FNV1a(data + sizeof(compiledMapHeader_t), header->fileSize - sizeof(compiledMapHeader_t), FNV1A_INITIAL);
+   }
+
+   /// The traversals index with these without checking them. The nodes are depth first,
+   /// so children always come after their parent and a bad file can't make a traversal loop
+   const bspFlatNode_t *cFlatNodes = (const bspFlatNode_t *)(data + header->flatNodesOffset);
+   for(i = 0; valid && i < header->nFlatNodes; i++) {
+      valid = (cFlatNodes[i].front == -1 || (cFlatNodes[i].front > i && cFlatNodes[i].front < header->nFlatNodes)) &&
+              (cFlatNodes[i].back == -1 || (cFlatNodes[i].back > i && cFlatNodes[i].back < header->nFlatNodes)) &&
+              cFlatNodes[i].leaf >= -1 && cFlatNodes[i].leaf < header->nLeaves;
+   }
+
+   /// Node ids are handed out three per split node (see CollectLeaves)
+   const compiledMapLeaf_t *cLeaves = (const compiledMapLeaf_t *)(data + header->leavesOffset);
+   for(i = 0; valid && i < header->nLeaves; i++) {
+      valid = cLeaves[i].nodeID < 3 * (uint32_t)header->nFlatNodes;
+   }
+
+   if(!valid) {
+      printf("\"%s\" is corrupted or was written by another version\n", fileName);
+      munmap(base, st.st_size);
+      return false;
+   }
+
+   /// Geometry might have changed since the map was compiled
+   if(FileChecksum(sourceFileName, &sourceChecksum) && sourceChecksum != header->sourceChecksum) {
+      printf("\"%s\" is out of date\n", fileName);
+      munmap(base, st.st_size);
+      return false;
+   }
+
+   if(header->pvsMethod != method) {
+      printf("\"%s\" has a PVS built with another method\n", fileName);
+      munmap(base, st.st_size);
+      return false;
+   }
+
+   mappedMap = base;
+   mappedMapSize = st.st_size;
+
+   nLeaves = header->nLeaves;
+   nNodes = header->nNodes;
+   nFlatNodes = header->nFlatNodes;
+   nLeafTriangles = header->nLeafTriangles;
+   pvsMethod = method;
+
+   bbox.SetMin(header->bboxMin.x, header->bboxMin.y, header->bboxMin.z);
+   bbox.SetMax(header->bboxMax.x, header->bboxMax.y, header->bboxMax.z);
+   bbox.SetVertices();
+
+   /// Used in place
+   flatNodes = (bspFlatNode_t *)(data + header->flatNodesOffset);
+   leafTriangles = (triangle_vn *)(data + header->trianglesOffset);
+
+   const unsigned char *pvs = (const unsigned char *)(data + header->pvsOffset);
+
+   loadedLeaves = new C_BspNode[nLeaves];
+   pvsBits = new uint32_t[nLeaves * header->pvsRowWords];
+   leaves.reserve(nLeaves);
+
+   for(i = 0; i < nLeaves; i++) {
+      C_BspNode *leaf = &loadedLeaves[i];
+
+      leaf->nodeID = cLeaves[i].nodeID;
+      leaf->leafIndex = i;
+      leaf->isLeaf = true;
+      leaf->tree = this;
+
+      leaf->bbox.SetMin(cLeaves[i].bboxMin.x, cLeaves[i].bboxMin.y, cLeaves[i].bboxMin.z);
+      leaf->bbox.SetMax(cLeaves[i].bboxMax.x, cLeaves[i].bboxMax.y, cLeaves[i].bboxMax.z);
+      leaf->bbox.SetVertices();
+
+      if(cLeaves[i].firstTriangle >= 0 && cLeaves[i].nTriangles >= 0 &&
+         cLeaves[i].firstTriangle + cLeaves[i].nTriangles <= nLeafTriangles) {
+         leaf->nTriangles = cLeaves[i].nTriangles;
+         leaf->triangles = &leafTriangles[cLeaves[i].firstTriangle];
+      }
+
+      leaf->PVS.SetStorage(&pvsBits[i * header->pvsRowWords], nLeaves);
+      if(cLeaves[i].pvsOffset + cLeaves[i].pvsSize > header->pvsSize ||
+         !leaf->PVS.DecompressRLE(pvs + cLeaves[i].pvsOffset, cLeaves[i].pvsSize)) {
+         printf("Leaf %d: bad pvs row. Leaf will see nothing but itself\n", i);
+         leaf->PVS.ClearAll();
+         leaf->PVS.Set(i);
+      }
+
+      leaves.push_back(leaf);
+   }
+
+   printf("%d leaves, %d triangles\n", nLeaves, nLeafTriangles);
+
+   return true;
+}
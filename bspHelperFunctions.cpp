@@ -1,5 +1,7 @@
 #include "bspHelperFunctions.h"
 
+#include <fstream>
+
 bool
 PointInTriangle(C_Vertex* point , triangle_vn *triangle)
 {
@@ -178,6 +180,20 @@ ClassifyVertex(C_Plane *plane , C_Vertex *vertex)
    }
 }
 
+int
+ClassifyVertex(const bspFlatNode_t *node, C_Vertex *vertex)
+{
+   float dist = node->a * vertex->x + node->b * vertex->y + node->c * vertex->z + node->d;
+
+   if(FLOAT_EQ(dist, 0.0f)) {
+      return COINCIDENT;
+   } else if(dist > EPSILON) {
+      return FRONT;
+   } else {
+      return BACK;
+   }
+}
+
 int
 ClassifyPolygon(C_Plane *plane, poly_t *polygon)
 {
@@ -205,7 +221,7 @@ ClassifyPolygon(C_Plane *plane, poly_t *polygon)
 }
 
 void
-SplitPolygon(C_Plane *plane , poly_t *polygon , poly_t **front , poly_t **back)
+SplitPolygon(C_Plane *plane , poly_t *polygon , poly_t **front , poly_t **back, C_PolygonArena *arena)
 {
    vector<C_Vertex> newFront;
    vector<C_Vertex> newBack;
@@ -249,10 +265,7 @@ SplitPolygon(C_Plane *plane , poly_t *polygon , poly_t **front , poly_t **back)
       sideA = sideB;
    }
 
-   *front = new poly_t();
-   (*front)->nVertices = newFront.size();
-   (*front)->pNorms = new C_Vertex[(*front)->nVertices];
-   (*front)->pVertices = new C_Vertex[(*front)->nVertices];
+   *front = arena->NewPolygon(newFront.size());
    (*front)->usedAsDivider = polygon->usedAsDivider;
 
    for(i = 0 ; i < (*front)->nVertices ; i++) {
@@ -265,10 +278,7 @@ SplitPolygon(C_Plane *plane , poly_t *polygon , poly_t **front , poly_t **back)
       (*front)->pNorms[i].z = polygon->pNorms[0].z;
    }
 
-   *back = new poly_t();
-   (*back)->nVertices = newBack.size();
-   (*back)->pNorms = new C_Vertex[(*back)->nVertices];
-   (*back)->pVertices = new C_Vertex[(*back)->nVertices];
+   *back = arena->NewPolygon(newBack.size());
    (*back)->usedAsDivider = polygon->usedAsDivider;
 
    for(i = 0 ; i < (*back)->nVertices ; i++) {
@@ -281,3 +291,41 @@ SplitPolygon(C_Plane *plane , poly_t *polygon , poly_t **front , poly_t **back)
       (*back)->pNorms[i].z = polygon->pNorms[0].z;
    }
 }
+
+float
+InverseDirection(float d)
+{
+   return 1.0f / (fabs(d) < 1.0e-12f ? 1.0e-12f : d);
+}
+
+uint32_t
+FNV1a(const void *data, size_t size, uint32_t hash)
+{
+   const unsigned char *bytes = (const unsigned char *)data;
+
+   for(size_t i = 0; i < size; i++) {
+      hash ^= bytes[i];
+      hash *= 16777619u;
+   }
+
+   return hash;
+}
+
+bool
+FileChecksum(const char *fileName, uint32_t *checksum)
+{
+   char buffer[64 * 1024];
+
+   ifstream file(fileName, ios::in | ios::binary);
+   if(!file.is_open()) {
+      return false;
+   }
+
+   *checksum = FNV1A_INITIAL;
+   while(file) {
+      file.read(buffer, sizeof(buffer));
+      *checksum = FNV1a(buffer, file.gcount(), *checksum);
+   }
+
+   return true;
+}
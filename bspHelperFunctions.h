@@ -4,6 +4,10 @@
 #include "bspNode.h"
 #include "bspTree.h"
 
+#include <stdint.h>
+
+#define FNV1A_INITIAL   2166136261u
+
 void CalculateUV(C_Plane* plane , C_Vertex* P , float* u , float* v);
 vector<C_Vertex> FindBBoxPlaneIntersections(C_BBox* bbox, C_Plane* plane);
 
@@ -12,12 +16,23 @@ vector<C_Vertex> FindBBoxPlaneIntersections(C_BBox* bbox, C_Plane* plane);
 C_Vertex FindIntersectionPoint(C_Vertex *ptA , C_Vertex *ptB , C_Plane *plane);
 bool FindIntersectionPoint_withCheck(C_Vertex *ptA, C_Vertex *ptB, C_Plane *plane, C_Vertex* intePoint);
 bool PointInTriangle(C_Vertex* points, triangle_vn *triangle);
+/// Sets outside[i] for the points C_BBox::IsInside would reject (see bspTriangleQuery.cpp)
+void PointsOutsideBBox(C_BBox *bbox, const C_Vertex *points, int nPoints, unsigned char *outside);
 bool RayTriangleIntersection(C_Vertex* p1 , C_Vertex* p2 , triangle_vn *triangle);
 /// Tests a vertex against a plane whether it is in FRONT, BACK or COINCIDENT
 int ClassifyVertex(C_Plane *plane, C_Vertex *vertex);
+/// Same as above against a flat node's partition plane
+int ClassifyVertex(const bspFlatNode_t *node, C_Vertex *vertex);
 /// Tests if polygon is in front, back, coincident or it spans the given plane
 int ClassifyPolygon(C_Plane *plane, poly_t *polygon);
-/// Splits the given polygon in two new polygon. The polygon must be spanning the plane given
-void SplitPolygon(C_Plane *plane, poly_t *polygon, poly_t **front, poly_t **back);
+/// Splits the given polygon in two new polygon. The polygon must be spanning the plane given.
+/// The new polygons are allocated from arena
+void SplitPolygon(C_Plane *plane, poly_t *polygon, poly_t **front, poly_t **back, C_PolygonArena *arena);
+/// 1 / d for line vs box slab tests. d is clamped away from 0 so the tests never produce NaNs
+float InverseDirection(float d);
+/// 32bit FNV-1a hash of size bytes. Pass FNV1A_INITIAL or a previous result as hash
+uint32_t FNV1a(const void *data, size_t size, uint32_t hash);
+/// FNV-1a hash of a whole file. Returns false if the file can't be read
+bool FileChecksum(const char *fileName, uint32_t *checksum);
 
 #endif
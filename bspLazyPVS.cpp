@@ -0,0 +1,285 @@
+#include "bspTree.h"
+#include "bspNode.h"
+#include "threadPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/**
+ * Lazy PVS.
+ * When there's no PVS file the game doesn't wait for the whole PVS to be traced. Every leaf
+ * starts out seeing every other one (only frustum culling is left) and the rows are traced
+ * by a background thread, the leaf the camera is in and its neighbours first.
+ *
+ * Every row is traced on its own so it can be used as soon as it is done: starting from the
+ * leaf's connected leaves, the connected leaves of every leaf found visible are checked in
+ * turn (flood fill through the visible leaves). A row is published with a release store of
+ * its leaf's PVSReady flag, drawing reads PVSReady with acquire semantics before touching the row.
+ *
+ * A row traced on its own misses the leaves that only became reachable through leaves that
+ * found it visible, which TraceVisibility gets by keeping the sets symmetric. Once all rows
+ * are served CompleteLazyPVS makes them symmetric and floods on from the leaves gained until
+ * nothing changes, so the PVS written to the file is the one TraceVisibility builds. Rows in
+ * use only gain bits, set atomically, and drawing tests them with TestAtomic.
+ */
+
+int
+C_BspTree::FloodLazyPVSRow(C_BspNode *leaf, C_BspNode **visible, int nVisible, bool symmetric)
+{
+   C_BitSet &tested = lazyPVSTested[leaf->leafIndex];
+   int nAdded = 0;
+
+   for(int v = 0; v < nVisible; v++) {
+      if(__atomic_load_n(&lazyPVSAbort, __ATOMIC_ACQUIRE)) {
+         return -1;
+      }
+
+      const vector<C_BspNode *> &neighbours = visible[v]->connectedLeaves;
+      for(unsigned int i = 0; i < neighbours.size(); i++) {
+         C_BspNode *candidate = neighbours[i];
+
+         if(tested.Test(candidate->leafIndex)) {
+            continue;
+         }
+         tested.Set(candidate->leafIndex);
+
+         /// Already traced from the other side. The rows are symmetric by then
+         if(symmetric && lazyPVSTested[candidate->leafIndex].Test(leaf->leafIndex)) {
+            continue;
+         }
+
+         if(CheckVisibility(leaf, candidate)) {
+            leaf->PVS.TestAndSetAtomic(candidate->leafIndex);
+            if(symmetric) {
+               candidate->PVS.TestAndSetAtomic(leaf->leafIndex);
+               lazyPVSTested[candidate->leafIndex].Set(leaf->leafIndex);
+            }
+            visible[nVisible++] = candidate;
+            nAdded++;
+         }
+      }
+   }
+
+   return nAdded;
+}
+
+int
+C_BspTree::NextLazyPVSRow(void)
+{
+   int row = __atomic_load_n(&lazyPVSCameraLeaf, __ATOMIC_RELAXED);
+
+   /// The camera's leaf and its neighbours first
+   if(row >= 0) {
+      if(!lazyPVSClaimed.TestAndSetAtomic(row)) {
+         return row;
+      }
+
+      const vector<C_BspNode *> &neighbours = leaves[row]->connectedLeaves;
+      for(unsigned int i = 0; i < neighbours.size(); i++) {
+         if(!lazyPVSClaimed.TestAndSetAtomic(neighbours[i]->leafIndex)) {
+            return neighbours[i]->leafIndex;
+         }
+      }
+   }
+
+   /// Then the rest in leaf order
+   while((row = __atomic_fetch_add(&lazyPVSNextRow, 1, __ATOMIC_RELAXED)) < nLeaves) {
+      if(!lazyPVSClaimed.TestAndSetAtomic(row)) {
+         return row;
+      }
+   }
+
+   return -1;
+}
+
+void
+C_BspTree::LazyPVSRow_Task(void *data, int tid)
+{
+   C_BspTree *tree = (C_BspTree *)data;
+
+   if(__atomic_load_n(&tree->lazyPVSAbort, __ATOMIC_ACQUIRE)) {
+      return;
+   }
+
+   int row = tree->NextLazyPVSRow();
+   if(row < 0) {
+      return;
+   }
+
+   C_BspNode *leaf = tree->leaves[row];
+   C_BitSet &tested = tree->lazyPVSTested[row];
+   C_BspNode **visible = new C_BspNode *[tree->nLeaves];
+   int nVisible = 0;
+   unsigned int i;
+
+   /// Connected leaves are already in the PVS
+   tested.Resize(tree->nLeaves);
+   tested.Set(row);
+   for(i = 0; i < leaf->connectedLeaves.size(); i++) {
+      tested.Set(leaf->connectedLeaves[i]->leafIndex);
+      visible[nVisible++] = leaf->connectedLeaves[i];
+   }
+
+   /// Leaves without sample points are visible from everywhere (see CheckVisibility)
+   for(int l = 0; l < tree->nLeaves; l++) {
+      if(!tested.Test(l) && !tree->leaves[l]->pointSet.size()) {
+         tested.Set(l);
+         leaf->PVS.Set(l);
+         visible[nVisible++] = tree->leaves[l];
+      }
+   }
+
+   int nAdded = tree->FloodLazyPVSRow(leaf, visible, nVisible, false);
+   delete[] visible;
+
+   if(nAdded < 0) {
+      return;
+   }
+
+   __atomic_store_n(&leaf->PVSReady, true, __ATOMIC_RELEASE);
+}
+
+void *
+C_BspTree::LazyPVS_Thread(void *data)
+{
+   C_BspTree *tree = (C_BspTree *)data;
+   timeval start, end;
+   int i;
+
+   gettimeofday(&start, NULL);
+
+   /// Every task traces whichever row is most urgent when it runs
+   if(MAX_THREADS > 1) {
+      C_ThreadPool pool(MAX_THREADS);
+
+      for(i = 0; i < tree->nLeaves; i++) {
+         pool.addTask(LazyPVSRow_Task, tree);
+      }
+
+      pool.wait();
+   } else {
+      for(i = 0; i < tree->nLeaves; i++) {
+         LazyPVSRow_Task(tree, 0);
+      }
+   }
+
+   tree->CompleteLazyPVS();
+   tree->ReleaseTriangleRecords();
+
+   delete[] tree->lazyPVSTested;
+   tree->lazyPVSTested = NULL;
+
+   if(!__atomic_load_n(&tree->lazyPVSAbort, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&tree->lazyPVSComplete, true, __ATOMIC_RELEASE);
+
+      gettimeofday(&end, NULL);
+      double elapsedTime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+      printf("PVS traced in the background (%.2f s)\n", elapsedTime);
+
+      if(tree->lazyPVSFileName.size()) {
+         tree->WritePVSFile(tree->lazyPVSFileName.c_str());
+      }
+   }
+
+   return NULL;
+}
+
+void
+C_BspTree::CompleteLazyPVS(void)
+{
+   C_BspNode **visible = new C_BspNode *[nLeaves];
+   int a, b, nAdded;
+
+   /// Symmetric like the sets TraceVisibility builds
+   for(a = 0; a < nLeaves && !__atomic_load_n(&lazyPVSAbort, __ATOMIC_ACQUIRE); a++) {
+      for(b = leaves[a]->PVS.NextSetBit(0); b >= 0; b = leaves[a]->PVS.NextSetBit(b + 1)) {
+         leaves[b]->PVS.TestAndSetAtomic(a);
+         lazyPVSTested[b].Set(a);
+      }
+   }
+
+   /// Flood every row on from all its visible leaves. Only the neighbours of the leaves
+   /// gained are still untested. Every sweep may add leaves to rows already swept
+   do {
+      nAdded = 0;
+      for(a = 0; a < nLeaves; a++) {
+         int nVisible = 0;
+         for(b = leaves[a]->PVS.NextSetBit(0); b >= 0; b = leaves[a]->PVS.NextSetBit(b + 1)) {
+            visible[nVisible++] = leaves[b];
+         }
+
+         int n = FloodLazyPVSRow(leaves[a], visible, nVisible, true);
+         if(n < 0) {
+            delete[] visible;
+            return;
+         }
+         nAdded += n;
+      }
+   } while(nAdded);
+
+   delete[] visible;
+}
+
+void
+C_BspTree::BuildLazyPVS(const char *filename)
+{
+	printf("%s\n", __FUNCTION__);
+
+	pvsMethod = PVS_RAY_SAMPLING;
+	if(filename && ReadPVSFile(filename)) {
+		cout << "PVS found in file." << endl << endl;
+		return;
+	}
+
+	cout << "Building PVS in the background..." << endl;
+	PrepareTriangleRecords();
+	cout << "\tDistributing sample points... " << flush;
+	DistributeSamplePoints();
+	cout << "Done!" << endl;
+
+	/// Only the connected leaves and the cleaned up sample points are needed
+	PrepareVisibilityTracing();
+	ReleaseVisibilityTracing();
+
+	allLeaves.Resize(nLeaves);
+	for(int i = 0; i < nLeaves; i++) {
+		allLeaves.Set(i);
+		leaves[i]->PVSReady = false;
+	}
+
+	lazyPVSClaimed.Resize(nLeaves);
+	lazyPVSNextRow = 0;
+	lazyPVSComplete = false;
+	lazyPVSAbort = false;
+	lazyPVSTested = new C_BitSet[nLeaves];
+	lazyPVSFileName = filename ? filename : "";
+
+	if(pthread_create(&lazyPVSThread, NULL, LazyPVS_Thread, (void *)this)) {
+		printf("Could not create new thread.\n");
+		abort();
+	}
+
+	lazyPVSRunning = true;
+}
+
+void
+C_BspTree::StopLazyPVS(bool abortTracing)
+{
+   if(!lazyPVSRunning) {
+      return;
+   }
+
+   if(abortTracing) {
+      __atomic_store_n(&lazyPVSAbort, true, __ATOMIC_RELEASE);
+   }
+
+   pthread_join(lazyPVSThread, NULL);
+   lazyPVSRunning = false;
+}
+
+bool
+C_BspTree::IsPVSComplete(void)
+{
+   return !lazyPVSRunning || __atomic_load_n(&lazyPVSComplete, __ATOMIC_ACQUIRE);
+}
@@ -1,15 +1,19 @@
 #include "bspNode.h"
 #include "bspTree.h"
 #include "bspHelperFunctions.h"
-#include <GL/glut.h>
+#include "threadPool.h"
+#include "polygonArena.h"
 
 #include <stdio.h>
 
 #define MINIMUMRELATION			0.5f
 #define MINIMUMRELATIONSCALE	2.0f
 
-#define NPOINTS_U 5
-#define NPOINTS_V 5
+/// Subtrees with less polygons than this are not worth a task of their own
+#define PARALLEL_BUILD_MIN_POLYS 32
+
+/// Nodes with more polygons than this score the candidate planes on a sample
+#define PARTITION_SAMPLE_THRESHOLD 2048
 
 C_BspNode::C_BspNode(void)
 {
@@ -25,8 +29,12 @@ C_BspNode::C_BspNode(void)
    depth = 0;
    nTriangles = 0;
    triangles = NULL;
-   checkedVisibilityWith = NULL;
-   visibleFrom = NULL;
+   isConvexRoom = false;
+   tree = NULL;
+   leafIndex = -1;
+   PVSOrder = NULL;
+   nPVSOrder = 0;
+   PVSReady = true;
 }
 
 C_BspNode::C_BspNode(poly_t** geometry , int nPolys)
@@ -43,8 +51,12 @@ C_BspNode::C_BspNode(poly_t** geometry , int nPolys)
    nTriangles = 0;
    triangles = NULL;
    depth = 0;
-   checkedVisibilityWith = NULL;
-   visibleFrom = NULL;
+   isConvexRoom = false;
+   tree = NULL;
+   leafIndex = -1;
+   PVSOrder = NULL;
+   nPVSOrder = 0;
+   PVSReady = true;
 }
 
 C_BspNode::~C_BspNode()
@@ -54,17 +66,11 @@ C_BspNode::~C_BspNode()
    delete frontNode;
    delete backNode;
 
-   if(checkedVisibilityWith != NULL) {
-      delete[] checkedVisibilityWith;
-   }
-
-   if(visibleFrom != NULL) {
-      delete[] visibleFrom;
-   }
-
    if(triangles)
       delete[] triangles;
 
+   delete[] PVSOrder;
+
    /// Empty the vector
    staticObjects.clear();
 }
@@ -89,41 +95,33 @@ C_BspNode::IsConvex(void)
    return true;
 }
 
+#ifndef BSP_COMPILER
 bool
-C_BspNode::insertStaticObject(staticTreeObject_t *staticMesh, C_Vertex *point)
+C_BspNode::insertStaticObject(staticTreeObject_t *staticMesh)
 {
-   if(!isLeaf) {
-      float side = partitionPlane.distanceFromPoint(point);
+   assert(isLeaf);
 
-      if(FLOAT_EQ(side, 0.0f) || side >= 0.0f) {
-         if(frontNode)
-           return frontNode->insertStaticObject(staticMesh, point);
-         else
-            return false;
-      } else {
-         if(backNode)
-            return backNode->insertStaticObject(staticMesh, point);
-         else
-            return false;
-      }
-   } else {
-      for(unsigned int i = 0; i < staticObjects.size(); ++i) {
-         if(staticObjects[i]->meshID == staticMesh->meshID) {
-            return false;
-         }
+   for(unsigned int i = 0; i < staticObjects.size(); ++i) {
+      if(staticObjects[i]->meshID == staticMesh->meshID) {
+         return false;
       }
-
-      staticObjects.push_back(staticMesh);
-      return true;
    }
-}
 
-void
-C_BspNode::BuildBspTree(C_BspTree *tree)
+   staticObjects.push_back(staticMesh);
+   return true;
+}
+#endif
+
+/**
+ * Picks a splitting plane and distributes the node's geometry to two new child nodes.
+ * Returns false if the node is a leaf.
+ * Apart from the split counter no shared tree state is touched, so independent
+ * subtrees can be split from different threads. Node ids and the leaves list are
+ * filled in afterwards by C_BspTree::CollectLeaves.
+ */
+bool
+C_BspNode::SplitNode(C_PolygonArena *arena)
 {
-   static int ID = 0;
-   bool isConvex;
-   this->tree = tree;
    C_Plane tempPlane;
 
    assert(tree);
@@ -132,24 +130,12 @@ C_BspNode::BuildBspTree(C_BspTree *tree)
    /// An i geometria dimiourgei kleisto horo
    /// i an ehei ftasei arketa bathia sto dendro
    /// tote einai katalili gia filo sto dentro
-   if((isConvex = IsConvex()) || depth == tree->maxDepth || nPolys < 5) {
-      tree->nConvexRooms += (int)isConvex;
+   if((isConvexRoom = IsConvex()) || depth == tree->maxDepth || nPolys < 5) {
       isLeaf = true;
-      tree->nLeaves++;
-      tree->leaves.push_back(this);
-
-      if(depth > tree->depthReached) {
-         tree->depthReached = depth;
-      }
-
-      if(nPolys < tree->lessPolysInNodeFound) {
-         tree->lessPolysInNodeFound = nPolys;
-      }
-
 
       /// Calculate leaf's bbox
       CalculateBBox();
-      return;
+      return false;
    }
 
 
@@ -160,15 +146,17 @@ C_BspNode::BuildBspTree(C_BspTree *tree)
    frontNode = new C_BspNode();
    frontNode->depth = depth + 1;
    frontNode->fatherNode = this;
+   frontNode->tree = tree;
    frontNode->partitionPlane.setPlane(&tempPlane);
 
    backNode = new C_BspNode();
    backNode->depth = depth + 1;
    backNode->fatherNode = this;
+   backNode->tree = tree;
    backNode->partitionPlane.setPlane(&tempPlane);
 
-   int result, nFront, nBack, i;
-   nFront = nBack = 0;
+   int result, nFront, nBack, nSplits, i;
+   nFront = nBack = nSplits = 0;
 
    /// Classify all polygons in this node
    for(i = 0; i < nPolys; i++) {
@@ -186,19 +174,14 @@ C_BspNode::BuildBspTree(C_BspTree *tree)
       }
    }
 
-   nodeID = ID++;
-
    /// Allocate memory
-   backNode->geometry = nBack ? new poly_t *[nBack] : NULL;
+   backNode->geometry = nBack ? arena->NewPolygonList(nBack) : NULL;
    backNode->nPolys = nBack;
-   backNode->nodeID = ID++;
 
-   frontNode->geometry = nFront ? new poly_t *[nFront] : NULL;
+   frontNode->geometry = nFront ? arena->NewPolygonList(nFront) : NULL;
    frontNode->nPolys = nFront;
-   frontNode->nodeID = ID++;
 
    nFront = nBack = 0;
-   tree->nNodes = ID;
 
    /// Distribute the geometry to the two new nodes
    for(i = 0; i < nPolys; i++) {
@@ -211,8 +194,8 @@ C_BspNode::BuildBspTree(C_BspTree *tree)
          backNode->geometry[nBack] = geometry[i];
          ++nBack;
       } else if(result == INTERSECTS) {
-         SplitPolygon(&partitionPlane , geometry[i] , &frontNode->geometry[nFront] , &backNode->geometry[nBack]);
-         tree->nSplits++;
+         SplitPolygon(&partitionPlane , geometry[i] , &frontNode->geometry[nFront] , &backNode->geometry[nBack], arena);
+         ++nSplits;
          ++nFront;
          ++nBack;
       } else if(result == COINCIDENT) {
@@ -221,23 +204,65 @@ C_BspNode::BuildBspTree(C_BspTree *tree)
       }
    }
 
+   if(nSplits) {
+      __sync_fetch_and_add(&tree->nSplits, nSplits);
+   }
+
    /// Calculate node's bbox
    CalculateBBox();
 
-   if(nFront) {
-      frontNode->BuildBspTree(tree);
+   /// The geometry now lives in the children. The list itself is released along with
+   /// the build arenas (or by the tree for the head node).
+   geometry = NULL;
 
-      if(frontNode->isLeaf == false) {
-         delete[] frontNode->geometry;
-         frontNode->geometry = NULL;
-      }
+   return true;
+}
+
+void
+C_BspNode::BuildBspTree(C_BspTree *tree, C_PolygonArena *arena)
+{
+   this->tree = tree;
+
+   if(!SplitNode(arena)) {
+      return;
+   }
+
+   if(frontNode->nPolys) {
+      frontNode->BuildBspTree(tree, arena);
+   }
+   if(backNode->nPolys) {
+      backNode->BuildBspTree(tree, arena);
+   }
+}
+
+/**
+ * Worker pool version of BuildBspTree.
+ * Big subtrees are queued as new tasks, small ones are built in place.
+ */
+void
+C_BspNode::BuildBspTree_Task(void *data, int tid)
+{
+   C_BspNode *node = (C_BspNode *)data;
+   C_BspNode *children[2];
+
+   C_PolygonArena *arena = &node->tree->buildArenas[tid];
+
+   if(!node->SplitNode(arena)) {
+      return;
    }
-   if(nBack) {
-      backNode->BuildBspTree(tree);
 
-      if(backNode->isLeaf == false) {
-         delete[] backNode->geometry;
-         backNode->geometry = NULL;
+   children[0] = node->frontNode;
+   children[1] = node->backNode;
+
+   for(int i = 0; i < 2; i++) {
+      if(!children[i]->nPolys) {
+         continue;
+      }
+
+      if(children[i]->nPolys >= PARALLEL_BUILD_MIN_POLYS) {
+         node->tree->buildPool->addTask(BuildBspTree_Task, children[i]);
+      } else {
+         children[i]->BuildBspTree(node->tree, arena);
       }
    }
 }
@@ -246,11 +271,8 @@ bool
 C_BspNode::SelectPartitionfromList(C_Plane* finalPlane)
 {
    unsigned int nFront, nBack, nSplits, bestPlane = 0, bestSplits = INT_MAX;
-   int currentPlane, i, result;
-   C_Plane tempPlane;
+   int currentPlane, i, j, result, step;
    bool found = false;
-//   poly_t **geometry = node->geometry;
-//   int nPolys = node->nPolys;
 
    float relation, bestRelation, minRelation;
    bestRelation = 0.0f;
@@ -258,25 +280,35 @@ C_BspNode::SelectPartitionfromList(C_Plane* finalPlane)
 
    assert(nPolys);
 
-   while(!found) {
-      for(currentPlane = 0; currentPlane < nPolys; currentPlane++) {
-         if(geometry[currentPlane]->usedAsDivider == true)
-            continue;
+   /// Most walls share a handful of planes. Every polygon lying on the same plane
+   /// gets exactly the same score so each distinct plane is scored only once.
+   vector<C_Plane> planes;
+   vector<partitionScore_t> scores;
+   int *planeOfPoly = new int[nPolys];
 
-         nBack = nFront = nSplits = 0;
-         tempPlane = C_Plane(&(geometry[currentPlane]->pVertices[0]),
-                             &(geometry[currentPlane]->pVertices[1]),
-                             &(geometry[currentPlane]->pVertices[2]));
+   /// On very big nodes only a fixed number of evenly spaced polygons is classified
+   step = nPolys > PARTITION_SAMPLE_THRESHOLD ? nPolys / PARTITION_SAMPLE_THRESHOLD + 1 : 1;
+
+   for(currentPlane = 0; currentPlane < nPolys; currentPlane++) {
+      planeOfPoly[currentPlane] = -1;
+      if(geometry[currentPlane]->usedAsDivider == true)
+         continue;
 
-//         printf("(%f %f %f) - (%f %f %f) - (%f %f %f)\n",
-//         geometry[currentPlane]->pVertices[0].x, geometry[currentPlane]->pVertices[0].y, geometry[currentPlane]->pVertices[0].z,
-//         geometry[currentPlane]->pVertices[1].x, geometry[currentPlane]->pVertices[1].y, geometry[currentPlane]->pVertices[1].z,
-//         geometry[currentPlane]->pVertices[2].x, geometry[currentPlane]->pVertices[2].y, geometry[currentPlane]->pVertices[2].z);
+      C_Plane tempPlane(&(geometry[currentPlane]->pVertices[0]),
+                        &(geometry[currentPlane]->pVertices[1]),
+                        &(geometry[currentPlane]->pVertices[2]));
+
+      for(j = 0; j < (int)planes.size(); j++) {
+         if(FLOAT_EQ(planes[j].a, tempPlane.a) && FLOAT_EQ(planes[j].b, tempPlane.b) &&
+            FLOAT_EQ(planes[j].c, tempPlane.c) && FLOAT_EQ(planes[j].d, tempPlane.d))
+            break;
+      }
 
-         for(i = 0; i < nPolys; i++) {
-            if(i == currentPlane)
-               continue;
+      if(j == (int)planes.size()) {
+         nBack = nFront = nSplits = 0;
 
+         for(i = 0; i < nPolys; i += step) {
+            /// Polygons on the plane are coincident, including the candidate itself
             result = ClassifyPolygon(&tempPlane , geometry[i]);
 
             if(result == FRONT) {
@@ -288,148 +320,50 @@ C_BspNode::SelectPartitionfromList(C_Plane* finalPlane)
             }
          }
 
-         relation = (float)MIN(nFront, nBack) / (float)MAX(nFront, nBack);
-//			printf("bestSplits: %u\n", bestSplits);
-//			printf("nFront: %u\n", nFront);
-//			printf("nBack: %u\n", nBack);
-//			printf("nSplits: %u\n", nSplits);
-//			printf("relation: %f\n", relation);
-//			printf("minRelation: %f\n", minRelation);
-//			printf("bestRelation: %f\n", bestRelation);
+         partitionScore_t score;
+         score.nSplits = nSplits;
+         score.relation = (float)MIN(nFront, nBack) / (float)MAX(nFront, nBack);
+
+         planes.push_back(tempPlane);
+         scores.push_back(score);
+      }
+
+      planeOfPoly[currentPlane] = j;
+   }
+
+   /// Same selection as before but run on the cached scores
+   while(!found) {
+      for(currentPlane = 0; currentPlane < nPolys; currentPlane++) {
+         if(planeOfPoly[currentPlane] < 0)
+            continue;
+
+         nSplits = scores[planeOfPoly[currentPlane]].nSplits;
+         relation = scores[planeOfPoly[currentPlane]].relation;
 
          if((relation > minRelation && nSplits < bestSplits) || (nSplits == bestSplits && relation > bestRelation) ||
              (FLOAT_EQ(minRelation, 0.0f) && nSplits)) {
-            finalPlane->setPlane(&tempPlane);
             bestSplits = nSplits;
             bestRelation = relation;
             bestPlane = currentPlane;
             found = true;
-//            printf("\n---------------\n");
          }
       }
 
-//		printf("******************\n");
       /// An ehoun dokimastei ola ta polygona kai den ehei brethei akoma epipedo diahorismou
       /// halarose ligo ta kritiria kai ksanapsakse
       minRelation /= MINIMUMRELATIONSCALE;
-//      if(FLOAT_EQ(minRelation, 0.0f))
-//         printf("Warning!\n");
-   }
-
-   geometry[bestPlane]->usedAsDivider = true;
-   // Keep plane's information so we can draw it
-//   debug.push_back(finalPlane->points[0]);
-//   debug.push_back(finalPlane->points[1]);
-//   debug.push_back(finalPlane->points[2]);
-
-   return found;
-}
-
-void
-C_BspNode::Draw(C_Camera *camera, C_BspTree* tree, bool usePVS)
-{
-//   static unsigned long leaf = 0;
-
-   if(!isLeaf) {
-      C_Vector3 cameraPosition = camera->GetPosition();
-      float side = partitionPlane.distanceFromPoint(&cameraPosition);
-
-      if(side > 0.0f) {
-         if(!usePVS) {
-            if(backNode)
-               backNode->Draw(camera, tree, usePVS);
-         }
-         if(frontNode)
-            frontNode->Draw(camera, tree, usePVS);
-      } else {
-         if(!usePVS) {
-            if(frontNode)
-               frontNode->Draw(camera, tree, usePVS);
-         }
-         if(backNode)
-            backNode->Draw(camera, tree, usePVS);
-      }
-   } else {
-      tree->statistics.totalLeaves += PVS.size();
-
-//      if(nodeID != leaf) {
-//         printf("entered leaf: %lu\n", nodeID);
-//         leaf = nodeID;
-//      }
-
-//      glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-//      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-      Draw(camera);
-      if(DRAW_BSP_GEOMETRY) {
-         bbox.Draw(1.0f, 1.0f, 0.0f);
-         DrawPointSet();
-      }
-
-//      glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-
-      if(usePVS) {
-         for(unsigned int i = 0 ; i < PVS.size() ; i++) {
-            if(PVS[i]->drawn) {
-               continue;
-            }
-
-            if(ENABLE_BSP_FRUSTUM_CULLING) {
-               if(!camera->frustum->cubeInFrustum(&PVS[i]->bbox)) {
-                  continue;
-               }
-            }
-
-            PVS[i]->Draw(camera);
-            PVS[i]->drawn = true;
-            if(DRAW_BSP_GEOMETRY) {
-               PVS[i]->bbox.Draw();
-            }
-         }
-      }
-   }
-}
-
-void
-C_BspNode::Draw(C_Camera *camera)
-{
-   drawn = true;
-   tree->statistics.totalStaticObjects += staticObjects.size();
-   tree->statistics.leavesDrawn++;
-
-   /// Draw bsp geometry
-   if(DRAW_BSP_GEOMETRY) {
-      glEnableVertexAttribArray(bspShader->verticesAttribLocation);
-      glEnableVertexAttribArray(bspShader->normalsAttribLocation);
-
-      glVertexAttribPointer(bspShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, (3 + 3) * sizeof(float), triangles);
-      glVertexAttribPointer(bspShader->normalsAttribLocation, 3, GL_FLOAT, GL_FALSE, (3 + 3) * sizeof(float), (char *)triangles + 3 * sizeof(float));
-      glDrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
-
-      glDisableVertexAttribArray(bspShader->verticesAttribLocation);
-      glDisableVertexAttribArray(bspShader->normalsAttribLocation);
    }
 
-   if(DRAW_TREE_MESHES) {
-      /// Draw static meshes
-      for(unsigned int i = 0; i < staticObjects.size(); ++i) {
-         tree->statistics.totalTriangles += staticObjects[i]->mesh.nTriangles;
-
-         if(staticObjects[i]->drawn) {
-            continue;
-         }
+   delete[] planeOfPoly;
 
-   //      if(!camera->frustum->cubeInFrustum(&staticObjects[i]->mesh.bbox)) {
-   //         continue;
-   //      }
+   C_Plane bestPartition(&(geometry[bestPlane]->pVertices[0]),
+                         &(geometry[bestPlane]->pVertices[1]),
+                         &(geometry[bestPlane]->pVertices[2]));
+   finalPlane->setPlane(&bestPartition);
 
-         if(staticObjects[i]->mesh.draw(camera)) {
-            tree->statistics.staticObjectsDrawn++;
-            tree->statistics.trianglesDrawn += staticObjects[i]->mesh.nTriangles;
-         }
+   geometry[bestPlane]->usedAsDivider = true;
 
-         staticObjects[i]->drawn = true;
-      }
-   }
+   return found;
 }
 
 void
@@ -535,41 +469,62 @@ C_BspNode::TessellatePolygonsInLeaves(void)
 
    assert(nTriangles == currentTriangle);
 
-   delete[] geometry;
+   /// Polygons are kept in the tree's arenas
    geometry = NULL;
 }
 
+/**
+ * Removes the points outside the node's bbox and/or lying on its triangles.
+ * All the points are classified first and the kept ones are moved down in a single pass,
+ * keeping their order. Only reads the node, so point sets can be cleaned up in parallel.
+ */
 void
 C_BspNode::CleanUpPointSet(vector<C_Vertex>& points, bool testWithBbox, bool testWithGeometry)
 {
-   unsigned int cPoint = 0;
+   int nPoints = points.size();
+
+   if(!nPoints || (!testWithBbox && !testWithGeometry)) {
+      return;
+   }
+
+   vector<unsigned char> rejected(nPoints, 0);
 
-   /// Remove points outside the bbox
    if(testWithBbox) {
-      while(cPoint < points.size()) {
-         if(!bbox.IsInside(&points[cPoint])) {
-            points.erase(points.begin() + cPoint);
-            cPoint--;
-         }
-         cPoint++;
-      }
+      PointsOutsideBBox(&bbox, &points[0], nPoints, &rejected[0]);
    }
 
-   /// Remove points coinciding with the triangles of the given node
-   /// NOTE: VERY BRUTE FORCE WAY. MUST FIND SOMETHING FASTER.
    if(testWithGeometry) {
-      for(int cTri = 0 ; cTri < nTriangles ; cTri++) {
-         cPoint = 0;
-         while(cPoint < points.size()) {
-            if(PointInTriangle(&points[cPoint], &triangles[cTri])) {
-               points.erase(points.begin() + cPoint);
-               cPoint--;
-            }
+      tree->PointsOnLeafGeometry(this, &points[0], nPoints, &rejected[0]);
+   }
 
-            cPoint++;
-         }
+   int kept = 0;
+   for(int i = 0; i < nPoints; i++) {
+      if(!rejected[i]) {
+         points[kept++] = points[i];
       }
    }
+
+   points.resize(kept);
+}
+
+void
+C_BspNode::DistributeSamplePoints_Task(void *data, int tid)
+{
+   C_BspNode *leaf = (C_BspNode *)data;
+
+   leaf->DistributePointsAlongBBox();
+   leaf->CleanUpPointSet(leaf->pointSet, true, true);
+}
+
+void
+C_BspNode::RemoveRedundantPoints_Task(void *data, int tid)
+{
+   C_BspNode *leaf = (C_BspNode *)data;
+   vector<C_BspNode *> &leaves = leaf->tree->leaves;
+
+   for(int j = leaf->PVS.NextSetBit(0); j >= 0; j = leaf->PVS.NextSetBit(j + 1)) {
+      leaves[j]->CleanUpPointSet(leaf->pointSet, false, true);
+   }
 }
 
 //void
@@ -690,36 +645,26 @@ C_BspNode::DistributePointsAlongPlane(C_Plane *plane)
    }
 }
 
-void C_BspNode::DrawPointSet(void)
+/// The entry is claimed first and filled in after, so readers must stop at the first -1
+static inline void
+appendToPVSOrder(C_BspNode *leaf, int index)
 {
-   int n = pointSet.size();
-
-   shaderManager->pushShader(pointShader);
-      pointShader->setUniform4f("u_v4_color", 0.0f, 1.0f, 0.0f, 1.0f);
-
-      pointShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
-      pointShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
-
-      glEnableVertexAttribArray(pointShader->verticesAttribLocation);
-      glVertexAttribPointer(pointShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, &pointSet[0]);
-      glDrawArrays(GL_POINTS, 0, n);
-      glDisableVertexAttribArray(pointShader->verticesAttribLocation);
-   shaderManager->popShader();
+   int slot = __atomic_fetch_add(&leaf->nPVSOrder, 1, __ATOMIC_ACQ_REL);
+   __atomic_store_n(&leaf->PVSOrder[slot], index, __ATOMIC_RELEASE);
 }
 
 bool
 C_BspNode::addNodeToPVS(C_BspNode *node)
 {
-   for(unsigned int i = 0; i < PVS.size(); i++) {
-      if(PVS[i]->nodeID == node->nodeID)
-         return false;
-   }
+   /// Each side is appended by whoever sets its bit so no entry is added twice,
+   /// even if node->addNodeToPVS(this) runs at the same time
+   if(PVS.TestAndSetAtomic(node->leafIndex))
+      return false;
 
-   PVS.push_back(node);
-   visibleFrom[node->nodeID] = true;
+   appendToPVSOrder(this, node->leafIndex);
 
-   node->PVS.push_back(this);
-   node->visibleFrom[nodeID] = true;
+   if(!node->PVS.TestAndSetAtomic(leafIndex))
+      appendToPVSOrder(node, leafIndex);
 
    return true;
 }
@@ -2,6 +2,7 @@
 #define _C_BSPNODE_H_
 
 #include "bspCommon.h"
+#include "bitSet.h"
 
 class C_BspNode {
 friend class C_BspTree;
@@ -13,24 +14,41 @@ protected:
    bool drawn;
 
    vector<staticTreeObject_t *> staticObjects;
-   bool insertStaticObject(staticTreeObject_t *mesh, C_Vertex *point);
+   /// Adds a static object to the leaf. Returns false if it is already there
+#ifndef BSP_COMPILER
+   bool insertStaticObject(staticTreeObject_t *mesh);
+#endif
 
 public:
    /// Node's ID
    ULONG nodeID;
-
-   vector<C_BspNode*> PVS;
-
+   /// Position in the tree's leaves list. -1 if the node is not a leaf
+   int leafIndex;
+
+   /// Leaves visible from this leaf, indexed by leafIndex
+   C_BitSet PVS;
+   /// Cleared while the row is traced in the background (see C_BspTree::BuildLazyPVS).
+   /// Set with release semantics once PVS holds the whole row
+   bool PVSReady;
+   /// Order the leaves were added to the PVS while it is being traced.
+   /// Visibility tracing walks the PVS in this order. Released once the PVS is built.
+   /// Room for nLeaves entries, unused ones are -1. Appended to by several threads at once
+   int *PVSOrder;
+   int nPVSOrder;
+   /// Portals leading out of this leaf (indices into C_BspTree::portals)
+   vector<int> portals;
 
    USHORT depth;
-   bool *visibleFrom;
-   bool *checkedVisibilityWith;
+   /// Leaves this leaf has already been tested against while tracing visibility
+   C_BitSet checkedVisibilityWith;
 
    /// Plane used to classify the polygons
    C_Plane partitionPlane;
 
    /// If this node is leaf
    bool isLeaf;
+   /// Leaf was created because its geometry is convex
+   bool isConvexRoom;
 
    /// Number of polys in node
    int nPolys;
@@ -60,8 +78,14 @@ public:
    C_BspNode(poly_t** geom , int nPolys);
    ~C_BspNode();
 
+   /// Splits the node in two. Returns false if the node is a leaf.
+   /// New polygons and polygon lists are allocated from arena
+   bool SplitNode(C_PolygonArena *arena);
+
    /// Recursively builds the tree
-   void BuildBspTree(C_BspTree* tree);
+   void BuildBspTree(C_BspTree* tree, C_PolygonArena *arena);
+   /// Same as above but as a C_ThreadPool task. Data is the node to build
+   static void BuildBspTree_Task(void *data, int tid);
 
    /// Calculate node's bbox
    void CalculateBBox(void);
@@ -70,13 +94,21 @@ public:
    void DistributePointsAlongBBox(void);
    void DistributeSamplePoints(vector<C_Vertex>& points);
    void CleanUpPointSet(vector<C_Vertex>& points, bool testWithBbox, bool testWithGeometry);
+   /// Distributes the leaf's sample points along its bbox and cleans them up.
+   /// C_ThreadPool task, data is the leaf
+   static void DistributeSamplePoints_Task(void *data, int tid);
+   /// Removes the leaf's sample points lying on the geometry of the leaves in its PVS.
+   /// C_ThreadPool task, data is the leaf
+   static void RemoveRedundantPoints_Task(void *data, int tid);
+   /// Adds node to the PVS and this leaf to node's PVS. Thread safe.
+   /// Returns false if node was already in the PVS
    bool addNodeToPVS(C_BspNode *node);
 
    void DrawPointSet(void);
 
 
-   void Draw(C_Camera *camera, C_BspTree* tree, bool usePVS);
-   //		static void Draw_PVS(C_Vector3* cameraPosition , C_BspNode* node , C_BspTree* tree);
+   /// Draws the leaf and, if usePVS is set, the leaves in its PVS
+   void DrawLeaf(C_Camera *camera, bool usePVS);
    void Draw(C_Camera *camera);
 
    /// Brakes down CONVEX polygon of 4 or 5 vertices into triangles.
@@ -0,0 +1,37 @@
+#ifndef _BSPPACKET_H_
+#define _BSPPACKET_H_
+
+#include <stdint.h>
+
+#include "globals.h"
+
+/**
+ * Lanes of the packet queries (see bspRayPacket.cpp and bspTriangleQuery.cpp).
+ * Written with the compiler's vector extensions so the same code maps to SSE or AVX
+ * (or NEON on arm) depending on the target and RAY_PACKET_SIZE.
+ */
+typedef float packetFloat_t __attribute__((vector_size(RAY_PACKET_SIZE * sizeof(float))));
+typedef int32_t packetInt_t __attribute__((vector_size(RAY_PACKET_SIZE * sizeof(int32_t))));
+
+#if RAY_PACKET_SIZE > 16
+#  error "RAY_PACKET_SIZE must be 4, 8 or 16"
+#endif
+
+/// Lanes of a packet are kept as bits of an unsigned int
+#define ALL_LANES       ((1u << RAY_PACKET_SIZE) - 1u)
+
+static inline unsigned int
+laneBits(const packetInt_t *mask)
+{
+   unsigned int bits = 0;
+
+   for(int i = 0; i < RAY_PACKET_SIZE; i++) {
+      if((*mask)[i]) {
+         bits |= 1u << i;
+      }
+   }
+
+   return bits;
+}
+
+#endif
@@ -0,0 +1,689 @@
+#include "bspTree.h"
+#include "bspNode.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/**
+ * Portal based PVS.
+ * Instead of casting rays between sample points, visibility is found by flowing through
+ * the openings (portals) between adjacent leaves: a leaf is visible from a source leaf if
+ * there is a line that passes through every portal of a chain leading from the source to it.
+ *
+ * Leaves always span the whole height of the map (closeLeafHoles asserts it) and walls are
+ * vertical, so the problem is solved in 2D on the horizontal plane half way up the map.
+ * Portals are the shared parts of the leaves' bbox faces minus the walls lying on them.
+ *
+ * The result is an approximation. Geometry inside the leaves is ignored, which adds leaves
+ * hidden behind it, and openings are only looked for on the mid plane, so leaves only seen
+ * above or below it would be missed. bspc -r counts both against a brute force reference.
+ *
+ * A line of sight can't cross back over a portal it went through, so past every portal of a
+ * chain the flow only keeps what lies beyond it. Each portal, in each direction, first gets the
+ * leaves that might be seen through it (mightsee): those reached by flooding through the
+ * portals lying at least partly beyond it. A chain can only reach the leaves in the mightsee
+ * sets of all its portals, so the flow stops as soon as they hold nothing the chain's first
+ * portal doesn't already reach.
+ * What the flow from a leaf reaches through each of its portals is kept (portalVis). A line of
+ * sight going through the same portal later can't see more than that, so once the leaf is done
+ * it replaces the much bigger mightsee set. Both flows only approximate the lines of sight, so
+ * this loses a few leaves the longer chain would have reached. The leaves with the smallest
+ * mightsee sets go first.
+ *
+ * The number of chains still grows exponentially with the size of open areas, so every source
+ * leaf only gets PORTAL_FLOW_MAX_STEPS portals to flow through. Past them whatever a chain might
+ * still reach is taken as visible.
+ */
+
+/// A wall crossing the map's mid plane, lying on the plane axis = coord
+typedef struct {
+   float       coord;
+   /// Extent along the other horizontal axis
+   float       lo, hi;
+} portalWall_t;
+
+/// Line on the XZ plane. Normalized so that lineSide() returns the distance from it
+typedef struct {
+   float       nx, nz, d;
+} portalLine_t;
+
+typedef struct {
+   C_BspTree   *tree;
+   int         leaf;
+} portalFlowTask_t;
+
+static bool
+wallLess(const portalWall_t &w1, const portalWall_t &w2)
+{
+   return w1.coord < w2.coord || (!(w2.coord < w1.coord) && w1.lo < w2.lo);
+}
+
+/// Line through points a and b. Returns false if they are the same point
+static bool
+lineThrough(float ax, float az, float bx, float bz, portalLine_t *line)
+{
+   float dx = bx - ax;
+   float dz = bz - az;
+   float length = sqrt(dx * dx + dz * dz);
+
+   if(length < EPSILON) {
+      return false;
+   }
+
+   line->nx = -dz / length;
+   line->nz = dx / length;
+   line->d = -(line->nx * ax + line->nz * az);
+
+   return true;
+}
+
+static inline float
+lineSide(const portalLine_t *line, float x, float z)
+{
+   return line->nx * x + line->nz * z + line->d;
+}
+
+static inline void
+flipLine(portalLine_t *line)
+{
+   line->nx = -line->nx;
+   line->nz = -line->nz;
+   line->d = -line->d;
+}
+
+/// Portals perpendicular to x have the same x at both ends (see newPortal)
+static inline bool
+portalOnX(const bspPortal_t *portal)
+{
+   return FLOAT_EQ(portal->x0, portal->x1);
+}
+
+/// Line of the portal oriented so that leaf (one of its two leaves) is on its positive side
+static void
+portalLine(const bspPortal_t *portal, C_BspNode *leaf, portalLine_t *line)
+{
+   C_Vertex min, max;
+
+   leaf->bbox.GetMin(&min);
+   leaf->bbox.GetMax(&max);
+
+   if(portalOnX(portal)) {
+      line->nx = (min.x + max.x) / 2.0f > portal->x0 ? 1.0f : -1.0f;
+      line->nz = 0.0f;
+      line->d = -line->nx * portal->x0;
+   } else {
+      line->nx = 0.0f;
+      line->nz = (min.z + max.z) / 2.0f > portal->z0 ? 1.0f : -1.0f;
+      line->d = -line->nz * portal->z0;
+   }
+}
+
+/// Keeps the part of the segment on the positive side of the line.
+/// If strict is set, points lying on the line are rejected too.
+/// Returns false if nothing is left
+static bool
+clipSegment(bspPortal_t *seg, const portalLine_t *line, bool strict)
+{
+   float s0 = lineSide(line, seg->x0, seg->z0);
+   float s1 = lineSide(line, seg->x1, seg->z1);
+   bool in0 = strict ? s0 > EPSILON : s0 > -EPSILON;
+   bool in1 = strict ? s1 > EPSILON : s1 > -EPSILON;
+
+   if(!in0 && !in1) {
+      return false;
+   }
+
+   if(in0 != in1) {
+      float t = s0 / (s0 - s1);
+      float x = seg->x0 + t * (seg->x1 - seg->x0);
+      float z = seg->z0 + t * (seg->z1 - seg->z0);
+
+      if(in0) {
+         seg->x1 = x;
+         seg->z1 = z;
+      } else {
+         seg->x0 = x;
+         seg->z0 = z;
+      }
+   }
+
+   float dx = seg->x1 - seg->x0;
+   float dz = seg->z1 - seg->z0;
+
+   return dx * dx + dz * dz > EPSILON * EPSILON;
+}
+
+/// Where the triangle crosses the horizontal plane y. Returns false if it doesn't.
+/// u selects the coordinate returned (0: x, 2: z)
+static bool
+sliceTriangle(const triangle_vn *tri, float y, int u, float *lo, float *hi)
+{
+   const C_Vertex *v[3] = { &tri->vertex0, &tri->vertex1, &tri->vertex2 };
+
+   *lo = GREATEST_FLOAT;
+   *hi = -GREATEST_FLOAT;
+
+   for(int e = 0; e < 3; e++) {
+      const C_Vertex *va = v[e];
+      const C_Vertex *vb = v[(e + 1) % 3];
+      float da = va->y - y;
+      float db = vb->y - y;
+      float ua = u ? va->z : va->x;
+      float ub = u ? vb->z : vb->x;
+
+      if((da > 0.0f && db > 0.0f) || (da < 0.0f && db < 0.0f)) {
+         continue;
+      }
+
+      if(FLOAT_EQ(va->y, vb->y)) {
+         /// Edge lies on the plane
+         *lo = MIN(*lo, MIN(ua, ub));
+         *hi = MAX(*hi, MAX(ua, ub));
+      } else {
+         float p = ua + da / (da - db) * (ub - ua);
+         *lo = MIN(*lo, p);
+         *hi = MAX(*hi, p);
+      }
+   }
+
+   return FLOAT_GREATER(*hi, *lo);
+}
+
+/// Keeps the part of the segment inside bounds. Points on the box's sides are rejected like
+/// clipSegment's strict clip. Returns false if nothing is left
+static bool
+clipSegmentToBounds(bspPortal_t *seg, const bspPortalBounds_t *bounds)
+{
+   portalLine_t line;
+
+   for(int a = 0; a < 2; a++) {
+      if(bounds->min[a] > -GREATEST_FLOAT) {
+         line.nx = a ? 0.0f : 1.0f;
+         line.nz = a ? 1.0f : 0.0f;
+         line.d = -bounds->min[a];
+         if(!clipSegment(seg, &line, true)) {
+            return false;
+         }
+      }
+
+      if(bounds->max[a] < GREATEST_FLOAT) {
+         line.nx = a ? 0.0f : -1.0f;
+         line.nz = a ? -1.0f : 0.0f;
+         line.d = bounds->max[a];
+         if(!clipSegment(seg, &line, true)) {
+            return false;
+         }
+      }
+   }
+
+   return true;
+}
+
+static void
+newPortal(vector<bspPortal_t> &portals, int axis, float coord, float lo, float hi, int leaf1, int leaf2)
+{
+   bspPortal_t portal;
+
+   portal.leaves[0] = leaf1;
+   portal.leaves[1] = leaf2;
+   portal.x0 = axis ? lo : coord;
+   portal.z0 = axis ? coord : lo;
+   portal.x1 = axis ? hi : coord;
+   portal.z1 = axis ? coord : hi;
+
+   portals.push_back(portal);
+}
+
+/**
+ * Splits the open part of a leaf face into portals.
+ * axis is the axis the face is perpendicular to (0: x, 2: z), coord the face's position on
+ * it and [lo, hi] its extent along the other axis. walls must be sorted by wallLess.
+ */
+static void
+addPortals(vector<bspPortal_t> &portals, const vector<portalWall_t> &walls, int axis,
+           float coord, float lo, float hi, int leaf1, int leaf2)
+{
+   portalWall_t key;
+   vector<portalWall_t> blocking;
+
+   key.coord = coord - EPSILON;
+   key.lo = -GREATEST_FLOAT;
+
+   for(vector<portalWall_t>::const_iterator w = lower_bound(walls.begin(), walls.end(), key, wallLess);
+       w != walls.end() && w->coord < coord + EPSILON; ++w) {
+      if(FLOAT_GREATER(w->hi, lo) && FLOAT_SMALLER(w->lo, hi)) {
+         key = *w;
+         key.coord = coord;
+         blocking.push_back(key);
+      }
+   }
+
+   sort(blocking.begin(), blocking.end(), wallLess);
+
+   /// Whatever lies between the walls is open
+   float start = lo;
+   for(unsigned int i = 0; i < blocking.size(); i++) {
+      if(FLOAT_GREATER(blocking[i].lo, start)) {
+         newPortal(portals, axis, coord, start, blocking[i].lo, leaf1, leaf2);
+      }
+
+      start = MAX(start, blocking[i].hi);
+   }
+
+   if(FLOAT_GREATER(hi, start)) {
+      newPortal(portals, axis, coord, start, hi, leaf1, leaf2);
+   }
+}
+
+/**
+ * Finds the portals between all pairs of leaves whose bboxes share part of a face.
+ * Must run after closeLeafHoles so that the leaves are tightly packed.
+ */
+void
+C_BspTree::ExtractPortals(void)
+{
+   int i, j;
+   C_Vertex treeMin, treeMax, min1, max1, min2, max2;
+   vector<portalWall_t> xWalls, zWalls;
+
+   bbox.GetMin(&treeMin);
+   bbox.GetMax(&treeMax);
+   float midY = (treeMin.y + treeMax.y) / 2.0f;
+
+   /// Collect the walls lying on axis aligned planes
+   for(i = 0; i < nLeaves; i++) {
+      C_BspNode *leaf = leaves[i];
+
+      for(j = 0; j < leaf->nTriangles; j++) {
+         const triangle_vn *tri = &leaf->triangles[j];
+         portalWall_t wall;
+
+         if(FLOAT_EQ(tri->vertex0.x, tri->vertex1.x) && FLOAT_EQ(tri->vertex0.x, tri->vertex2.x)) {
+            if(sliceTriangle(tri, midY, 2, &wall.lo, &wall.hi)) {
+               wall.coord = tri->vertex0.x;
+               xWalls.push_back(wall);
+            }
+         } else if(FLOAT_EQ(tri->vertex0.z, tri->vertex1.z) && FLOAT_EQ(tri->vertex0.z, tri->vertex2.z)) {
+            if(sliceTriangle(tri, midY, 0, &wall.lo, &wall.hi)) {
+               wall.coord = tri->vertex0.z;
+               zWalls.push_back(wall);
+            }
+         }
+      }
+   }
+
+   sort(xWalls.begin(), xWalls.end(), wallLess);
+   sort(zWalls.begin(), zWalls.end(), wallLess);
+
+   portals.clear();
+   for(i = 0; i < nLeaves; i++) {
+      leaves[i]->portals.clear();
+   }
+
+   for(i = 0; i < nLeaves; i++) {
+      leaves[i]->bbox.GetMin(&min1);
+      leaves[i]->bbox.GetMax(&max1);
+
+      for(j = i + 1; j < nLeaves; j++) {
+         leaves[j]->bbox.GetMin(&min2);
+         leaves[j]->bbox.GetMax(&max2);
+
+         unsigned int first = portals.size();
+
+         /// Faces perpendicular to x
+         if(FLOAT_EQ(max1.x, min2.x) || FLOAT_EQ(min1.x, max2.x)) {
+            float lo = MAX(min1.z, min2.z);
+            float hi = MIN(max1.z, max2.z);
+            if(FLOAT_GREATER(hi, lo)) {
+               addPortals(portals, xWalls, 0, FLOAT_EQ(max1.x, min2.x) ? max1.x : min1.x, lo, hi, i, j);
+            }
+         }
+
+         /// Faces perpendicular to z
+         if(FLOAT_EQ(max1.z, min2.z) || FLOAT_EQ(min1.z, max2.z)) {
+            float lo = MAX(min1.x, min2.x);
+            float hi = MIN(max1.x, max2.x);
+            if(FLOAT_GREATER(hi, lo)) {
+               addPortals(portals, zWalls, 2, FLOAT_EQ(max1.z, min2.z) ? max1.z : min1.z, lo, hi, i, j);
+            }
+         }
+
+         for(unsigned int p = first; p < portals.size(); p++) {
+            leaves[i]->portals.push_back(p);
+            leaves[j]->portals.push_back(p);
+         }
+      }
+   }
+}
+
+/**
+ * Leaves that might be seen through portal when leaving leaf from: all the leaves reached from
+ * its other side through portals lying at least partly beyond it.
+ * Past a portal the flow only goes through portals strictly beyond it (see clipSegmentToBounds),
+ * so this holds everything the flow can reach. Any point beyond the line is taken here, so
+ * rounding in the clipped portals can't leave a leaf out.
+ */
+void
+C_BspTree::PortalMightsee(int portal, int from)
+{
+   const bspPortal_t *first = &portals[portal];
+   int side = first->leaves[0] == from ? 0 : 1;
+   int into = first->leaves[!side];
+   C_BitSet *mightsee = &portalMightsee[2 * portal + side];
+   vector<int> open;
+   portalLine_t line;
+
+   portalLine(first, leaves[into], &line);
+
+   mightsee->Set(into);
+   open.push_back(into);
+
+   while(open.size()) {
+      int leaf = open.back();
+      open.pop_back();
+
+      for(unsigned int p = 0; p < leaves[leaf]->portals.size(); p++) {
+         const bspPortal_t *next = &portals[leaves[leaf]->portals[p]];
+         int nextLeaf = next->leaves[0] == leaf ? next->leaves[1] : next->leaves[0];
+
+         if(mightsee->Test(nextLeaf)) {
+            continue;
+         }
+
+         if(lineSide(&line, next->x0, next->z0) > 0.0f || lineSide(&line, next->x1, next->z1) > 0.0f) {
+            mightsee->Set(nextLeaf);
+            open.push_back(nextLeaf);
+         }
+      }
+   }
+}
+
+/**
+ * Recursively flows from leaf through its portals marking everything reachable as visible
+ * from source.
+ * sourcePortal is the first portal of the chain and passPortal the (clipped) portal the flow
+ * entered leaf from. Both are NULL for the source leaf itself. bounds is the area beyond all
+ * the portals of the chain.
+ * state->path holds the leaves of the current chain so that it never loops. The leaves the
+ * chain might still reach are in state->mightsee[depth - 1] (all of them for the source leaf).
+ * Leaves reached go to the portalVis set of the chain's first portal, state->reached.
+ */
+void
+C_BspTree::PortalFlow(int source, int leaf, const bspPortal_t *sourcePortal, const bspPortal_t *passPortal,
+                      const bspPortalBounds_t *bounds, int depth, bspPortalFlowState_t *state)
+{
+   portalLine_t passLine, separator;
+   const C_BitSet *mightsee = depth ? state->mightsee[depth - 1] : NULL;
+
+   if((int)state->mightsee.size() == depth) {
+      state->mightsee.push_back(new C_BitSet(nLeaves));
+   }
+   C_BitSet *nextMightsee = state->mightsee[depth];
+
+   state->path.Set(leaf);
+
+   for(unsigned int p = 0; p < leaves[leaf]->portals.size(); p++) {
+      int index = leaves[leaf]->portals[p];
+      const bspPortal_t *portal = &portals[index];
+      int side = portal->leaves[0] == leaf ? 0 : 1;
+      int next = portal->leaves[!side];
+
+      if(state->path.Test(next)) {
+         continue;
+      }
+
+      /// Can't be reached through the portals of the chain
+      if(mightsee && !mightsee->Test(next)) {
+         continue;
+      }
+
+      /// Nothing past the portal the first portal doesn't reach already
+      nextMightsee->ClearAll();
+      if(__atomic_load_n(&portalVisDone[2 * index + side], __ATOMIC_ACQUIRE)) {
+         nextMightsee->Or(&portalVis[2 * index + side]);
+      } else {
+         nextMightsee->Or(&portalMightsee[2 * index + side]);
+      }
+      if(mightsee) {
+         nextMightsee->And(mightsee);
+      }
+
+      if(!depth) {
+         state->reached = &portalVis[2 * index + side];
+      }
+      C_BitSet *reached = state->reached;
+
+      if(reached->Test(next) && !nextMightsee->HasBitsNotIn(reached)) {
+         continue;
+      }
+
+      bspPortal_t target = *portal;
+
+      if(passPortal) {
+         /// Must be beyond all the portals the flow came through
+         if(!clipSegmentToBounds(&target, bounds)) {
+            continue;
+         }
+
+         /// and inside the area seen from the source portal through the pass portal.
+         /// That area is bounded by the lines through one end of each portal
+         /// that leave the two portals on opposite sides
+         if(sourcePortal != passPortal) {
+            const float sx[2] = { sourcePortal->x0, sourcePortal->x1 };
+            const float sz[2] = { sourcePortal->z0, sourcePortal->z1 };
+            const float px[2] = { passPortal->x0, passPortal->x1 };
+            const float pz[2] = { passPortal->z0, passPortal->z1 };
+            bool visible = true;
+
+            for(int s = 0; s < 2 && visible; s++) {
+               for(int ps = 0; ps < 2 && visible; ps++) {
+                  if(!lineThrough(sx[s], sz[s], px[ps], pz[ps], &separator)) {
+                     continue;
+                  }
+
+                  float sourceSide = lineSide(&separator, sx[!s], sz[!s]);
+                  float passSide = lineSide(&separator, px[!ps], pz[!ps]);
+                  if(FLOAT_EQ(sourceSide, 0.0f) || FLOAT_EQ(passSide, 0.0f) || (sourceSide > 0.0f) == (passSide > 0.0f)) {
+                     continue;
+                  }
+
+                  if(passSide < 0.0f) {
+                     flipLine(&separator);
+                  }
+
+                  visible = clipSegment(&target, &separator, false);
+               }
+            }
+
+            if(!visible) {
+               continue;
+            }
+         }
+      }
+
+      /// Next leaf's side of the portal
+      bspPortalBounds_t nextBounds = *bounds;
+      int axis = portalOnX(portal) ? 0 : 1;
+      float coord = axis ? portal->z0 : portal->x0;
+
+      portalLine(portal, leaves[next], &passLine);
+      if((axis ? passLine.nz : passLine.nx) > 0.0f) {
+         nextBounds.min[axis] = MAX(nextBounds.min[axis], coord);
+      } else {
+         nextBounds.max[axis] = MIN(nextBounds.max[axis], coord);
+      }
+
+      reached->Set(next);
+
+      /// Out of steps: whatever the chain might still reach is taken as visible
+      if(++state->steps > PORTAL_FLOW_MAX_STEPS) {
+         reached->Or(nextMightsee);
+         continue;
+      }
+
+      PortalFlow(source, next, sourcePortal ? sourcePortal : &target, &target, &nextBounds, depth + 1, state);
+   }
+
+   state->path.Unset(leaf);
+}
+
+static void
+PortalMightsee_Task(void *data_, int tid)
+{
+   portalFlowTask_t *data = (portalFlowTask_t *)data_;
+   const C_BspNode *leaf = data->tree->leaves[data->leaf];
+
+   /// Only the portals leaving the leaf, so every set is written by one task
+   for(unsigned int p = 0; p < leaf->portals.size(); p++) {
+      data->tree->PortalMightsee(leaf->portals[p], data->leaf);
+   }
+}
+
+static void
+PortalFlow_Task(void *data_, int tid)
+{
+   portalFlowTask_t *data = (portalFlowTask_t *)data_;
+   bspPortalFlowState_t state;
+   bspPortalBounds_t bounds;
+
+   state.path.Resize(data->tree->nLeaves);
+   state.steps = 0;
+   bounds.min[0] = bounds.min[1] = -GREATEST_FLOAT;
+   bounds.max[0] = bounds.max[1] = GREATEST_FLOAT;
+
+   C_BspTree *tree = data->tree;
+   C_BspNode *leaf = tree->leaves[data->leaf];
+
+   tree->PortalFlow(data->leaf, data->leaf, NULL, NULL, &bounds, 0, &state);
+
+   /// Publish what every portal reached for the flows still running
+   for(unsigned int p = 0; p < leaf->portals.size(); p++) {
+      int index = leaf->portals[p];
+      int side = tree->portals[index].leaves[0] == data->leaf ? 0 : 1;
+
+      leaf->PVS.Or(&tree->portalVis[2 * index + side]);
+      __atomic_store_n(&tree->portalVisDone[2 * index + side], true, __ATOMIC_RELEASE);
+   }
+
+   for(unsigned int i = 0; i < state.mightsee.size(); i++) {
+      delete state.mightsee[i];
+   }
+}
+
+/// Leaves and the total size of the mightsee sets of their portals, to flow the smallest ones first
+static bool
+mightseeLess(const pair<int, int> &l1, const pair<int, int> &l2)
+{
+   return l1.second < l2.second;
+}
+
+void
+C_BspTree::PortalVisibility(void)
+{
+   int i, j;
+   timeval start, end;
+   double elapsedTime;
+
+   printf("\tExtracting portals... ");
+   fflush(stdout);
+
+   ExtractPortals();
+
+   printf("Done! (%lu portals)\n", (unsigned long)portals.size());
+
+   printf("\tFlowing through portals... ");
+   fflush(stdout);
+   gettimeofday(&start, NULL);
+
+   for(i = 0; i < nLeaves; i++) {
+      leaves[i]->PVS.ClearAll();
+   }
+
+   int rowWords = C_BitSet::WordsForBits(nLeaves);
+   int nSets = 2 * portals.size();
+   portalMightseeBits = new uint32_t[nSets * rowWords];
+   portalMightsee = new C_BitSet[nSets];
+   portalVisBits = new uint32_t[nSets * rowWords];
+   portalVis = new C_BitSet[nSets];
+   portalVisDone = new bool[nSets];
+   memset(portalMightseeBits, 0, nSets * rowWords * sizeof(uint32_t));
+   memset(portalVisBits, 0, nSets * rowWords * sizeof(uint32_t));
+   for(i = 0; i < nSets; i++) {
+      portalMightsee[i].SetStorage(&portalMightseeBits[i * rowWords], nLeaves);
+      portalVis[i].SetStorage(&portalVisBits[i * rowWords], nLeaves);
+      portalVisDone[i] = false;
+   }
+
+   /// Every source leaf only writes its own PVS row and its portals' portalVis sets so they can all run in parallel
+   portalFlowTask_t *tasks = new portalFlowTask_t[nLeaves];
+   C_ThreadPool *pool = MAX_THREADS > 1 ? new C_ThreadPool(MAX_THREADS) : NULL;
+
+   for(i = 0; i < nLeaves; i++) {
+      tasks[i].tree = this;
+      tasks[i].leaf = i;
+
+      if(pool) {
+         pool->addTask(PortalMightsee_Task, &tasks[i]);
+      } else {
+         PortalMightsee_Task(&tasks[i], 0);
+      }
+   }
+
+   if(pool) {
+      pool->wait();
+   }
+
+   vector<pair<int, int> > order(nLeaves);
+   for(i = 0; i < nLeaves; i++) {
+      order[i].first = i;
+      order[i].second = 0;
+      for(unsigned int p = 0; p < leaves[i]->portals.size(); p++) {
+         int index = leaves[i]->portals[p];
+         order[i].second += portalMightsee[2 * index + (portals[index].leaves[0] == i ? 0 : 1)].Count();
+      }
+   }
+   stable_sort(order.begin(), order.end(), mightseeLess);
+
+   for(i = 0; i < nLeaves; i++) {
+      tasks[i].leaf = order[i].first;
+
+      if(pool) {
+         pool->addTask(PortalFlow_Task, &tasks[i]);
+      } else {
+         PortalFlow_Task(&tasks[i], 0);
+      }
+   }
+
+   if(pool) {
+      pool->wait();
+      delete pool;
+   }
+
+   delete[] tasks;
+   delete[] portalMightsee;
+   delete[] portalMightseeBits;
+   delete[] portalVis;
+   delete[] portalVisBits;
+   delete[] portalVisDone;
+   portalMightsee = NULL;
+   portalMightseeBits = NULL;
+   portalVis = NULL;
+   portalVisBits = NULL;
+   portalVisDone = NULL;
+
+   /// Keep the sets symmetric like the ray traced ones
+   for(i = 0; i < nLeaves; i++) {
+      for(j = leaves[i]->PVS.NextSetBit(0); j >= 0; j = leaves[i]->PVS.NextSetBit(j + 1)) {
+         leaves[j]->PVS.Set(i);
+      }
+   }
+
+   gettimeofday(&end, NULL);
+   elapsedTime = (end.tv_sec - start.tv_sec) * 1000.0;      // sec to ms
+   elapsedTime += (end.tv_usec - start.tv_usec) / 1000.0;   // us to ms
+
+   printf("Done! (%.2f s)\n", elapsedTime / 1000.0);
+}
@@ -0,0 +1,222 @@
+#include "bspTree.h"
+#include "bspNode.h"
+#include "bspHelperFunctions.h"
+#include "bspPacket.h"
+
+#include <string.h>
+
+/**
+ * Packet ray casting used by the PVS ray tracer.
+ * CheckVisibility casts a ray from every sample point of one leaf to every sample point of
+ * the other. Rays leaving the same point are traced together, RAY_PACKET_SIZE at a time:
+ * the packet walks the flat tree once, each node only being visited by the rays that need
+ * it, and every triangle reached is tested against all of the packet's rays at once.
+ *
+ * Triangles are tested with Moller-Trumbore against the records precomputed by
+ * PrepareTriangleRecords, going through the leaf's BVH if it has one. Like
+ * RayTriangleIntersection the rays are treated as lines and the same tolerances are used,
+ * so both give the same answers (up to rounding).
+ */
+
+typedef struct {
+   /// Shared start point
+   float          sx, sy, sz;
+   /// End points and directions (end - start), one per lane
+   packetFloat_t  ex, ey, ez;
+   packetFloat_t  dx, dy, dz;
+   /// 1 / direction (see InverseDirection)
+   packetFloat_t  idx, idy, idz;
+} rayPacket_t;
+
+/// Returns the active lanes whose ray hits one of records first .. first + count - 1
+static unsigned int
+PacketIntersectsRecords(const bspTriangleRecords_t *rec, int first, int count, const rayPacket_t *packet, unsigned int active)
+{
+   unsigned int blocked = 0;
+
+   for(int i = first; i < first + count && blocked != active; i++) {
+      /// Everything depending only on the start point is shared by all the lanes
+      float tx = packet->sx - rec->v0[0][i];
+      float ty = packet->sy - rec->v0[1][i];
+      float tz = packet->sz - rec->v0[2][i];
+      float qx = ty * rec->e1[2][i] - tz * rec->e1[1][i];
+      float qy = tz * rec->e1[0][i] - tx * rec->e1[2][i];
+      float qz = tx * rec->e1[1][i] - ty * rec->e1[0][i];
+
+      packetFloat_t px = packet->dy * rec->e2[2][i] - packet->dz * rec->e2[1][i];
+      packetFloat_t py = packet->dz * rec->e2[0][i] - packet->dx * rec->e2[2][i];
+      packetFloat_t pz = packet->dx * rec->e2[1][i] - packet->dy * rec->e2[0][i];
+
+      packetFloat_t det = px * rec->e1[0][i] + py * rec->e1[1][i] + pz * rec->e1[2][i];
+      packetFloat_t u = (px * tx + py * ty + pz * tz) / det;
+      packetFloat_t v = (packet->dx * qx + packet->dy * qy + packet->dz * qz) / det;
+      /// u + v <= 1 within EPSILON
+      packetFloat_t uv = u + v - 1.0f;
+
+      packetInt_t hit = ((det >= rec->parallel[i]) | (det <= -rec->parallel[i])) &
+                        (u > -EPSILON) & (v > -EPSILON) &
+                        (uv < EPSILON);
+
+      blocked |= laneBits(&hit) & active;
+   }
+
+   return blocked;
+}
+
+/// Returns the lanes whose line crosses the BVH node's box
+static unsigned int
+PacketHitsBox(const bspTriangleBvhNode_t *node, const rayPacket_t *packet)
+{
+   packetFloat_t t0 = (node->min[0] - packet->sx) * packet->idx;
+   packetFloat_t t1 = (node->max[0] - packet->sx) * packet->idx;
+   packetFloat_t tMin = t0 < t1 ? t0 : t1;
+   packetFloat_t tMax = t0 < t1 ? t1 : t0;
+
+   t0 = (node->min[1] - packet->sy) * packet->idy;
+   t1 = (node->max[1] - packet->sy) * packet->idy;
+   packetFloat_t lo = t0 < t1 ? t0 : t1;
+   packetFloat_t hi = t0 < t1 ? t1 : t0;
+   tMin = lo > tMin ? lo : tMin;
+   tMax = hi < tMax ? hi : tMax;
+
+   t0 = (node->min[2] - packet->sz) * packet->idz;
+   t1 = (node->max[2] - packet->sz) * packet->idz;
+   lo = t0 < t1 ? t0 : t1;
+   hi = t0 < t1 ? t1 : t0;
+   tMin = lo > tMin ? lo : tMin;
+   tMax = hi < tMax ? hi : tMax;
+
+   packetInt_t hit = tMin <= tMax;
+   return laneBits(&hit);
+}
+
+/// Returns the active lanes whose ray hits one of the leaf's triangles
+static unsigned int
+PacketIntersectsLeaf(const C_BspTree *tree, const C_BspNode *leaf, const rayPacket_t *packet, unsigned int active)
+{
+   const bspTriangleRecords_t *rec = &tree->triangleRecords;
+   int root = rec->leafBvh[leaf->leafIndex];
+
+   if(root < 0) {
+      return PacketIntersectsRecords(rec, leaf->triangles - tree->leafTriangles, leaf->nTriangles, packet, active);
+   }
+
+   unsigned int blocked = 0;
+   int stack[64], nStack = 0;
+
+   stack[nStack++] = root;
+   while(nStack && blocked != active) {
+      const bspTriangleBvhNode_t *node = &rec->bvhNodes[stack[--nStack]];
+      unsigned int lanes = PacketHitsBox(node, packet) & active & ~blocked;
+      if(!lanes) {
+         continue;
+      }
+
+      if(node->count) {
+         blocked |= PacketIntersectsRecords(rec, node->first, node->count, packet, lanes);
+      } else {
+         assert(nStack + 2 <= 64);
+         stack[nStack++] = node->first;
+         stack[nStack++] = node - rec->bvhNodes + 1;
+      }
+   }
+
+   return blocked;
+}
+
+/**
+ * Returns the active lanes blocked by something in the subtree.
+ * Rays are sent down the same children RayIntersectsSomethingInTree would send them.
+ */
+static unsigned int
+PacketIntersectsSomethingInTree(const C_BspTree *tree, int node, const rayPacket_t *packet, unsigned int active)
+{
+   if(node < 0 || !active) {
+      return 0;
+   }
+
+   const bspFlatNode_t *fNode = &tree->flatNodes[node];
+
+   if(fNode->leaf >= 0) {
+      return PacketIntersectsLeaf(tree, tree->leaves[fNode->leaf], packet, active);
+   }
+
+   float startDist = fNode->a * packet->sx + fNode->b * packet->sy + fNode->c * packet->sz + fNode->d;
+   bool startCoincident = FLOAT_EQ(startDist, 0.0f);
+   bool startFront = !startCoincident && startDist > EPSILON;
+   bool startBack = !startCoincident && !startFront;
+
+   packetFloat_t endDist = fNode->a * packet->ex + fNode->b * packet->ey + fNode->c * packet->ez + fNode->d;
+   packetInt_t endCoincidentMask = (endDist < EPSILON) & (endDist > -EPSILON);
+   packetInt_t endFrontMask = endDist > EPSILON;
+   unsigned int endCoincident = laneBits(&endCoincidentMask);
+   unsigned int endFront = laneBits(&endFrontMask) & ~endCoincident;
+   unsigned int endBack = ALL_LANES & ~endCoincident & ~endFront;
+
+   /// Rays spanning the partition plane go down both sides
+   unsigned int spanning;
+   if(startCoincident) {
+      spanning = endCoincident;
+   } else {
+      spanning = startFront ? endBack : endFront;
+   }
+
+   unsigned int front = spanning | endFront | (startFront ? ALL_LANES : 0);
+   unsigned int back = spanning | endBack | (startBack ? ALL_LANES : 0);
+
+   unsigned int blocked = PacketIntersectsSomethingInTree(tree, fNode->back, packet, active & back);
+   blocked |= PacketIntersectsSomethingInTree(tree, fNode->front, packet, active & front & ~blocked);
+
+   return blocked;
+}
+
+/**
+ * Returns true if at least one ray from a sample point of node1 to a sample point of node2
+ * gets through.
+ * A leaf left without sample points can't be proven hidden so it is considered visible.
+ */
+bool
+C_BspTree::CheckVisibility(C_BspNode *node1, C_BspNode *node2)
+{
+   rayPacket_t packet;
+   unsigned int nPoints2 = node2->pointSet.size();
+
+   assert(triangleRecords.storage);
+
+   if(!node1->pointSet.size() || !nPoints2) {
+      return true;
+   }
+
+	for(unsigned int p1 = 0; p1 < node1->pointSet.size(); p1++) {
+	   packet.sx = node1->pointSet[p1].x;
+	   packet.sy = node1->pointSet[p1].y;
+	   packet.sz = node1->pointSet[p1].z;
+
+		for(unsigned int first = 0; first < nPoints2; first += RAY_PACKET_SIZE) {
+		   unsigned int nRays = MIN(nPoints2 - first, (unsigned int)RAY_PACKET_SIZE);
+
+		   /// Unused lanes repeat the last ray and are left inactive
+		   for(unsigned int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+		      const C_Vertex *end = &node2->pointSet[first + MIN(lane, nRays - 1)];
+
+		      packet.ex[lane] = end->x;
+		      packet.ey[lane] = end->y;
+		      packet.ez[lane] = end->z;
+		      packet.idx[lane] = InverseDirection(end->x - packet.sx);
+		      packet.idy[lane] = InverseDirection(end->y - packet.sy);
+		      packet.idz[lane] = InverseDirection(end->z - packet.sz);
+		   }
+
+		   packet.dx = packet.ex - packet.sx;
+		   packet.dy = packet.ey - packet.sy;
+		   packet.dz = packet.ez - packet.sz;
+
+		   unsigned int active = ALL_LANES >> (RAY_PACKET_SIZE - nRays);
+			if(PacketIntersectsSomethingInTree(this, 0, &packet, active) != active) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,754 @@
+#include "bspTree.h"
+#include "bspNode.h"
+#include "occlusionBuffer.h"
+#include "renderQueue.h"
+
+#include <GL/gl.h>
+
+/**
+ * Rendering side of the bsp tree.
+ * Kept apart from the tree building and PVS code so that the offline map
+ * compiler (bspc) can be linked without any of the graphics libraries.
+ */
+
+void
+C_BspTree::Draw(void)
+{
+	for(int np = 0 ; np < nPolys ; np++) {
+		glBegin(GL_POLYGON);
+		for(int k = 0 ; k < pRawPolys[np]->nVertices ; k++) {
+			glNormal3f(pRawPolys[np]->pNorms[k].x , pRawPolys[np]->pNorms[k].y , pRawPolys[np]->pNorms[k].z);
+			glVertex3f(pRawPolys[np]->pVertices[k].x , pRawPolys[np]->pVertices[k].y , pRawPolys[np]->pVertices[k].z);
+
+			//glNormal3f ( rawPolys[np].pNorms[k].x , rawPolys[np].pNorms[k].y , rawPolys[np].pNorms[k].z );
+			//glVertex3f ( rawPolys[np].pVertices[k].x , rawPolys[np].pVertices[k].y , rawPolys[np].pVertices[k].z );
+		}
+		glEnd();
+	}
+}
+
+/**
+ * Insert a mesh into the tree as a static object.
+ * To determine to which node(s) the mesh belongs, all 8 bbox's vertices are
+ * "thrown" down the tree
+ */
+void
+C_BspTree::insertStaticObject(C_MeshGroup *staticMesh, ESMatrix *matrix)
+{
+   static unsigned int meshID = 0;
+   C_Vertex bboxVertices[8];
+
+   staticTreeObject_t *object = new staticTreeObject_t;
+   object->mesh.softCopy(staticMesh);
+   object->mesh.matrix = *matrix;
+   object->meshID = meshID++;
+   object->drawn = false;
+   object->outsideFrustum = false;
+   object->occluded = false;
+   object->cullFrame = 0;
+   /// The tree frustum culls its objects itself (see CullStaticObjects)
+   object->mesh.applyFrustumCulling = false;
+
+   object->mesh.bbox.ApplyTransformation(matrix);
+   object->mesh.bbox.GetVertices(bboxVertices);
+
+   for(int i = 0; i < 8; ++i) {
+      int node = 0;
+
+      /// Points on a partition plane go to the front side
+      while(node >= 0 && flatNodes[node].leaf < 0) {
+         bspFlatNode_t *fNode = &flatNodes[node];
+         float side = fNode->a * bboxVertices[i].x + fNode->b * bboxVertices[i].y + fNode->c * bboxVertices[i].z + fNode->d;
+
+         node = (FLOAT_EQ(side, 0.0f) || side >= 0.0f) ? fNode->front : fNode->back;
+      }
+
+      if(node >= 0) {
+         leaves[flatNodes[node].leaf]->insertStaticObject(object);
+      }
+   }
+
+   staticObjects.push_back(object);
+}
+
+int
+C_BspTree::Draw2(C_Camera *camera)
+{
+	/// Set all leaves as not drawn
+	for(unsigned int i = 0 ; i < leaves.size() ; i++) {
+		leaves[i]->drawn = false;
+	}
+
+   /// Pass matrices to shader
+	/// Keep a copy of global movelview matrix
+	shaderManager->pushShader(bspShader);
+      glEnableVertexAttribArray(bspShader->verticesAttribLocation);
+      glEnableVertexAttribArray(bspShader->normalsAttribLocation);
+
+      ESMatrix mat = globalViewMatrix;
+      esTranslate(&mat, position.x , position.y , position.z);
+
+      bspShader->setUniformMatrix4fv(UNIFORM_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
+      bspShader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+      DrawNode(0, camera, false);
+	shaderManager->popShader();
+
+	return 0;
+}
+
+int
+C_BspTree::Draw_PVS(C_Camera *camera)
+{
+   /// Initialize tree statistics
+	memset((void *)&statistics, 0, sizeof(statistics));
+
+   /// Set all leaves as not drawn
+	for(unsigned int i = 0 ; i < leaves.size() ; i++) {
+		leaves[i]->drawn = false;
+		for(unsigned int j = 0; j < leaves[i]->staticObjects.size(); ++j) {
+		   leaves[i]->staticObjects[j]->drawn = false;
+		   leaves[i]->staticObjects[j]->occluded = false;
+		}
+	}
+
+   /// Pass matrices to shader
+	/// Keep a copy of global movelview matrix
+	if(DRAW_BSP_GEOMETRY) {
+   	shaderManager->pushShader(bspShader);
+      ESMatrix mat = Identity;
+      esTranslate(&mat, position.x , position.y , position.z);
+
+      bspShader->setUniformMatrix4fv(UNIFORM_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
+      bspShader->setUniformMatrix4fv(UNIFORM_MODEL_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
+      bspShader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+   }
+
+   DrawNode(0, camera, USE_PVS);
+
+   if(DRAW_BSP_GEOMETRY) {
+      shaderManager->popShader();
+   }
+
+	return 0;
+}
+
+void
+C_BspTree::DrawNode(int node, C_Camera *camera, bool usePVS)
+{
+   if(node < 0)
+      return;
+
+   C_Vector3 cameraPosition = camera->GetPosition();
+
+   /// With the PVS only the leaf the camera is in needs to be found
+   if(usePVS) {
+      node = FindLeaf(&cameraPosition);
+      if(node >= 0) {
+         /// Tell the background PVS tracing (if any) where the camera is
+         __atomic_store_n(&lazyPVSCameraLeaf, flatNodes[node].leaf, __ATOMIC_RELAXED);
+         leaves[flatNodes[node].leaf]->DrawLeaf(camera, usePVS);
+      }
+
+      return;
+   }
+
+   bspFlatNode_t *fNode = &flatNodes[node];
+
+   if(fNode->leaf >= 0) {
+      leaves[fNode->leaf]->DrawLeaf(camera, usePVS);
+      return;
+   }
+
+   float side = fNode->a * cameraPosition.x + fNode->b * cameraPosition.y + fNode->c * cameraPosition.z + fNode->d;
+
+   if(side > 0.0f) {
+      DrawNode(fNode->back, camera, usePVS);
+      DrawNode(fNode->front, camera, usePVS);
+   } else {
+      DrawNode(fNode->front, camera, usePVS);
+      DrawNode(fNode->back, camera, usePVS);
+   }
+}
+
+/**
+ * Frustum culls the static objects in the drawLeaves with C_Frustum::boxesInFrustum.
+ * An object can be in many leaves. It's tested once. The ones in the frustum are
+ * left in occludees
+ */
+void
+C_BspTree::CullStaticObjects(const C_Frustum *frustum)
+{
+   C_Vector3 min, max;
+   unsigned int i, j;
+
+   frameObjects.clear();
+   clearFrustumBoxes(&frameObjectBoxes);
+   occludees.clear();
+   occludeeBoxes.clear();
+   ++cullFrame;
+
+   for(i = 0; i < drawLeaves.size(); i++) {
+      C_BspNode *leaf = drawLeaves[i];
+
+      for(j = 0; j < leaf->staticObjects.size(); j++) {
+         staticTreeObject_t *object = leaf->staticObjects[j];
+
+         if(object->cullFrame != cullFrame) {
+            object->cullFrame = cullFrame;
+            object->mesh.bbox.GetMin(&min);
+            object->mesh.bbox.GetMax(&max);
+            frameObjects.push_back(object);
+            addFrustumBox(&frameObjectBoxes, &min, &max);
+         }
+      }
+   }
+
+   if(!frameObjects.size()) {
+      return;
+   }
+
+   frustumResults.resize(frameObjects.size());
+   if(ENABLE_MESH_FRUSTUM_CULLING) {
+      frustum->boxesInFrustum(&frameObjectBoxes, &frustumResults[0]);
+   } else {
+      memset(&frustumResults[0], FRUSTUM_INTERSECT, frustumResults.size());
+   }
+
+   for(i = 0; i < frameObjects.size(); i++) {
+      staticTreeObject_t *object = frameObjects[i];
+
+      object->outsideFrustum = frustumResults[i] == FRUSTUM_OUTSIDE;
+      if(!object->outsideFrustum) {
+         occludees.push_back(object);
+         occludeeBoxes.push_back(&object->mesh.bbox);
+      }
+   }
+}
+
+void
+C_BspTree::CullOccludedObjects(void)
+{
+   if(!occlusionBuffer) {
+      occlusionBuffer = new C_OcclusionBuffer();
+   }
+
+   ESMatrix viewProjection, model = Identity;
+   esMatrixMultiply(&viewProjection, &globalViewMatrix, &globalProjectionMatrix);
+   esTranslate(&model, position.x, position.y, position.z);
+
+   occlusionBuffer->Begin(&viewProjection);
+
+   for(unsigned int i = 0; i < drawLeaves.size(); i++) {
+      occlusionBuffer->AddOccluders(drawLeaves[i]->triangles, drawLeaves[i]->nTriangles, &model);
+   }
+
+   if(!occludees.size()) {
+      return;
+   }
+
+   occlusionBuffer->Rasterize();
+
+   bool *visible = new bool[occludees.size()];
+   occlusionBuffer->TestBoxes(&occludeeBoxes[0], occludees.size(), visible);
+
+   for(unsigned int i = 0; i < occludees.size(); i++) {
+      occludees[i]->occluded = !visible[i];
+   }
+
+   delete[] visible;
+}
+
+/**
+ * Coherent hierarchical occlusion culling with hardware occlusion queries.
+ * The boxes of the nodes are queried after the frame is drawn and the results are read in the
+ * following frames, only once they are available, so the CPU never waits for the GPU. Until then
+ * a node keeps the visibility of its previous query.
+ * A visible leaf is drawn and its box queried again. A node found hidden isn't walked down, its box
+ * is queried instead. When all the children of a node are hidden the node is hidden instead, so
+ * hidden regions cost one query however many leaves they have. When a hidden node is found
+ * visible again its children are walked down (and queried) in the next frame.
+ */
+void
+C_BspTree::ReadOcclusionQueries(void)
+{
+   int i, node;
+
+   if(!nodeQueries) {
+      nodeQueries = new bspNodeQuery_t[nFlatNodes];
+      flatNodeParents = new int[nFlatNodes];
+
+      for(node = 0; node < nFlatNodes; node++) {
+         nodeQueries[node].query = 0;
+         nodeQueries[node].visible = true;
+         nodeQueries[node].pending = false;
+         nodeQueries[node].visitFrame = 0;
+         flatNodeParents[node] = -1;
+      }
+
+      for(node = 0; node < nFlatNodes; node++) {
+         if(flatNodes[node].front >= 0) flatNodeParents[flatNodes[node].front] = node;
+         if(flatNodes[node].back >= 0) flatNodeParents[flatNodes[node].back] = node;
+      }
+   }
+
+   ++queryFrame;
+   queryNodes.clear();
+
+   unsigned int nPending = 0;
+   for(unsigned int p = 0; p < pendingQueryNodes.size(); p++) {
+      node = pendingQueryNodes[p];
+      bspNodeQuery_t *query = &nodeQueries[node];
+      GLuint available = GL_FALSE, samples = 0;
+
+      glGetQueryObjectuiv(query->query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if(!available) {
+         pendingQueryNodes[nPending++] = node;
+         continue;
+      }
+
+      glGetQueryObjectuiv(query->query, GL_QUERY_RESULT, &samples);
+      query->pending = false;
+
+      if(samples) {
+         /// Pull down. The children of a node that was hidden get queried on their own
+         if(!query->visible) {
+            query->visible = true;
+            if(flatNodes[node].front >= 0) nodeQueries[flatNodes[node].front].visible = true;
+            if(flatNodes[node].back >= 0) nodeQueries[flatNodes[node].back].visible = true;
+         }
+         continue;
+      }
+
+      /// Pull up
+      query->visible = false;
+      for(i = flatNodeParents[node]; i >= 0; i = flatNodeParents[i]) {
+         int front = flatNodes[i].front, back = flatNodes[i].back;
+
+         if((front >= 0 && nodeQueries[front].visible) || (back >= 0 && nodeQueries[back].visible)) {
+            break;
+         }
+
+         nodeQueries[i].visible = false;
+      }
+   }
+
+   pendingQueryNodes.resize(nPending);
+}
+
+void
+C_BspTree::IssueOcclusionQueries(void)
+{
+   /// Two triangles per face
+   static const int boxIndices[36] = {0, 1, 3, 0, 3, 2,  4, 6, 7, 4, 7, 5,  0, 4, 5, 0, 5, 1,
+                                      2, 3, 7, 2, 7, 6,  0, 2, 6, 0, 6, 4,  1, 5, 7, 1, 7, 3};
+   float corners[8][3], vertices[36][3];
+   int i, j;
+
+   if(!queryNodes.size()) {
+      return;
+   }
+
+   GLboolean culling;
+   glGetBooleanv(GL_CULL_FACE, &culling);
+   glDisable(GL_CULL_FACE);
+   glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+   glDepthMask(GL_FALSE);
+   /// Boxes lie on the walls they bound
+   glDepthFunc(GL_LEQUAL);
+
+   shaderManager->pushShader(basicShader);
+      basicShader->setUniformMatrix4fv(UNIFORM_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
+      basicShader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+      /// vertices is client memory. Whatever buffer the last draw left bound would turn it into an offset
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      glEnableVertexAttribArray(basicShader->verticesAttribLocation);
+      glVertexAttribPointer(basicShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, vertices);
+
+      for(unsigned int q = 0; q < queryNodes.size(); q++) {
+         bspNodeQuery_t *query = &nodeQueries[queryNodes[q]];
+         const bspFlatNodeBounds_t *bounds = &flatNodeBounds[queryNodes[q]];
+
+         /// Still waiting for the previous one
+         if(query->pending) {
+            continue;
+         }
+
+         for(i = 0; i < 8; i++) {
+            corners[i][0] = position.x + ((i & 4) ? bounds->max[0] : bounds->min[0]);
+            corners[i][1] = position.y + ((i & 2) ? bounds->max[1] : bounds->min[1]);
+            corners[i][2] = position.z + ((i & 1) ? bounds->max[2] : bounds->min[2]);
+         }
+
+         for(i = 0; i < 36; i++) {
+            for(j = 0; j < 3; j++) {
+               vertices[i][j] = corners[boxIndices[i]][j];
+            }
+         }
+
+         if(!query->query) {
+            glGenQueries(1, &query->query);
+         }
+
+         glBeginQuery(GL_SAMPLES_PASSED, query->query);
+         glDrawArrays(GL_TRIANGLES, 0, 36);
+         glEndQuery(GL_SAMPLES_PASSED);
+
+         query->pending = true;
+         pendingQueryNodes.push_back(queryNodes[q]);
+         statistics.occlusionQueries++;
+      }
+
+      glDisableVertexAttribArray(basicShader->verticesAttribLocation);
+   shaderManager->popShader();
+
+   glDepthFunc(GL_LESS);
+   glDepthMask(GL_TRUE);
+   glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+   if(culling) {
+      glEnable(GL_CULL_FACE);
+   }
+}
+
+void
+C_BspTree::ReleaseOcclusionQueries(void)
+{
+   if(!nodeQueries) {
+      return;
+   }
+
+   for(int node = 0; node < nFlatNodes; node++) {
+      if(nodeQueries[node].query) {
+         glDeleteQueries(1, &nodeQueries[node].query);
+      }
+   }
+
+   delete[] nodeQueries;
+   delete[] flatNodeParents;
+   nodeQueries = NULL;
+   flatNodeParents = NULL;
+   pendingQueryNodes.clear();
+}
+
+void
+C_BspTree::QueueInstance(staticTreeObject_t *object)
+{
+   C_MeshGroup *mesh = &object->mesh;
+   unsigned int batch;
+
+   for(batch = 0; batch < instanceBatches.size(); batch++) {
+      if(instanceBatches[batch].mesh->meshes == mesh->meshes) {
+         break;
+      }
+   }
+
+   if(batch == instanceBatches.size()) {
+      instanceBatch_t newBatch;
+      newBatch.mesh = mesh;
+      instanceBatches.push_back(newBatch);
+   }
+
+   /// Same transformation C_MeshGroup::draw applies
+   ESMatrix model = mesh->matrix;
+   esTranslate(&model, mesh->position.x, mesh->position.y, mesh->position.z);
+   instanceBatches[batch].matrices.push_back(model);
+}
+
+/**
+ * Draws the queued instances. The batches are kept from frame to frame so their
+ * vectors don't have to grow again, only the matrices are cleared.
+ * With the render queue all the batches go in the buffer at once, one after the other,
+ * since they are drawn later
+ */
+void
+C_BspTree::DrawInstancedObjects(void)
+{
+   unsigned int batch;
+
+   if(USE_RENDER_QUEUE) {
+      int nInstances = 0;
+      for(batch = 0; batch < instanceBatches.size(); batch++) {
+         nInstances += instanceBatches[batch].matrices.size();
+      }
+
+      if(!nInstances) {
+         return;
+      }
+
+      if(!instanceBuffer) {
+         glGenBuffers(1, &instanceBuffer);
+      }
+
+      glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+      glBufferData(GL_ARRAY_BUFFER, nInstances * sizeof(ESMatrix), NULL, GL_STREAM_DRAW);
+
+      int firstInstance = 0;
+      for(batch = 0; batch < instanceBatches.size(); batch++) {
+         vector<ESMatrix> &matrices = instanceBatches[batch].matrices;
+
+         if(!matrices.size()) {
+            continue;
+         }
+
+         glBufferSubData(GL_ARRAY_BUFFER, firstInstance * sizeof(ESMatrix), matrices.size() * sizeof(ESMatrix), &matrices[0]);
+         instanceBatches[batch].mesh->queueInstanced(renderQueue, instanceBuffer, firstInstance, matrices.size());
+         statistics.meshDrawCalls += instanceBatches[batch].mesh->nMeshes;
+
+         firstInstance += matrices.size();
+         matrices.clear();
+      }
+
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      return;
+   }
+
+   for(batch = 0; batch < instanceBatches.size(); batch++) {
+      vector<ESMatrix> &matrices = instanceBatches[batch].matrices;
+
+      if(!matrices.size()) {
+         continue;
+      }
+
+      if(!instanceBuffer) {
+         glGenBuffers(1, &instanceBuffer);
+      }
+
+      /// Orphan last batch's data instead of waiting for the draw calls still using it
+      glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+      glBufferData(GL_ARRAY_BUFFER, matrices.size() * sizeof(ESMatrix), &matrices[0], GL_STREAM_DRAW);
+
+      instanceBatches[batch].mesh->drawInstanced(instanceBuffer, matrices.size());
+      statistics.meshDrawCalls += instanceBatches[batch].mesh->nMeshes;
+
+      matrices.clear();
+   }
+
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void
+C_BspTree::ReleaseInstanceBuffer(void)
+{
+   if(instanceBuffer) {
+      glDeleteBuffers(1, &instanceBuffer);
+      instanceBuffer = 0;
+   }
+
+   instanceBatches.clear();
+}
+
+/**
+ * Hierarchical frustum culling.
+ * A subtree is dropped as soon as its box is outside the frustum. Planes a box is fully
+ * inside of are removed from planeMask, so once a subtree is fully inside the frustum its
+ * leaves are collected without any more tests.
+ * The side of every node the camera is on is visited first, so the leaves come out front
+ * to back starting with the camera's
+ */
+void
+C_BspTree::CollectDrawLeaves(int node, const C_Vector3 *cameraPosition, int cameraLeaf, const C_BitSet *visibleSet, const C_Frustum *frustum, unsigned int planeMask)
+{
+   if(node < 0)
+      return;
+
+   if(planeMask && !frustum->boxInFrustum(flatNodeBounds[node].min, flatNodeBounds[node].max, &planeMask))
+      return;
+
+   bspFlatNode_t *fNode = &flatNodes[node];
+   bool queried = false;
+
+   if(USE_OCCLUSION_QUERIES) {
+      bspNodeQuery_t *query = &nodeQueries[node];
+      const bspFlatNodeBounds_t *bounds = &flatNodeBounds[node];
+
+      /// Whatever a node not reached in the last frame was, it's out of date
+      if(query->visitFrame + 1 != queryFrame) {
+         query->visible = true;
+      }
+      query->visitFrame = queryFrame;
+
+      /// The nodes around the camera are always walked down
+      const float margin = OCCLUSION_QUERY_CAMERA_MARGIN;
+      queried = cameraPosition->x < bounds->min[0] - margin || cameraPosition->x > bounds->max[0] + margin ||
+                cameraPosition->y < bounds->min[1] - margin || cameraPosition->y > bounds->max[1] + margin ||
+                cameraPosition->z < bounds->min[2] - margin || cameraPosition->z > bounds->max[2] + margin;
+
+      if(!queried) {
+         query->visible = true;
+      }
+
+      if(queried && !query->visible) {
+         if(fNode->leaf < 0 || visibleSet->TestAtomic(fNode->leaf)) {
+            queryNodes.push_back(node);
+         }
+         return;
+      }
+   }
+
+   if(fNode->leaf >= 0) {
+      if(fNode->leaf == cameraLeaf || visibleSet->TestAtomic(fNode->leaf)) {
+         drawLeaves.push_back(leaves[fNode->leaf]);
+
+         /// Visible leaves are queried again to find out when they get hidden
+         if(queried) {
+            queryNodes.push_back(node);
+         }
+      }
+      return;
+   }
+
+   float side = fNode->a * cameraPosition->x + fNode->b * cameraPosition->y + fNode->c * cameraPosition->z + fNode->d;
+
+   if(side > 0.0f) {
+      CollectDrawLeaves(fNode->front, cameraPosition, cameraLeaf, visibleSet, frustum, planeMask);
+      CollectDrawLeaves(fNode->back, cameraPosition, cameraLeaf, visibleSet, frustum, planeMask);
+   } else {
+      CollectDrawLeaves(fNode->back, cameraPosition, cameraLeaf, visibleSet, frustum, planeMask);
+      CollectDrawLeaves(fNode->front, cameraPosition, cameraLeaf, visibleSet, frustum, planeMask);
+   }
+}
+
+void
+C_BspNode::DrawLeaf(C_Camera *camera, bool usePVS)
+{
+   assert(isLeaf);
+
+   /// Everything is potentially visible until the row has been traced
+   const C_BitSet *visibleSet = __atomic_load_n(&PVSReady, __ATOMIC_ACQUIRE) ? &PVS : &tree->allLeaves;
+
+   tree->statistics.totalLeaves += visibleSet->Count();
+
+   vector<C_BspNode *> &drawLeaves = tree->drawLeaves;
+   drawLeaves.clear();
+
+   if(usePVS) {
+      if(!tree->flatNodeBounds) {
+         tree->ComputeFlatNodeBounds();
+      }
+
+      if(USE_OCCLUSION_QUERIES) {
+         tree->ReadOcclusionQueries();
+      }
+
+      C_Vector3 cameraPosition = camera->GetPosition();
+      tree->CollectDrawLeaves(0, &cameraPosition, leafIndex, visibleSet, camera->frustum,
+                              ENABLE_BSP_FRUSTUM_CULLING ? FRUSTUM_ALL_PLANES : 0);
+   } else {
+      drawLeaves.push_back(this);
+   }
+
+   if(DRAW_TREE_MESHES) {
+      if(USE_RENDER_QUEUE && !tree->renderQueue) {
+         tree->renderQueue = new C_RenderQueue();
+      }
+
+      tree->CullStaticObjects(camera->frustum);
+
+      /// Needs all the leaves drawn in the frame at once
+      if(ENABLE_OCCLUSION_CULLING && usePVS) {
+         tree->CullOccludedObjects();
+      }
+   }
+
+   if(DRAW_BSP_GEOMETRY) {
+      bbox.Draw(1.0f, 1.0f, 0.0f);
+      DrawPointSet();
+   }
+
+   for(unsigned int i = 0; i < drawLeaves.size(); i++) {
+      drawLeaves[i]->Draw(camera);
+      if(DRAW_BSP_GEOMETRY && drawLeaves[i] != this) {
+         drawLeaves[i]->bbox.Draw();
+      }
+   }
+
+   if(DRAW_TREE_MESHES && ENABLE_INSTANCING) {
+      tree->DrawInstancedObjects();
+   }
+
+   if(DRAW_TREE_MESHES && USE_RENDER_QUEUE) {
+      tree->renderQueue->Flush();
+   }
+
+   /// Against the depth buffer of the whole frame
+   if(USE_OCCLUSION_QUERIES && usePVS) {
+      tree->IssueOcclusionQueries();
+   }
+}
+
+void
+C_BspNode::Draw(C_Camera *camera)
+{
+   drawn = true;
+   tree->statistics.totalStaticObjects += staticObjects.size();
+   tree->statistics.leavesDrawn++;
+   tree->statistics.bspTrianglesDrawn += nTriangles;
+
+   /// Draw bsp geometry
+   if(DRAW_BSP_GEOMETRY) {
+      glEnableVertexAttribArray(bspShader->verticesAttribLocation);
+      glEnableVertexAttribArray(bspShader->normalsAttribLocation);
+
+      glVertexAttribPointer(bspShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, (3 + 3) * sizeof(float), triangles);
+      glVertexAttribPointer(bspShader->normalsAttribLocation, 3, GL_FLOAT, GL_FALSE, (3 + 3) * sizeof(float), (char *)triangles + 3 * sizeof(float));
+      glDrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
+
+      glDisableVertexAttribArray(bspShader->verticesAttribLocation);
+      glDisableVertexAttribArray(bspShader->normalsAttribLocation);
+   }
+
+   if(DRAW_TREE_MESHES) {
+      /// Draw static meshes
+      for(unsigned int i = 0; i < staticObjects.size(); ++i) {
+         tree->statistics.totalTriangles += staticObjects[i]->mesh.nTriangles;
+
+         if(staticObjects[i]->drawn) {
+            continue;
+         }
+
+         if(staticObjects[i]->outsideFrustum) {
+            staticObjects[i]->drawn = true;
+            continue;
+         }
+
+         if(ENABLE_OCCLUSION_CULLING && staticObjects[i]->occluded) {
+            tree->statistics.staticObjectsOccluded++;
+            staticObjects[i]->drawn = true;
+            continue;
+         }
+
+         if(ENABLE_INSTANCING && staticObjects[i]->mesh.instancedShader) {
+            tree->QueueInstance(staticObjects[i]);
+            tree->statistics.staticObjectsDrawn++;
+            tree->statistics.trianglesDrawn += staticObjects[i]->mesh.nTriangles;
+         } else if(USE_RENDER_QUEUE) {
+            staticObjects[i]->mesh.queue(tree->renderQueue);
+            tree->statistics.staticObjectsDrawn++;
+            tree->statistics.trianglesDrawn += staticObjects[i]->mesh.nTriangles;
+            tree->statistics.meshDrawCalls += staticObjects[i]->mesh.nMeshes;
+         } else if(staticObjects[i]->mesh.draw(camera)) {
+            tree->statistics.staticObjectsDrawn++;
+            tree->statistics.trianglesDrawn += staticObjects[i]->mesh.nTriangles;
+            tree->statistics.meshDrawCalls += staticObjects[i]->mesh.nMeshes;
+         }
+
+         staticObjects[i]->drawn = true;
+      }
+   }
+}
+
+void C_BspNode::DrawPointSet(void)
+{
+   int n = pointSet.size();
+
+   shaderManager->pushShader(pointShader);
+      pointShader->setUniform4f(UNIFORM_COLOR, 0.0f, 1.0f, 0.0f, 1.0f);
+
+      pointShader->setUniformMatrix4fv(UNIFORM_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
+      pointShader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+
+      glEnableVertexAttribArray(pointShader->verticesAttribLocation);
+      glVertexAttribPointer(pointShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, 0, &pointSet[0]);
+      glDrawArrays(GL_POINTS, 0, n);
+      glDisableVertexAttribArray(pointShader->verticesAttribLocation);
+   shaderManager->popShader();
+}
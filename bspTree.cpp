@@ -2,17 +2,31 @@
 #include "bspNode.h"
 #include "vectors.h"
 #include "bspHelperFunctions.h"
+#include "threadPool.h"
+#ifndef BSP_COMPILER
+#  include "occlusionBuffer.h"
+#  include "renderQueue.h"
+#endif
 
 #include <fstream>
-#include <GL/gl.h>
 #include <iostream>
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 int nConvexRooms;
 
+static double
+elapsedSeconds(const timeval *start)
+{
+   timeval end;
+   gettimeofday(&end, NULL);
+
+   return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
 C_BspTree::C_BspTree(USHORT depth)
 {
    PRINT_FUNC_ENTRY;
@@ -23,6 +37,39 @@ C_BspTree::C_BspTree(USHORT depth)
 	pBrushes = NULL;
 	headNode = NULL;
 	pRawPolys = NULL;
+	buildPool = NULL;
+	loadedLeaves = NULL;
+	pvsBits = NULL;
+	pvsMethod = PVS_RAY_SAMPLING;
+	portalMightsee = NULL;
+	portalMightseeBits = NULL;
+	portalVis = NULL;
+	portalVisBits = NULL;
+	portalVisDone = NULL;
+	memset(&triangleRecords, 0, sizeof(triangleRecords));
+	mappedMap = NULL;
+	mappedMapSize = 0;
+	geometryChecksum = 0;
+	buildArenas = NULL;
+	nBuildArenas = 0;
+	flatNodes = NULL;
+	nFlatNodes = 0;
+	flatNodeBounds = NULL;
+	leafTriangles = NULL;
+	nLeafTriangles = 0;
+	lazyPVSCameraLeaf = -1;
+	lazyPVSRunning = false;
+	lazyPVSAbort = false;
+	lazyPVSNextRow = 0;
+	lazyPVSComplete = false;
+	lazyPVSTested = NULL;
+	occlusionBuffer = NULL;
+	cullFrame = 0;
+	nodeQueries = NULL;
+	flatNodeParents = NULL;
+	queryFrame = 0;
+	instanceBuffer = 0;
+	renderQueue = NULL;
 
 	maxDepth = depth;
 	lessPolysInNodeFound = INT_MAX;
@@ -37,6 +84,7 @@ C_BspTree::C_BspTree(USHORT depth)
 	nNodes = 0;
 
 	memset((void *)&treeStats, 0, sizeof(treeStats));
+	memset((void *)&pvsTimes, 0, sizeof(pvsTimes));
 	memset((void *)&statistics, 0, sizeof(statistics));
 }
 
@@ -44,24 +92,43 @@ C_BspTree::~C_BspTree(void)
 {
    PRINT_FUNC_ENTRY;
 
-	/// Delete data
-	for(int i = 0 ; i < nBrushes ; i++) {
-		for(int j = 0 ; j < pBrushes[i].nPolys ; j++) {
-			delete[] pBrushes[i].pPolys[j].pVertices;
-			delete[] pBrushes[i].pPolys[j].pNorms;
-		}
-		delete[] pBrushes[i].pPolys;
-	}
-
+	/// Delete data. Polygons themselves are released with rawPolyArena
    delete[] pBrushes;
    delete[] pRawPolys;
+   delete[] buildArenas;
 
+#ifndef BSP_COMPILER
 	for(unsigned int i = 0; i < staticObjects.size(); ++i) {
 	   delete staticObjects[i];
 	}
 	staticObjects.clear();
 
+	delete occlusionBuffer;
+	ReleaseOcclusionQueries();
+	ReleaseInstanceBuffer();
+	delete renderQueue;
+#endif
+
+	/// Background tracing uses the leaves
+	StopLazyPVS(true);
+
+	/// Leaves' triangles live in leafTriangles
+	for(unsigned int i = 0; i < leaves.size(); ++i) {
+	   leaves[i]->triangles = NULL;
+	}
+
 	delete headNode;
+	delete[] loadedLeaves;
+	delete[] pvsBits;
+	delete[] flatNodeBounds;
+	ReleaseTriangleRecords();
+
+	if(mappedMap) {
+	   munmap(mappedMap, mappedMapSize);
+	} else {
+	   delete[] flatNodes;
+	   delete[] leafTriangles;
+	}
 }
 
 
@@ -129,15 +196,15 @@ C_BspTree::ReadGeometryFile(const char* fileName)
 		file.read((char*)&pBrushes[i].nPolys, sizeof(int));
 		printf("   brush %d: %d polys\n", i, pBrushes[i].nPolys);
 
-		pBrushes[i].pPolys = new poly_t[pBrushes[i].nPolys];
+		pBrushes[i].pPolys = rawPolyArena.NewPolygons(pBrushes[i].nPolys);
 
 		/// For each poly in brush
 		for(int j = 0 ; j < pBrushes[i].nPolys ; j++) {
 			/// Read number of vertices
 			file.read((char*)&pBrushes[i].pPolys[j].nVertices, sizeof(int));
 
-			pBrushes[i].pPolys[j].pVertices = new C_Vertex[pBrushes[i].pPolys[j].nVertices];
-			pBrushes[i].pPolys[j].pNorms = new C_Vertex[pBrushes[i].pPolys[j].nVertices];
+			pBrushes[i].pPolys[j].pVertices = (C_Vertex *)rawPolyArena.Allocate(pBrushes[i].pPolys[j].nVertices * sizeof(C_Vertex));
+			pBrushes[i].pPolys[j].pNorms = (C_Vertex *)rawPolyArena.Allocate(pBrushes[i].pPolys[j].nVertices * sizeof(C_Vertex));
 			pBrushes[i].pPolys[j].usedAsDivider = false;
 
 			pRawPolys[currentPoly] = &pBrushes[i].pPolys[j];
@@ -168,6 +235,9 @@ C_BspTree::ReadGeometryFile(const char* fileName)
 
 	assert(currentPoly == nPolys);
 
+	/// Files built out of the geometry (ie. the PVS file) are checked against it
+	FileChecksum(fileName, &geometryChecksum);
+
    /// Set bbox
    bbox.SetMax(maxX , maxY , maxZ);
    bbox.SetMin(minX , minY , minZ);
@@ -180,22 +250,6 @@ C_BspTree::ReadGeometryFile(const char* fileName)
 	return true;
 }
 
-void
-C_BspTree::Draw(void)
-{
-	for(int np = 0 ; np < nPolys ; np++) {
-		glBegin(GL_POLYGON);
-		for(int k = 0 ; k < pRawPolys[np]->nVertices ; k++) {
-			glNormal3f(pRawPolys[np]->pNorms[k].x , pRawPolys[np]->pNorms[k].y , pRawPolys[np]->pNorms[k].z);
-			glVertex3f(pRawPolys[np]->pVertices[k].x , pRawPolys[np]->pVertices[k].y , pRawPolys[np]->pVertices[k].z);
-
-			//glNormal3f ( rawPolys[np].pNorms[k].x , rawPolys[np].pNorms[k].y , rawPolys[np].pNorms[k].z );
-			//glVertex3f ( rawPolys[np].pVertices[k].x , rawPolys[np].pVertices[k].y , rawPolys[np].pVertices[k].z );
-		}
-		glEnd();
-	}
-}
-
 void
 C_BspTree::CalcNorms(void)
 {
@@ -217,54 +271,59 @@ C_BspTree::CalcNorms(void)
 	}
 }
 
-/**
- * Insert a mesh into the tree as a static object.
- * To determine to which node(s) the mesh belongs, all 8 bbox's vertices are
- * "thrown" down the tree
- */
 void
-C_BspTree::insertStaticObject(C_MeshGroup *staticMesh, ESMatrix *matrix)
+C_BspTree::DistributeSamplePoints(void)
 {
-   static unsigned int meshID = 0;
-   C_Vertex bboxVertices[8];
-
-   staticTreeObject_t *object = new staticTreeObject_t;
-   object->mesh.softCopy(staticMesh);
-   object->mesh.matrix = *matrix;
-   object->meshID = meshID++;
-   object->drawn = false;
-
-   object->mesh.bbox.ApplyTransformation(matrix);
-   object->mesh.bbox.GetVertices(bboxVertices);
-
-   for(int i = 0; i < 8; ++i) {
-      headNode->insertStaticObject(object, &bboxVertices[i]);
-   }
-
-   staticObjects.push_back(object);
+   RunLeafTasks(C_BspNode::DistributeSamplePoints_Task);
 }
 
 void
-C_BspTree::DistributeSamplePoints(void)
+C_BspTree::RunLeafTasks(void (*task)(void *data, int tid))
 {
-   for(unsigned int i = 0; i < leaves.size(); ++i) {
-      leaves[i]->DistributePointsAlongBBox();
-      leaves[i]->CleanUpPointSet(leaves[i]->pointSet, true, true);
+   if(MAX_THREADS > 1) {
+      C_ThreadPool pool(MAX_THREADS);
+
+      for(unsigned int i = 0; i < leaves.size(); ++i) {
+         pool.addTask(task, leaves[i]);
+      }
+
+      pool.wait();
+   } else {
+      for(unsigned int i = 0; i < leaves.size(); ++i) {
+         task(leaves[i], 0);
+      }
    }
 }
 
 void
-C_BspTree::BuildPVS(const char *filename)
+C_BspTree::BuildPVS(const char *filename, pvsMethod_t method)
 {
 	printf("%s\n", __FUNCTION__);
 
+	pvsMethod = method;
+	if(method == PVS_PORTAL_FLOW) {
+		cout << "Building PVS (portals)..." << endl;
+		PortalVisibility();
+		cout << "Done!" << endl << endl;
+		return;
+	}
+
 	/// An iparhei arheio me tin pliroforia diabase apo ekei
 	bool pvsFileFound = false;
-	pvsFileFound = this->ReadPVSFile(filename);
+	if(filename) {
+		pvsFileFound = this->ReadPVSFile(filename);
+	}
 
 	cout << "Building PVS..." << endl;
+	timeval start;
+	gettimeofday(&start, NULL);
+	PrepareTriangleRecords();
+	pvsTimes.triangleRecords = elapsedSeconds(&start);
+
 	cout << "\tDistributing sample points... " << flush;
+	gettimeofday(&start, NULL);
 	DistributeSamplePoints();
+	pvsTimes.sampleDistribution = elapsedSeconds(&start);
 	cout << "Done!" << endl;
 
 	if(pvsFileFound) {
@@ -274,91 +333,258 @@ C_BspTree::BuildPVS(const char *filename)
 		cout << "Done!" << endl << endl;
 	}
 
+	ReleaseTriangleRecords();
 	cout << "Done!" << endl << endl;
 
 	/// Write PVS into a file
-	if(!pvsFileFound) {
+	if(!pvsFileFound && filename) {
 		WritePVSFile(filename);
 	}
 }
 
+/// Uniform grid of all the leaves' sample points used to find connected leaves.
+/// Cells are CONNECTED_LEAVES_DISTANCE wide so close points are at most one cell apart.
+/// Cells are hashed into nBuckets buckets; points of bucket b are points[first[b] .. first[b + 1])
+typedef struct {
+   int            nBuckets;
+   int            *first;
+   C_Vertex       *points;
+   /// Leaf index of every point
+   int            *pointLeaves;
+} connectedLeavesGrid_t;
+
+typedef struct {
+   C_BspTree                     *tree;
+   const connectedLeavesGrid_t   *grid;
+   int                           leaf;
+   /// Connected leaves with a greater index than leaf
+   C_BitSet                      *connected;
+} connectedLeavesTask_t;
+
+static inline int
+gridCell(float coord)
+{
+   return (int)floorf(coord / CONNECTED_LEAVES_DISTANCE);
+}
+
+static inline int
+gridBucket(const connectedLeavesGrid_t *grid, int x, int y, int z)
+{
+   /// nBuckets is a power of 2
+   return (int)(((unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u) & (unsigned int)(grid->nBuckets - 1));
+}
+
+/// Finds the leaves following data->leaf connected to it. Only writes its own bit set
+void
+C_BspTree::FindConnectedLeaves_Task(void *data_, int tid)
+{
+   connectedLeavesTask_t *data = (connectedLeavesTask_t *)data_;
+   const connectedLeavesGrid_t *grid = data->grid;
+   const vector<C_Vertex> &points = data->tree->leaves[data->leaf]->pointSet;
+   const float maxDistance = CONNECTED_LEAVES_DISTANCE * CONNECTED_LEAVES_DISTANCE;
+
+   for(unsigned int p = 0; p < points.size(); p++) {
+      int cx = gridCell(points[p].x);
+      int cy = gridCell(points[p].y);
+      int cz = gridCell(points[p].z);
+
+      for(int x = cx - 1; x <= cx + 1; x++) {
+         for(int y = cy - 1; y <= cy + 1; y++) {
+            for(int z = cz - 1; z <= cz + 1; z++) {
+               int bucket = gridBucket(grid, x, y, z);
+
+               /// Buckets can hold points of other cells too. They are far enough to fail the distance test
+               for(int k = grid->first[bucket]; k < grid->first[bucket + 1]; k++) {
+                  int leaf = grid->pointLeaves[k];
+                  if(leaf <= data->leaf || data->connected->Test(leaf)) {
+                     continue;
+                  }
+
+                  if(math::DistanceSquared(&points[p], &grid->points[k]) < maxDistance) {
+                     data->connected->Set(leaf);
+                  }
+               }
+            }
+         }
+      }
+   }
+}
+
+/**
+ * Hashes all the sample points into a uniform grid so each point is only compared with the
+ * points of its neighbouring cells. Every leaf is looked up as a separate task and the
+ * results are applied in leaf order afterwards, so the PVS comes out the same whatever the
+ * number of threads.
+ */
+void
+C_BspTree::FindConnectedLeaves(void)
+{
+   connectedLeavesGrid_t grid;
+   int i, j, nPoints = 0;
+
+   for(i = 0; i < nLeaves; i++) {
+      nPoints += leaves[i]->pointSet.size();
+   }
+
+   grid.nBuckets = 1;
+   while(grid.nBuckets < nPoints) {
+      grid.nBuckets <<= 1;
+   }
+
+   grid.first = new int[grid.nBuckets + 1];
+   grid.points = new C_Vertex[MAX(nPoints, 1)];
+   grid.pointLeaves = new int[MAX(nPoints, 1)];
+   memset(grid.first, 0, (grid.nBuckets + 1) * sizeof(int));
+
+   /// Counting sort of the points into their buckets
+   int *pointBuckets = new int[MAX(nPoints, 1)];
+   int point = 0;
+   for(i = 0; i < nLeaves; i++) {
+      for(unsigned int p = 0; p < leaves[i]->pointSet.size(); p++, point++) {
+         const C_Vertex *v = &leaves[i]->pointSet[p];
+         pointBuckets[point] = gridBucket(&grid, gridCell(v->x), gridCell(v->y), gridCell(v->z));
+         grid.first[pointBuckets[point] + 1]++;
+      }
+   }
+
+   for(i = 0; i < grid.nBuckets; i++) {
+      grid.first[i + 1] += grid.first[i];
+   }
+
+   int *next = new int[grid.nBuckets];
+   memcpy(next, grid.first, grid.nBuckets * sizeof(int));
+
+   point = 0;
+   for(i = 0; i < nLeaves; i++) {
+      for(unsigned int p = 0; p < leaves[i]->pointSet.size(); p++, point++) {
+         int slot = next[pointBuckets[point]]++;
+         grid.points[slot] = leaves[i]->pointSet[p];
+         grid.pointLeaves[slot] = i;
+      }
+   }
+
+   delete[] next;
+   delete[] pointBuckets;
+
+   /// Look up every leaf
+   C_BitSet *connected = new C_BitSet[nLeaves];
+   connectedLeavesTask_t *tasks = new connectedLeavesTask_t[nLeaves];
+   C_ThreadPool *pool = MAX_THREADS > 1 ? new C_ThreadPool(MAX_THREADS) : NULL;
+
+   for(i = 0; i < nLeaves; i++) {
+      connected[i].Resize(nLeaves);
+      tasks[i].tree = this;
+      tasks[i].grid = &grid;
+      tasks[i].leaf = i;
+      tasks[i].connected = &connected[i];
+
+      if(pool) {
+         pool->addTask(FindConnectedLeaves_Task, &tasks[i]);
+      } else {
+         FindConnectedLeaves_Task(&tasks[i], 0);
+      }
+   }
+
+   if(pool) {
+      pool->wait();
+      delete pool;
+   }
+
+   /// Connect them in the order the pairs are met, (i, j) with i < j.
+   /// The order leaves go into the PVS is the order visibility tracing explores them.
+   /// addNodeToPVS connects both ways so both connectedLeaves lists are updated at once
+   for(i = 0; i < nLeaves; i++) {
+      for(j = connected[i].NextSetBit(0); j >= 0; j = connected[i].NextSetBit(j + 1)) {
+         if(leaves[j]->PVS.Test(i) == false) {
+            leaves[j]->connectedLeaves.push_back(leaves[i]);
+            leaves[i]->connectedLeaves.push_back(leaves[j]);
+            leaves[j]->addNodeToPVS(leaves[i]);
+         }
+      }
+   }
+
+   delete[] tasks;
+   delete[] connected;
+   delete[] grid.first;
+   delete[] grid.points;
+   delete[] grid.pointLeaves;
+}
+
 typedef struct {
    int tid;
    C_BspTree *tree;
+   /// Pairs of leaves this thread traced rays between
+   int pairsTraced;
 } threadData_t;
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static float progress;
+/// Next leaf to be picked up by a thread and number of leaves done so far
+static int nextLeaf;
+static int leavesDone;
 
+/**
+ * Visibility tracing worker.
+ * Threads pick up leaves one at a time from a shared counter and check them against every
+ * leaf in the PVS of the leaves in their PVS. No locks are taken:
+ *  - a pair is claimed by atomically setting its checked bit on the lower indexed leaf,
+ *    so every pair is traced by one thread only;
+ *  - results are published with atomic bit sets and appends (see addNodeToPVS);
+ *  - the PVSOrder lists other threads are growing are read up to their first unfilled entry.
+ */
 void *TraceVisibility_Thread(void *data_)
 {
    threadData_t *data = (threadData_t *)data_;
-   int tid = data->tid;
    C_BspTree *tree = data->tree;
    vector<C_BspNode *> &leaves = tree->leaves;
    C_BspNode *leaf1, *leaf2, *leaf3;
    const int progressBarStars = 20;
-
-   C_BspNode *res;
    int load = leaves.size();
-   int start = load / MAX_THREADS * tid;
-   int end = load / MAX_THREADS * (tid + 1);
-   float step = (float)progressBarStars / (float)load;
+   int l1;
 
-   /// thread 0 prints progress bar
-   if(!tid) {
-      pthread_mutex_lock(&mutex);
-      progress = step;
-      pthread_mutex_unlock(&mutex);
-
-      cout << "\n\t\t0%|---------50---------|100%\n\t   ";
-   }
+   data->pairsTraced = 0;
 
-	for(int l1 = start; l1 < end; l1++) {
+	while((l1 = __atomic_fetch_add(&nextLeaf, 1, __ATOMIC_RELAXED)) < load) {
 	   leaf1 = leaves[l1];
-		for(unsigned int l2 = 0; l2 < leaf1->PVS.size(); l2++) {
-		   leaf2 = leaf1->PVS[l2];
-         for(unsigned int l3 = 0; l3 < leaf2->PVS.size(); l3++) {
-            leaf3 = leaf2->PVS[l3];
+		for(int l2 = 0; l2 < __atomic_load_n(&leaf1->nPVSOrder, __ATOMIC_ACQUIRE); l2++) {
+		   int index2 = __atomic_load_n(&leaf1->PVSOrder[l2], __ATOMIC_ACQUIRE);
+		   if(index2 < 0) {
+		      break;
+		   }
+		   leaf2 = leaves[index2];
+
+         for(int l3 = 0; l3 < __atomic_load_n(&leaf2->nPVSOrder, __ATOMIC_ACQUIRE); l3++) {
+            int index3 = __atomic_load_n(&leaf2->PVSOrder[l3], __ATOMIC_ACQUIRE);
+            if(index3 < 0) {
+               break;
+            }
+            leaf3 = leaves[index3];
 
             /// Sanity checks
             assert(leaf1->isLeaf);
             assert(leaf2->isLeaf);
             assert(leaf3->isLeaf);
 
-            if(leaf1->nodeID == leaf3->nodeID) {
+            if(leaf1 == leaf3 || leaf1->PVS.TestAtomic(index3)) {
                continue;
             }
 
-            pthread_mutex_lock(&mutex);
-            assert(leaf1->checkedVisibilityWith[leaf3->nodeID] == leaf3->checkedVisibilityWith[leaf1->nodeID]);
-            assert(leaf1->visibleFrom[leaf3->nodeID] == leaf3->visibleFrom[leaf1->nodeID]);
-            if(leaf1->visibleFrom[leaf3->nodeID] || leaf1->checkedVisibilityWith[leaf3->nodeID]) {
-               pthread_mutex_unlock(&mutex);
+            /// Claim the pair
+            C_BspNode *first = l1 < index3 ? leaf1 : leaf3;
+            if(first->checkedVisibilityWith.TestAndSetAtomic(l1 < index3 ? index3 : l1)) {
                continue;
             }
-            pthread_mutex_unlock(&mutex);
-
-            res = tree->CheckVisibility(leaf1, leaf3);
 
-            pthread_mutex_lock(&mutex);
-            if(!res)
+            data->pairsTraced++;
+            if(tree->CheckVisibility(leaf1, leaf3)) {
                leaf1->addNodeToPVS(leaf3);
-
-            leaf1->checkedVisibilityWith[leaf3->nodeID] = true;
-            leaf3->checkedVisibilityWith[leaf1->nodeID] = true;
-            pthread_mutex_unlock(&mutex);
+            }
          }
       }
 
-		pthread_mutex_lock(&mutex);
-  		progress += step;
-  		pthread_mutex_unlock(&mutex);
-
-  		if(!tid) {
-         cout << "\r\t\t   ";
-         for(int k = 0 ; k < (int)floor(progress + 0.5f); k++)
-            cout << "*" << flush;
+      /// Whoever completes the leaf that crosses a star boundary draws the star
+      int done = __atomic_add_fetch(&leavesDone, 1, __ATOMIC_RELAXED);
+      if(done * progressBarStars / load != (done - 1) * progressBarStars / load) {
+         printf("*");
+         fflush(stdout);
       }
 	}
 
@@ -367,16 +593,23 @@ void *TraceVisibility_Thread(void *data_)
 }
 
 void
-C_BspTree::TraceVisibility(void)
+C_BspTree::PrepareVisibilityTracing(void)
 {
-   pthread_t threads[MAX_THREADS];
-   threadData_t threadData[MAX_THREADS];
-   int cb, ret, i, j;
    timeval start, end;
    double elapsedTime;
+   int i;
+
+   assert(nLeaves == (int)leaves.size());
 
-   assert(nLeaves == leaves.size());
+   /// Tracing bookkeeping
+   for(i = 0; i < nLeaves; i++) {
+      delete[] leaves[i]->PVSOrder;
+      leaves[i]->PVSOrder = new int[nLeaves];
+      leaves[i]->nPVSOrder = 0;
+      memset(leaves[i]->PVSOrder, -1, nLeaves * sizeof(int));
 
+      leaves[i]->checkedVisibilityWith.Resize(nLeaves);
+   }
 
 /// Find connected leaves
 /// NOTE: Two leaves sharing at least one visibility point will be considered as connected
@@ -385,66 +618,66 @@ C_BspTree::TraceVisibility(void)
    fflush(stdout);
    gettimeofday(&start, NULL);
 
-	for(i = 0; i < nLeaves; i++) {
-		for(j = 0; j < nLeaves; j++) {
-			if(i == j || leaves[j]->visibleFrom[leaves[i]->nodeID] || leaves[i]->visibleFrom[leaves[j]->nodeID])
-				continue;
-
-         /// Loop through point sets
-			for(unsigned int p1 = 0; p1 < leaves[i]->pointSet.size(); p1++) {
-				for(unsigned int p2 = 0; p2 < leaves[j]->pointSet.size(); p2++) {
-				   if(math::Distance(&leaves[i]->pointSet[p1], &leaves[j]->pointSet[p2]) < 5.0f) {
-						if(leaves[j]->visibleFrom[leaves[i]->nodeID] == false) {
-							leaves[j]->connectedLeaves.push_back(leaves[i]);
-							leaves[j]->addNodeToPVS(leaves[i]);
-						}
-
-						if(leaves[i]->visibleFrom[leaves[j]->nodeID] == false) {
-							leaves[i]->connectedLeaves.push_back(leaves[j]);
-							leaves[i]->addNodeToPVS(leaves[j]);
-						}
-
-						p1 = leaves[i]->pointSet.size();
-						break;
-					}
-				}
-			}
-		}
-	}
+   FindConnectedLeaves();
 
    gettimeofday(&end, NULL);
    elapsedTime = (end.tv_sec - start.tv_sec) * 1000.0;      // sec to ms
    elapsedTime += (end.tv_usec - start.tv_usec) / 1000.0;   // us to ms
    printf("Done! (%.2f s)\n", elapsedTime / 1000.0);
-
-//return;
+   pvsTimes.connectedLeaves = elapsedTime / 1000.0;
 
    /// After finding connected leaves try to furter clean up the visibility points
    /// Removes sample points that coincide with connected leaves' geometry
    printf("\tRemoving redundant sample points...");
    fflush(stdout);
+   gettimeofday(&start, NULL);
 
-   C_BspNode *leaf;
-   for(i = 0; i < nLeaves; i++) {
-      leaf = leaves[i];
-//      C_BspNode::CleanUpPointSet(leaf, leaf->pointSet, false, true);
-      for(j = 0; j < (int)leaf->PVS.size(); j++) {
-         leaf->PVS[j]->CleanUpPointSet(leaf->pointSet, false, true);
-      }
+   RunLeafTasks(C_BspNode::RemoveRedundantPoints_Task);
+
+   pvsTimes.pointCleanup = elapsedSeconds(&start);
+   printf("Done! (%.2f s)\n", pvsTimes.pointCleanup);
+}
+
+void
+C_BspTree::ReleaseVisibilityTracing(void)
+{
+   for(int i = 0; i < nLeaves; i++) {
+      delete[] leaves[i]->PVSOrder;
+      leaves[i]->PVSOrder = NULL;
+      leaves[i]->nPVSOrder = 0;
+      leaves[i]->checkedVisibilityWith.Release();
    }
-   printf("Done!\n");
+}
 
-//   return;
+void
+C_BspTree::TraceVisibility(void)
+{
+   pthread_t threads[MAX_THREADS];
+   threadData_t threadData[MAX_THREADS];
+   int cb, ret;
+   timeval start, end;
+   double elapsedTime;
+
+   PrepareVisibilityTracing();
 
 /// Trace visibility
 /// ----------------------
    printf("\tTracing Visibility...\n");
    gettimeofday(&start, NULL);
 
+   nextLeaf = 0;
+   leavesDone = 0;
+
 	for(cb = 0; cb < MAX_THREADS; cb++) {
 		threadData[cb].tid = cb;
 		threadData[cb].tree = this;
 		printf("\t\t[Creating thread %d]\n", cb);
+	}
+
+   printf("\n\t\t0%%|---------50---------|100%%\n\t\t   ");
+   fflush(stdout);
+
+	for(cb = 0; cb < MAX_THREADS; cb++) {
       /// Fork threads
 		ret = pthread_create(&threads[cb], NULL, TraceVisibility_Thread, (void *)&threadData[cb]);
 		if(ret) {
@@ -454,62 +687,50 @@ C_BspTree::TraceVisibility(void)
 	}
 
    /// Join threads here
+   int pairsTraced = 0;
 	for(cb = 0; cb < MAX_THREADS; cb++) {
 		pthread_join(threads[cb], NULL);
+		pairsTraced += threadData[cb].pairsTraced;
 	}
 
    gettimeofday(&end, NULL);
    elapsedTime = (end.tv_sec - start.tv_sec) * 1000.0;      // sec to ms
    elapsedTime += (end.tv_usec - start.tv_usec) / 1000.0;   // us to ms
 
-   printf("\n\nDone (%.2f s)\n", elapsedTime / 1000.0f);
+   printf("\n\nDone (%.2f s, %d leaf pairs traced)\n", elapsedTime / 1000.0f, pairsTraced);
+   pvsTimes.tracing = elapsedTime / 1000.0;
 
-	pthread_mutex_destroy(&mutex);
+   /// Tracing bookkeeping is no longer needed
+   ReleaseVisibilityTracing();
 }
 
 C_BspNode *
-C_BspTree::CheckVisibility(C_BspNode *node1, C_BspNode *node2)
+C_BspTree::RayIntersectsSomethingInTree(int node, C_Vertex *start, C_Vertex *end)
 {
-   C_BspNode *occluderNode = NULL;
-
-	for(unsigned int p1 = 0; p1 < node1->pointSet.size(); p1++) {
-		for(unsigned int p2 = 0; p2 < node2->pointSet.size(); p2++) {
-			if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(headNode, &node1->pointSet[p1], &node2->pointSet[p2])) == NULL) {
-				return NULL;
-			}
-		}
-	}
-
-	return occluderNode;
-}
-
-C_BspNode *
-C_BspTree::RayIntersectsSomethingInTree(C_BspNode *node, C_Vertex *start, C_Vertex *end)
-{
-   if(!node)
+   if(node < 0)
       return NULL;
 
    C_BspNode *occluderNode;
+   bspFlatNode_t *fNode = &flatNodes[node];
 
-	if(node->isLeaf) {
-		for(int cp = 0 ; cp < node->nTriangles ; cp++) {
-			if(RayTriangleIntersection(start, end, &node->triangles[cp])) {
-				return node;
-			}
+	if(fNode->leaf >= 0) {
+	   C_BspNode *leaf = leaves[fNode->leaf];
+		if(LineHitsLeaf(leaf, start, end)) {
+			return leaf;
 		}
 		return NULL;
 	}
 
-	int startSide = ClassifyVertex(&node->partitionPlane, start);
-	int endSide = ClassifyVertex(&node->partitionPlane, end);
+	int startSide = ClassifyVertex(fNode, start);
+	int endSide = ClassifyVertex(fNode, end);
 
    /// If the ray spans the node's partition plane, then send the ray down both sides of node
 	if((startSide == COINCIDENT && endSide == COINCIDENT) ||
       (startSide != endSide && startSide != COINCIDENT && endSide != COINCIDENT)) {
-		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(node->backNode, start, end))) {
+		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(fNode->back, start, end))) {
 			return occluderNode;
 		}
-		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(node->frontNode, start, end))) {
+		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(fNode->front, start, end))) {
 			return occluderNode;
 		}
 	}
@@ -517,7 +738,7 @@ C_BspTree::RayIntersectsSomethingInTree(C_BspNode *node, C_Vertex *start, C_Vert
    /// If ray is whole in front of partition plane the send it down the front node
    /// The or in the if statement is because one of the points might be coinciding with the plane.
 	if(startSide == FRONT || endSide == FRONT) {
-		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(node->frontNode, start, end))) {
+		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(fNode->front, start, end))) {
 			return occluderNode;
 		}
 	}
@@ -525,7 +746,7 @@ C_BspTree::RayIntersectsSomethingInTree(C_BspNode *node, C_Vertex *start, C_Vert
    /// Respectively send it down to back node
    /// The or in the if statement is because one of the points might be coinciding with the plane.
 	if(startSide == BACK || endSide == BACK) {
-		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(node->backNode, start, end))) {
+		if((occluderNode = C_BspTree::RayIntersectsSomethingInTree(fNode->back, start, end))) {
 			return occluderNode;
 		}
 	}
@@ -533,6 +754,45 @@ C_BspTree::RayIntersectsSomethingInTree(C_BspNode *node, C_Vertex *start, C_Vert
 	return NULL;
 }
 
+/**
+ * Walks the tree depth first (front side first) assigning node ids, collecting the leaves
+ * and gathering the tree statistics.
+ * Numbering follows the order the serial recursive build has always used: a split node takes
+ * the next id followed by its back and front children, then the front subtree is visited
+ * before the back one.
+ */
+void
+C_BspTree::CollectLeaves(C_BspNode *node, ULONG *ID)
+{
+   if(node->isLeaf) {
+      nConvexRooms += (int)node->isConvexRoom;
+      nLeaves++;
+      node->leafIndex = leaves.size();
+      leaves.push_back(node);
+
+      if(node->depth > depthReached) {
+         depthReached = node->depth;
+      }
+
+      if(node->nPolys < lessPolysInNodeFound) {
+         lessPolysInNodeFound = node->nPolys;
+      }
+
+      return;
+   }
+
+   node->nodeID = (*ID)++;
+   node->backNode->nodeID = (*ID)++;
+   node->frontNode->nodeID = (*ID)++;
+
+   if(node->frontNode->nPolys) {
+      CollectLeaves(node->frontNode, ID);
+   }
+   if(node->backNode->nPolys) {
+      CollectLeaves(node->backNode, ID);
+   }
+}
+
 void
 C_BspTree::BuildBspTree(void)
 {
@@ -540,7 +800,29 @@ C_BspTree::BuildBspTree(void)
 	cout << "Building bsp tree... ";
 
 	headNode = new C_BspNode(pRawPolys , nPolys);
-	headNode->BuildBspTree(this);
+
+	if(PARALLEL_BSP_BUILD && MAX_THREADS > 1) {
+	   /// Independent subtrees are built as tasks on a worker pool
+	   nBuildArenas = MAX_THREADS;
+	   buildArenas = new C_PolygonArena[nBuildArenas];
+	   buildPool = new C_ThreadPool(MAX_THREADS);
+	   headNode->tree = this;
+	   buildPool->addTask(C_BspNode::BuildBspTree_Task, headNode);
+	   buildPool->wait();
+
+	   delete buildPool;
+	   buildPool = NULL;
+	} else {
+	   nBuildArenas = 1;
+	   buildArenas = new C_PolygonArena[nBuildArenas];
+	   headNode->BuildBspTree(this, &buildArenas[0]);
+	}
+
+	/// Number the nodes and gather the leaves. This is done after the tree is built
+	/// so the ids (and the PVS files that refer to them) don't depend on the build order.
+	ULONG ID = 0;
+	CollectLeaves(headNode, &ID);
+	nNodes = ID;
 
    /// Close possible space holes between the tree's leaves
    printf("\n\tDetecting and closing space holes... ");
@@ -552,6 +834,13 @@ C_BspTree::BuildBspTree(void)
 
 	TessellatePolygons();
 
+	/// Leaves are triangles now. The split polygons are not needed anymore
+	delete[] buildArenas;
+	buildArenas = NULL;
+	nBuildArenas = 0;
+
+	FlattenTree();
+
 	cout << "Done!" << endl;
 
 	// Print out statistics
@@ -567,63 +856,157 @@ C_BspTree::BuildBspTree(void)
 	cout << "***********************************************\n\n" << endl;
 }
 
-int
-C_BspTree::Draw2(C_Camera *camera)
+/**
+ * Copies the node tree into a contiguous array of small nodes so that the runtime
+ * traversals don't have to chase pointers around the heap.
+ * Nodes are laid out depth first with the front child right after its parent.
+ * Empty children (nodes that received no polygons) are dropped.
+ */
+void
+C_BspTree::FlattenTree(void)
 {
-	/// Set all leaves as not drawn
-	for(unsigned int i = 0 ; i < leaves.size() ; i++) {
-		leaves[i]->drawn = false;
-	}
+   int i, first;
+
+   delete[] flatNodes;
+   delete[] leafTriangles;
+   delete[] flatNodeBounds;
+   flatNodeBounds = NULL;
+
+   /// nNodes counts only the split nodes. A tree that is a single leaf has none of them
+   int nNeeded = CountFlatNodes(headNode);
+   flatNodes = new bspFlatNode_t[MAX(nNeeded, 1)];
+   nFlatNodes = 0;
+   FlattenNode(headNode);
+   assert(nFlatNodes == nNeeded);
+
+   /// No polygons at all. Node 0 is still there for the traversals, a split without children
+   if(!nFlatNodes) {
+      memset((void *)&flatNodes[0], 0, sizeof(bspFlatNode_t));
+      flatNodes[0].front = flatNodes[0].back = flatNodes[0].leaf = -1;
+      nFlatNodes = 1;
+   }
 
-   /// Pass matrices to shader
-	/// Keep a copy of global movelview matrix
-	shaderManager->pushShader(bspShader);
-      glEnableVertexAttribArray(bspShader->verticesAttribLocation);
-      glEnableVertexAttribArray(bspShader->normalsAttribLocation);
+   /// Pack the leaves' triangles together
+   nLeafTriangles = 0;
+   for(i = 0; i < nLeaves; i++) {
+      nLeafTriangles += leaves[i]->nTriangles;
+   }
 
-      ESMatrix mat = globalViewMatrix;
-      esTranslate(&mat, position.x , position.y , position.z);
+   leafTriangles = new triangle_vn[nLeafTriangles];
+
+   first = 0;
+   for(i = 0; i < nLeaves; i++) {
+      C_BspNode *leaf = leaves[i];
 
-      bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
-      bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
-      headNode->Draw(camera, this, false);
-	shaderManager->popShader();
+      memcpy((void *)&leafTriangles[first], (void *)leaf->triangles, leaf->nTriangles * sizeof(triangle_vn));
+      delete[] leaf->triangles;
+      leaf->triangles = &leafTriangles[first];
 
-	return 0;
+      first += leaf->nTriangles;
+   }
 }
 
+/// Same rules as FlattenNode
 int
-C_BspTree::Draw_PVS(C_Camera *camera)
+C_BspTree::CountFlatNodes(C_BspNode *node)
 {
-   /// Initialize tree statistics
-	memset((void *)&statistics, 0, sizeof(statistics));
+   if(!node || !node->nPolys)
+      return 0;
 
-   /// Set all leaves as not drawn
-	for(unsigned int i = 0 ; i < leaves.size() ; i++) {
-		leaves[i]->drawn = false;
-		for(unsigned int j = 0; j < leaves[i]->staticObjects.size(); ++j)
-		   leaves[i]->staticObjects[j]->drawn = false;
-	}
+   if(node->isLeaf)
+      return 1;
+
+   return 1 + CountFlatNodes(node->frontNode) + CountFlatNodes(node->backNode);
+}
+
+int
+C_BspTree::FlattenNode(C_BspNode *node)
+{
+   if(!node || !node->nPolys)
+      return -1;
 
-   /// Pass matrices to shader
-	/// Keep a copy of global movelview matrix
-	if(DRAW_BSP_GEOMETRY) {
-   	shaderManager->pushShader(bspShader);
-      ESMatrix mat = Identity;
-      esTranslate(&mat, position.x , position.y , position.z);
+   int index = nFlatNodes++;
+   bspFlatNode_t *fNode = &flatNodes[index];
 
-      bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
-      bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MODEL_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
-      bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+   fNode->a = node->partitionPlane.a;
+   fNode->b = node->partitionPlane.b;
+   fNode->c = node->partitionPlane.c;
+   fNode->d = node->partitionPlane.d;
+   fNode->front = fNode->back = -1;
+
+   if(node->isLeaf) {
+      fNode->leaf = node->leafIndex;
+      return index;
    }
 
-   headNode->Draw(camera, this, USE_PVS);
+   fNode->leaf = -1;
+   fNode->front = FlattenNode(node->frontNode);
+   fNode->back = FlattenNode(node->backNode);
+
+   return index;
+}
 
-   if(DRAW_BSP_GEOMETRY) {
-      shaderManager->popShader();
+/**
+ * Builds the flat nodes' boxes bottom up from the leaves' bboxes.
+ * Leaves' bboxes can still be grown after the tree is flattened (see closeLeafHoles),
+ * so this is done when the boxes are first needed
+ */
+void
+C_BspTree::ComputeFlatNodeBounds(void)
+{
+   assert(flatNodes && !flatNodeBounds);
+
+   flatNodeBounds = new bspFlatNodeBounds_t[nFlatNodes];
+   ComputeFlatNodeBounds(0);
+}
+
+void
+C_BspTree::ComputeFlatNodeBounds(int node)
+{
+   bspFlatNode_t *fNode = &flatNodes[node];
+   bspFlatNodeBounds_t *bounds = &flatNodeBounds[node];
+
+   if(fNode->leaf >= 0) {
+      C_BBox *bbox = &leaves[fNode->leaf]->bbox;
+      bbox->GetMin(&bounds->min[0], &bounds->min[1], &bounds->min[2]);
+      bbox->GetMax(&bounds->max[0], &bounds->max[1], &bounds->max[2]);
+      return;
+   }
+
+   for(int i = 0; i < 3; i++) {
+      bounds->min[i] = GREATEST_FLOAT;
+      bounds->max[i] = SMALLEST_FLOAT;
    }
 
-	return 0;
+   int children[2] = {fNode->front, fNode->back};
+   for(int c = 0; c < 2; c++) {
+      if(children[c] < 0) {
+         continue;
+      }
+
+      ComputeFlatNodeBounds(children[c]);
+
+      const bspFlatNodeBounds_t *child = &flatNodeBounds[children[c]];
+      for(int i = 0; i < 3; i++) {
+         bounds->min[i] = MIN(bounds->min[i], child->min[i]);
+         bounds->max[i] = MAX(bounds->max[i], child->max[i]);
+      }
+   }
+}
+
+int
+C_BspTree::FindLeaf(const C_Vector3 *point)
+{
+   int node = 0;
+
+   while(node >= 0 && flatNodes[node].leaf < 0) {
+      bspFlatNode_t *fNode = &flatNodes[node];
+      float side = fNode->a * point->x + fNode->b * point->y + fNode->c * point->z + fNode->d;
+
+      node = side > 0.0f ? fNode->front : fNode->back;
+   }
+
+   return node;
 }
 
 void
@@ -632,58 +1015,170 @@ C_BspTree::TessellatePolygons(void)
 	headNode->TessellatePolygonsInLeaves();
 }
 
+/**
+ * Ray sampled PVS file.
+ *
+ *    pvsFileHeader_t                     header
+ *    per leaf, in leaf index order:
+ *       uint32_t                         size
+ *       unsigned char                    row[size]
+ *
+ * Rows are run length compressed (see C_BitSet::CompressRLE). The header keeps a checksum of
+ * the geometry file and of the settings the PVS depends on, a file built from another map or
+ * with other settings is rejected and the PVS is traced again.
+ */
+
+#define PVS_FILE_MAGIC     "BPVS"
+#define PVS_FILE_VERSION   1
+
+typedef struct {
+   char        magic[4];
+   int32_t     version;
+   /// Checksum of everything following the header
+   uint32_t    checksum;
+   uint32_t    geometryChecksum;
+   uint32_t    settingsChecksum;
+   int32_t     nLeaves;
+   uint32_t    fileSize;
+} pvsFileHeader_t;
+
+/// Settings changing the leaves or their sample points
+static uint32_t
+pvsSettingsChecksum(const C_BspTree *tree)
+{
+   struct {
+      int32_t  maxDepth;
+      int32_t  nPointsU, nPointsV;
+      float    connectedLeavesDistance;
+      float    scaleFactor;
+   } settings;
+
+   memset((void *)&settings, 0, sizeof(settings));
+   settings.maxDepth = tree->maxDepth;
+   settings.nPointsU = NPOINTS_U;
+   settings.nPointsV = NPOINTS_V;
+   settings.connectedLeavesDistance = CONNECTED_LEAVES_DISTANCE;
+   settings.scaleFactor = tree->scaleFactor;
+
+   return FNV1a(&settings, sizeof(settings), FNV1A_INITIAL);
+}
+
 void
 C_BspTree::WritePVSFile(const char *fileName)
 {
-	fstream filestr;
-	filestr.open(fileName, fstream::out);
+   pvsFileHeader_t header;
+   int i;
 
-	filestr << nLeaves << endl;
+   memset((void *)&header, 0, sizeof(header));
+   memcpy(header.magic, PVS_FILE_MAGIC, 4);
+   header.version = PVS_FILE_VERSION;
+   header.geometryChecksum = geometryChecksum;
+   header.settingsChecksum = pvsSettingsChecksum(this);
+   header.nLeaves = nLeaves;
 
-	for(int i = 0; i < nLeaves; i++) {
-		filestr << leaves[i]->nodeID << " * " << leaves[i]->PVS.size();
+   unsigned char *data = new unsigned char[sizeof(header) + nLeaves * (sizeof(uint32_t) + leaves[0]->PVS.MaxRLESize())];
+   uint32_t size = sizeof(header);
 
-		for(unsigned int j = 0; j < leaves[i]->PVS.size(); j++) {
-			filestr << " " << leaves[i]->PVS[j]->nodeID;
-		}
+   for(i = 0; i < nLeaves; i++) {
+      assert(leaves[i]->PVS.GetnBits() == nLeaves);
 
-		filestr << endl;
-	}
+      uint32_t rowSize = leaves[i]->PVS.CompressRLE(data + size + sizeof(uint32_t));
+      memcpy(data + size, &rowSize, sizeof(uint32_t));
+      size += sizeof(uint32_t) + rowSize;
+   }
+
+   header.fileSize = size;
+   header.checksum = FNV1a(data + sizeof(header), size - sizeof(header), FNV1A_INITIAL);
+   memcpy(data, &header, sizeof(header));
 
-	filestr.close();
+   ofstream file(fileName, ios::out | ios::binary);
+   if(file.is_open()) {
+      file.write((const char *)data, size);
+      file.close();
+   } else {
+      printf("Couldn't open \"%s\"\n", fileName);
+   }
+
+   delete[] data;
 }
 
+/**
+ * Reads the PVS into the leaves' PVS sets.
+ * Returns false if the file is missing, corrupted, or out of date: written for another
+ * geometry file, tree depth or sampling settings. The PVS must then be traced again.
+ */
 bool
 C_BspTree::ReadPVSFile(const char *filename)
 {
-	fstream filestr;
-	filestr.open(filename , fstream::in);
+   pvsFileHeader_t header;
+   int i;
 
-	if(filestr.fail()) {
-		return false;
-	}
+   ifstream file(filename, ios::in | ios::binary);
+   if(!file.is_open()) {
+      return false;
+   }
 
-	filestr >> nLeaves;
+   file.seekg(0, ios::end);
+   uint32_t size = file.tellg();
+   file.seekg(0, ios::beg);
 
-	for(int i = 0; i < nLeaves; i++) {
-		ULONG nodeId;
-		int size;
+   if(size < sizeof(header)) {
+      printf("\"%s\" is not a PVS file\n", filename);
+      return false;
+   }
 
-		filestr >> nodeId;
-		filestr.ignore(3);
-		filestr >> size;
+   unsigned char *data = new unsigned char[size];
+   file.read((char *)data, size);
+   bool valid = file.good();
+   file.close();
+
+   memcpy(&header, data, sizeof(header));
+   valid = valid &&
+           !memcmp(header.magic, PVS_FILE_MAGIC, 4) &&
+           header.version == PVS_FILE_VERSION &&
+           header.fileSize == size &&
+           header.checksum == FNV1a(data + sizeof(header), size - sizeof(header), FNV1A_INITIAL);
+
+   if(!valid) {
+      printf("\"%s\" is corrupted or was written by another version\n", filename);
+      delete[] data;
+      return false;
+   }
 
-		for(int j = 0; j < size; j++) {
-			filestr >> nodeId;
+   if(header.geometryChecksum != geometryChecksum || header.settingsChecksum != pvsSettingsChecksum(this) ||
+      header.nLeaves != nLeaves) {
+      printf("\"%s\" is out of date\n", filename);
+      delete[] data;
+      return false;
+   }
 
-			int k = 0;
-			while(nodeId != leaves[k++]->nodeID);
-			k--;
-			leaves[i]->PVS.push_back(leaves[k]);
-		}
-	}
+   uint32_t offset = sizeof(header);
+   for(i = 0; i < nLeaves && valid; i++) {
+      uint32_t rowSize;
 
-	return true;
+      if(leaves[i]->PVS.GetnBits() != nLeaves) {
+         leaves[i]->PVS.Resize(nLeaves);
+      }
+
+      valid = offset + sizeof(uint32_t) <= size;
+      if(valid) {
+         memcpy(&rowSize, data + offset, sizeof(uint32_t));
+         offset += sizeof(uint32_t);
+         valid = offset + rowSize <= size && leaves[i]->PVS.DecompressRLE(data + offset, rowSize);
+         offset += rowSize;
+      }
+   }
+
+   delete[] data;
+
+   if(!valid) {
+      printf("\"%s\": bad pvs row\n", filename);
+      for(i = 0; i < nLeaves; i++) {
+         leaves[i]->PVS.ClearAll();
+      }
+   }
+
+   return valid;
 }
 
 void
@@ -741,11 +1236,7 @@ C_BspTree::closeLeafHoles(void)
    /// Initialize variables
    /// ----------------------
 	for(int i = 0 ; i < nLeaves; i++) {
-		leaves[i]->visibleFrom = new bool[nNodes];
-		leaves[i]->checkedVisibilityWith = new bool[nNodes];
-
-		memset(leaves[i]->visibleFrom, false, nNodes * sizeof(bool));
-		memset(leaves[i]->checkedVisibilityWith, false, nNodes * sizeof(bool));
+		leaves[i]->PVS.Resize(nLeaves);
 	}
 
    bbox.GetMin(&treeMin);
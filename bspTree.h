@@ -2,8 +2,12 @@
 #define _BSPTREE_H_
 
 #include <iostream>
+#include <pthread.h>
 
 #include "bspCommon.h"
+#include "polygonArena.h"
+#include "bitSet.h"
+#include "frustum.h"
 
 using namespace std;
 
@@ -15,8 +19,18 @@ typedef struct {
    int totalStaticObjects;
    int trianglesDrawn;
    int totalTriangles;
+   int staticObjectsOccluded;
+   int bspTrianglesDrawn;
+   int occlusionQueries;
+   int meshDrawCalls;
 } treeDrawStatistics_t;
 
+/// Model matrices of the visible copies of a mesh group, drawn with one instanced call
+typedef struct {
+   C_MeshGroup *mesh;
+   vector<ESMatrix> matrices;
+} instanceBatch_t;
+
 /// Tree statistics
 typedef struct {
    int nLeaves;
@@ -28,6 +42,19 @@ typedef struct {
    int nFinalPolys;
 } treeStatistics_t;
 
+/// Seconds spent in every phase of the last ray sampled PVS build
+typedef struct {
+   double triangleRecords;
+   double sampleDistribution;
+   double connectedLeaves;
+   double pointCleanup;
+   double tracing;
+} pvsBuildTimes_t;
+
+class C_ThreadPool;
+class C_OcclusionBuffer;
+class C_RenderQueue;
+
 class C_BspTree {
 friend class C_BspNode;
 
@@ -48,11 +75,19 @@ public:
    vector<poly_t*> tessellatedPolys;
    poly_t** pRawPolys;
 
-   USHORT leafToDraw;
-   USHORT nNodesToDraw;
+   /// Storage for the polygons read from the geometry file. Lives as long as the tree
+   C_PolygonArena rawPolyArena;
+   /// Storage for split polygons and nodes' polygon lists, one per build thread.
+   /// Released as soon as the leaves are tessellated
+   C_PolygonArena *buildArenas;
+   int nBuildArenas;
+
+   int leafToDraw;
+   int nNodesToDraw;
 
    treeDrawStatistics_t statistics;
    treeStatistics_t treeStats;
+   pvsBuildTimes_t pvsTimes;
    vector<staticTreeObject_t *> staticObjects;
 public:
    C_BspTree(USHORT depth);
@@ -61,15 +96,100 @@ public:
    /// Read geometry file
    bool ReadGeometryFile(const char* fileName);
 
+   /// Checksum of the geometry file the tree was read from
+   uint32_t geometryChecksum;
+
+   /// Binary PVS file, rows stored by leaf index. Files written for other geometry or
+   /// settings are rejected by ReadPVSFile (see bspTree.cpp)
    void WritePVSFile(const char *fileName);
    bool ReadPVSFile(const char *fileName);
 
+   /// Compiled map holds the flat tree, the leaves and their PVS (see bspCompiledMap.cpp).
+   /// A tree loaded from a compiled map is ready to be drawn, no need to build it.
+   /// sourceFileName is the .bsp file the map is compiled from.
+   bool WriteCompiledMap(const char *fileName, const char *sourceFileName);
+   bool ReadCompiledMap(const char *fileName, const char *sourceFileName, pvsMethod_t method);
+
    void BuildBspTree(void);
-   void BuildPVS(const char *filename);
+   /// Assigns node ids and fills in the leaves list after the tree is built
+   void CollectLeaves(C_BspNode *node, ULONG *ID);
+   /// Builds the PVS using the given method. The ray sampled PVS is read from/written
+   /// to filename (if not NULL). The portal PVS is always recalculated
+   void BuildPVS(const char *filename, pvsMethod_t method);
+   /// Method the PVS was built with. Stored in the compiled map
+   pvsMethod_t pvsMethod;
 
    void TraceVisibility(void);
-   C_BspNode *CheckVisibility(C_BspNode *node1 , C_BspNode *node2);
-   C_BspNode *RayIntersectsSomethingInTree(C_BspNode *node , C_Vertex *start , C_Vertex *end);
+   /// Connects the leaves and cleans up their sample points ahead of the tracing.
+   /// Allocates the tracing bookkeeping, released by ReleaseVisibilityTracing
+   void PrepareVisibilityTracing(void);
+   void ReleaseVisibilityTracing(void);
+
+   /// Lazy PVS (see bspLazyPVS.cpp). If filename can't be read every leaf starts out seeing
+   /// every other one and the exact rows are traced in the background, the camera's leaf and
+   /// its neighbours first. The PVS is written to filename once all rows are done and completed
+   void BuildLazyPVS(const char *filename);
+   /// Waits for the background tracing to end. If abortTracing is set the rows left are skipped
+   void StopLazyPVS(bool abortTracing);
+   /// False while PVS rows are still being traced in the background
+   bool IsPVSComplete(void);
+   /// Row to trace next, -1 if there are none left
+   int NextLazyPVSRow(void);
+   /// Flood fill of leaf's row through the visible leaves, starting with the first nVisible entries of
+   /// visible, which must have room for all the leaves. Leaves already in the row's lazyPVSTested are
+   /// skipped. With symmetric set the results go to the other leaf's row too, like addNodeToPVS does.
+   /// Returns the number of leaves added to leaf's row, -1 if tracing was aborted
+   int FloodLazyPVSRow(C_BspNode *leaf, C_BspNode **visible, int nVisible, bool symmetric);
+   /// Traces the next row as a C_ThreadPool task. Data is the tree
+   static void LazyPVSRow_Task(void *data, int tid);
+   static void *LazyPVS_Thread(void *data);
+   /// Once every row is served makes the rows symmetric and tests the leaves next to the ones
+   /// gained until nothing changes, as TraceVisibility does. Rows only gain bits
+   void CompleteLazyPVS(void);
+   /// Drawn instead of the PVS of the leaves whose row isn't ready yet
+   C_BitSet allLeaves;
+   /// Leaf the camera was last found in. Its row is traced first
+   int lazyPVSCameraLeaf;
+   /// Background tracing state. Rows are claimed in lazyPVSClaimed, nextRow is the lowest one not yet claimed
+   pthread_t lazyPVSThread;
+   bool lazyPVSRunning;
+   bool lazyPVSAbort;
+   int lazyPVSNextRow;
+   /// Set once the rows are completed and safe to be written to the pvs file
+   bool lazyPVSComplete;
+   /// Leaves every row has been tested against
+   C_BitSet *lazyPVSTested;
+   C_BitSet lazyPVSClaimed;
+   string lazyPVSFileName;
+
+   /// Portal PVS (see bspPortals.cpp)
+   vector<bspPortal_t> portals;
+   /// Leaves that might be seen through each portal, two per portal: leaving portal->leaves[0] and leaving
+   /// portal->leaves[1]. Only kept while the portal PVS is being built
+   C_BitSet *portalMightsee;
+   uint32_t *portalMightseeBits;
+   /// Leaves the flow reached through each portal from the leaf it leaves, laid out like portalMightsee.
+   /// Once portalVisDone is set the leaf's flow is over and the set is used in place of the mightsee one
+   C_BitSet *portalVis;
+   uint32_t *portalVisBits;
+   bool *portalVisDone;
+   void ExtractPortals(void);
+   void PortalVisibility(void);
+   void PortalMightsee(int portal, int from);
+   void PortalFlow(int source, int leaf, const bspPortal_t *sourcePortal, const bspPortal_t *passPortal,
+                   const bspPortalBounds_t *bounds, int depth, bspPortalFlowState_t *state);
+   /// True if any ray between the two leaves' sample points gets through (see bspRayPacket.cpp)
+   bool CheckVisibility(C_BspNode *node1 , C_BspNode *node2);
+   /// Leaf triangles prepared for the ray and point queries (see bspTriangleQuery.cpp).
+   /// Only kept while the PVS is being built
+   bspTriangleRecords_t triangleRecords;
+   void PrepareTriangleRecords(void);
+   void ReleaseTriangleRecords(void);
+   /// True if the line through start and end crosses one of the leaf's triangles
+   bool LineHitsLeaf(const C_BspNode *leaf, const C_Vertex *start, const C_Vertex *end);
+   /// Sets onGeometry[i] for the points lying on one of the leaf's triangles
+   void PointsOnLeafGeometry(const C_BspNode *leaf, const C_Vertex *points, int nPoints, unsigned char *onGeometry);
+   C_BspNode *RayIntersectsSomethingInTree(int node , C_Vertex *start , C_Vertex *end);
    void insertStaticObject(C_MeshGroup *mesh, ESMatrix *matrix);
 
    void TessellatePolygons(void);
@@ -79,6 +199,44 @@ public:
    void Draw3(void);
    int Draw_PVS(C_Camera *camera);
 
+   /// Leaves drawn in this frame, front to back
+   vector<C_BspNode *> drawLeaves;
+   /// Walks down the tree front to back adding to drawLeaves cameraLeaf and the leaves in visibleSet that are in the frustum.
+   /// planeMask has a bit set for every frustum plane the node's parents are not fully inside of
+   void CollectDrawLeaves(int node, const C_Vector3 *cameraPosition, int cameraLeaf, const C_BitSet *visibleSet, const C_Frustum *frustum, unsigned int planeMask);
+   /// The static objects in the drawLeaves are frustum culled in one batch
+   unsigned int cullFrame;
+   vector<staticTreeObject_t *> frameObjects;
+   frustumBoxes_t frameObjectBoxes;
+   vector<signed char> frustumResults;
+   void CullStaticObjects(const C_Frustum *frustum);
+   /// Software occlusion culling of the static objects (see occlusionBuffer.cpp).
+   /// The drawLeaves' triangles are the occluders, the static objects in the frustum are tested
+   C_OcclusionBuffer *occlusionBuffer;
+   vector<staticTreeObject_t *> occludees;
+   vector<const C_BBox *> occludeeBoxes;
+   void CullOccludedObjects(void);
+   /// Hardware occlusion queries of the flat nodes' boxes (USE_OCCLUSION_QUERIES).
+   /// Each frame is drawn with the results of the queries of the frames before
+   bspNodeQuery_t *nodeQueries;
+   int *flatNodeParents;
+   unsigned int queryFrame;
+   /// Nodes whose box is queried once the frame is drawn, and the ones waiting for results
+   vector<int> queryNodes;
+   vector<int> pendingQueryNodes;
+   void ReadOcclusionQueries(void);
+   void IssueOcclusionQueries(void);
+   void ReleaseOcclusionQueries(void);
+   /// Static objects with an instanced shader (ENABLE_INSTANCING) are queued while the leaves are drawn
+   /// and drawn at the end of the frame, one batch per source mesh (soft copies share the meshes)
+   vector<instanceBatch_t> instanceBatches;
+   unsigned int instanceBuffer;
+   void QueueInstance(staticTreeObject_t *object);
+   void DrawInstancedObjects(void);
+   void ReleaseInstanceBuffer(void);
+   /// Static objects are drawn sorted by state at the end of the frame (USE_RENDER_QUEUE)
+   C_RenderQueue *renderQueue;
+
    /// Max depth allowed
    USHORT maxDepth;
    /// Number of polygon splits happen while building the tree
@@ -88,14 +246,48 @@ public:
    int depthReached;
    int lessPolysInNodeFound;
 
-   USHORT nLeaves;
-   USHORT nNodes;
-   USHORT nConvexRooms;
+   int nLeaves;
+   int nNodes;
+   int nConvexRooms;
 
    /// Keep all the leaves for easy reference
    vector<C_BspNode*> leaves;
 
+   /// Flat copy of the tree (depth first, front child first) used by all the runtime traversals
+   bspFlatNode_t *flatNodes;
+   int nFlatNodes;
+   /// Subtree boxes of the flat nodes. Built the first time they are needed
+   bspFlatNodeBounds_t *flatNodeBounds;
+   /// Triangles of all the leaves packed in a single array. The leaves' triangles point into it
+   triangle_vn *leafTriangles;
+   int nLeafTriangles;
+
+   /// Builds flatNodes and leafTriangles out of the node tree
+   void FlattenTree(void);
+   int FlattenNode(C_BspNode *node);
+   int CountFlatNodes(C_BspNode *node);
+   void ComputeFlatNodeBounds(void);
+   void ComputeFlatNodeBounds(int node);
+   /// Returns the flat node index of the leaf containing the point
+   int FindLeaf(const C_Vector3 *point);
+   void DrawNode(int node, C_Camera *camera, bool usePVS);
+
+   /// Leaves created by ReadCompiledMap. Such a tree has no headNode
+   C_BspNode *loadedLeaves;
+   /// Decompressed PVS rows of the loaded leaves, nLeaves rows of C_BitSet::WordsForBits(nLeaves) words
+   uint32_t *pvsBits;
+   /// The compiled map file. flatNodes and leafTriangles point into it
+   void *mappedMap;
+   size_t mappedMapSize;
+
+   /// Worker pool used while building the tree in parallel
+   C_ThreadPool *buildPool;
+
+   /// Leaves with sample points closer than CONNECTED_LEAVES_DISTANCE are connected
+   /// and go into each other's PVS
    void FindConnectedLeaves(void);
+   /// Same lookup for a single leaf as a C_ThreadPool task
+   static void FindConnectedLeaves_Task(void *data, int tid);
 
    void IncreaseLeavesDrawn(); // { if ( leafToDraw < nLeaves ) leafToDraw++; cout << leafToDraw << endl;}
    void DecreaseLeavesDrawn(); // { if ( leafToDraw > 0 ) leafToDraw--; cout << leafToDraw << endl;}
@@ -103,8 +295,8 @@ public:
    void IncreaseNodesDrawn(); // { if ( leafToDraw < nLeaves ) leafToDraw++; cout << leafToDraw << endl;}
    void DecreaseNodesDrawn(); // { if ( leafToDraw > 0 ) leafToDraw--; cout << leafToDraw << endl;}
 
-   inline USHORT GetnLeavesToDraw() { return leafToDraw; }
-   inline USHORT GetnNodesToDraw() { return nNodesToDraw; }
+   inline int GetnLeavesToDraw() { return leafToDraw; }
+   inline int GetnNodesToDraw() { return nNodesToDraw; }
 
    void dumpSamplePoints(const char *filename);
 
@@ -117,6 +309,9 @@ public:
    void closeLeafHoles(void);
 
    void DistributeSamplePoints(void);
+   /// Runs task once for every leaf, the leaf being its data.
+   /// Tasks go to a C_ThreadPool when MAX_THREADS > 1
+   void RunLeafTasks(void (*task)(void *data, int tid));
 
    void insertMeshIntoTree(C_MeshGroup *mesh);
 };
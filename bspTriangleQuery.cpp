@@ -0,0 +1,446 @@
+#include "bspTree.h"
+#include "bspNode.h"
+#include "vectors.h"
+#include "bspHelperFunctions.h"
+#include "bspPacket.h"
+
+#include <string.h>
+#include <algorithm>
+
+/**
+ * Ray and point queries against the leaves' triangles.
+ * PrepareTriangleRecords lays the leaf triangles out once per PVS build with everything the
+ * tests need precomputed: the edges for the Moller-Trumbore line test, the plane and the
+ * CalculateUV terms for the point test. Leaves with many triangles also get a small BVH.
+ *
+ * The tests give the same answers as RayTriangleIntersection and PointInTriangle (the lines
+ * are infinite and the same tolerances are used), the BVH boxes are padded to keep it so.
+ *
+ * Points are classified RAY_PACKET_SIZE at a time, one per lane (see bspPacket.h).
+ */
+
+/// Triangle being sorted into a BVH
+typedef struct {
+   float          min[3], max[3];
+   float          centre[3];
+   int            triangle;
+} bvhTriangle_t;
+
+class C_BvhCentreLess {
+public:
+   int axis;
+
+   C_BvhCentreLess(int axis) { this->axis = axis; }
+   bool operator()(const bvhTriangle_t &t1, const bvhTriangle_t &t2) const { return t1.centre[axis] < t2.centre[axis]; }
+};
+
+/// Infinite line through start and end
+typedef struct {
+   float          s[3];
+   float          d[3];
+   /// See InverseDirection
+   float          invD[3];
+} queryLine_t;
+
+/// Appends the BVH of triangles[first .. first + count) to nodes and returns its root
+static int
+BuildBvhNode(vector<bspTriangleBvhNode_t> &nodes, bvhTriangle_t *triangles, int first, int count, int firstRecord)
+{
+   bspTriangleBvhNode_t node;
+   float centreMin[3], centreMax[3];
+
+   for(int k = 0; k < 3; k++) {
+      node.min[k] = centreMin[k] = GREATEST_FLOAT;
+      node.max[k] = centreMax[k] = SMALLEST_FLOAT;
+   }
+
+   for(int i = first; i < first + count; i++) {
+      for(int k = 0; k < 3; k++) {
+         node.min[k] = MIN(node.min[k], triangles[i].min[k]);
+         node.max[k] = MAX(node.max[k], triangles[i].max[k]);
+         centreMin[k] = MIN(centreMin[k], triangles[i].centre[k]);
+         centreMax[k] = MAX(centreMax[k], triangles[i].centre[k]);
+      }
+   }
+
+   int index = nodes.size();
+   nodes.push_back(node);
+
+   if(count <= TRIANGLE_BVH_LEAF_SIZE) {
+      nodes[index].first = firstRecord + first;
+      nodes[index].count = count;
+      return index;
+   }
+
+   /// Median split along the longest axis of the centres
+   int axis = 0;
+   for(int k = 1; k < 3; k++) {
+      if(centreMax[k] - centreMin[k] > centreMax[axis] - centreMin[axis]) {
+         axis = k;
+      }
+   }
+
+   int half = count / 2;
+   nth_element(triangles + first, triangles + first + half, triangles + first + count, C_BvhCentreLess(axis));
+
+   BuildBvhNode(nodes, triangles, first, half, firstRecord);
+   int second = BuildBvhNode(nodes, triangles, first + half, count - half, firstRecord);
+
+   nodes[index].first = second;
+   nodes[index].count = 0;
+
+   return index;
+}
+
+void
+C_BspTree::PrepareTriangleRecords(void)
+{
+   bspTriangleRecords_t *rec = &triangleRecords;
+   const int nArrays = 20;
+   int i, k;
+
+   ReleaseTriangleRecords();
+
+   rec->nRecords = nLeafTriangles;
+   rec->storage = new float[nArrays * MAX(nLeafTriangles, 1)];
+
+   float *array = rec->storage;
+   for(k = 0; k < 3; k++) {
+      rec->v0[k] = array; array += nLeafTriangles;
+      rec->e1[k] = array; array += nLeafTriangles;
+      rec->e2[k] = array; array += nLeafTriangles;
+   }
+   for(k = 0; k < 4; k++) {
+      rec->plane[k] = array; array += nLeafTriangles;
+   }
+   rec->parallel = array; array += nLeafTriangles;
+   rec->dot00 = array; array += nLeafTriangles;
+   rec->dot01 = array; array += nLeafTriangles;
+   rec->dot11 = array; array += nLeafTriangles;
+   rec->invDenom = array;
+
+   /// Order the triangles of every leaf, building the BVHs of the big ones
+   vector<bspTriangleBvhNode_t> nodes;
+   rec->leafBvh = new int[MAX((int)nLeaves, 1)];
+   int *order = new int[MAX(nLeafTriangles, 1)];
+
+   for(i = 0; i < nLeaves; i++) {
+      const C_BspNode *leaf = leaves[i];
+      int first = leaf->triangles - leafTriangles;
+
+      if(leaf->nTriangles <= TRIANGLE_BVH_MIN_TRIANGLES) {
+         rec->leafBvh[i] = -1;
+         for(int t = 0; t < leaf->nTriangles; t++) {
+            order[first + t] = first + t;
+         }
+         continue;
+      }
+
+      bvhTriangle_t *triangles = new bvhTriangle_t[leaf->nTriangles];
+      for(int t = 0; t < leaf->nTriangles; t++) {
+         const triangle_vn *tri = &leafTriangles[first + t];
+         const C_Vertex *vertices[3] = { &tri->vertex0, &tri->vertex1, &tri->vertex2 };
+         C_Vector3 e1(tri->vertex1.x - tri->vertex0.x, tri->vertex1.y - tri->vertex0.y, tri->vertex1.z - tri->vertex0.z);
+         C_Vector3 e2(tri->vertex2.x - tri->vertex0.x, tri->vertex2.y - tri->vertex0.y, tri->vertex2.z - tri->vertex0.z);
+
+         /// The tests accept points up to EPSILON off the plane and barycentric coordinates
+         /// up to EPSILON outside the triangle
+         float pad = EPSILON * (1.0f + 2.0f * (sqrt(C_Vector3::DotProduct(&e1, &e1)) + sqrt(C_Vector3::DotProduct(&e2, &e2))));
+
+         triangles[t].triangle = first + t;
+         for(k = 0; k < 3; k++) {
+            float v[3] = { vertices[k]->x, vertices[k]->y, vertices[k]->z };
+            for(int axis = 0; axis < 3; axis++) {
+               triangles[t].min[axis] = k ? MIN(triangles[t].min[axis], v[axis] - pad) : v[axis] - pad;
+               triangles[t].max[axis] = k ? MAX(triangles[t].max[axis], v[axis] + pad) : v[axis] + pad;
+            }
+         }
+         for(k = 0; k < 3; k++) {
+            triangles[t].centre[k] = (triangles[t].min[k] + triangles[t].max[k]) * 0.5f;
+         }
+      }
+
+      rec->leafBvh[i] = BuildBvhNode(nodes, triangles, 0, leaf->nTriangles, first);
+
+      for(int t = 0; t < leaf->nTriangles; t++) {
+         order[first + t] = triangles[t].triangle;
+      }
+
+      delete[] triangles;
+   }
+
+   rec->nBvhNodes = nodes.size();
+   rec->bvhNodes = new bspTriangleBvhNode_t[MAX(rec->nBvhNodes, 1)];
+   if(rec->nBvhNodes) {
+      memcpy(rec->bvhNodes, &nodes[0], rec->nBvhNodes * sizeof(bspTriangleBvhNode_t));
+   }
+
+   /// Fill in the records
+   for(i = 0; i < nLeafTriangles; i++) {
+      const triangle_vn *tri = &leafTriangles[order[i]];
+      C_Plane plane(&tri->vertex0, &tri->vertex1, &tri->vertex2);
+
+      rec->v0[0][i] = tri->vertex0.x;
+      rec->v0[1][i] = tri->vertex0.y;
+      rec->v0[2][i] = tri->vertex0.z;
+      rec->e1[0][i] = tri->vertex1.x - tri->vertex0.x;
+      rec->e1[1][i] = tri->vertex1.y - tri->vertex0.y;
+      rec->e1[2][i] = tri->vertex1.z - tri->vertex0.z;
+      rec->e2[0][i] = tri->vertex2.x - tri->vertex0.x;
+      rec->e2[1][i] = tri->vertex2.y - tri->vertex0.y;
+      rec->e2[2][i] = tri->vertex2.z - tri->vertex0.z;
+
+      rec->plane[0][i] = plane.a;
+      rec->plane[1][i] = plane.b;
+      rec->plane[2][i] = plane.c;
+      rec->plane[3][i] = plane.d;
+
+      /// A line is parallel to the triangle when the dot product of its direction with the
+      /// unit normal is below EPSILON, as in FindIntersectionPoint_withCheck.
+      /// Moller-Trumbore's determinant is that dot product scaled by |e1 x e2|
+      float nx = rec->e1[1][i] * rec->e2[2][i] - rec->e1[2][i] * rec->e2[1][i];
+      float ny = rec->e1[2][i] * rec->e2[0][i] - rec->e1[0][i] * rec->e2[2][i];
+      float nz = rec->e1[0][i] * rec->e2[1][i] - rec->e1[1][i] * rec->e2[0][i];
+      rec->parallel[i] = EPSILON * sqrt(nx * nx + ny * ny + nz * nz);
+
+      /// Same terms as CalculateUV (its v0 is e2 and its v1 is e1)
+      C_Vector3 e1(rec->e1[0][i], rec->e1[1][i], rec->e1[2][i]);
+      C_Vector3 e2(rec->e2[0][i], rec->e2[1][i], rec->e2[2][i]);
+      rec->dot00[i] = C_Vector3::DotProduct(&e2, &e2);
+      rec->dot01[i] = C_Vector3::DotProduct(&e2, &e1);
+      rec->dot11[i] = C_Vector3::DotProduct(&e1, &e1);
+      rec->invDenom[i] = 1.0f / (rec->dot00[i] * rec->dot11[i] - rec->dot01[i] * rec->dot01[i]);
+   }
+
+   delete[] order;
+}
+
+void
+C_BspTree::ReleaseTriangleRecords(void)
+{
+   delete[] triangleRecords.storage;
+   delete[] triangleRecords.bvhNodes;
+   delete[] triangleRecords.leafBvh;
+   memset(&triangleRecords, 0, sizeof(triangleRecords));
+}
+
+static bool
+LineHitsRecord(const bspTriangleRecords_t *rec, int i, const queryLine_t *line)
+{
+   float tx = line->s[0] - rec->v0[0][i];
+   float ty = line->s[1] - rec->v0[1][i];
+   float tz = line->s[2] - rec->v0[2][i];
+
+   float px = line->d[1] * rec->e2[2][i] - line->d[2] * rec->e2[1][i];
+   float py = line->d[2] * rec->e2[0][i] - line->d[0] * rec->e2[2][i];
+   float pz = line->d[0] * rec->e2[1][i] - line->d[1] * rec->e2[0][i];
+
+   float det = px * rec->e1[0][i] + py * rec->e1[1][i] + pz * rec->e1[2][i];
+   if(det < rec->parallel[i] && det > -rec->parallel[i]) {
+      return false;
+   }
+
+   float qx = ty * rec->e1[2][i] - tz * rec->e1[1][i];
+   float qy = tz * rec->e1[0][i] - tx * rec->e1[2][i];
+   float qz = tx * rec->e1[1][i] - ty * rec->e1[0][i];
+
+   float u = (px * tx + py * ty + pz * tz) / det;
+   float v = (line->d[0] * qx + line->d[1] * qy + line->d[2] * qz) / det;
+
+   return u > -EPSILON && v > -EPSILON && u + v - 1.0f < EPSILON;
+}
+
+static bool
+LineHitsBox(const bspTriangleBvhNode_t *node, const queryLine_t *line)
+{
+   float tMin = SMALLEST_FLOAT, tMax = GREATEST_FLOAT;
+
+   for(int k = 0; k < 3; k++) {
+      float t0 = (node->min[k] - line->s[k]) * line->invD[k];
+      float t1 = (node->max[k] - line->s[k]) * line->invD[k];
+      tMin = MAX(tMin, MIN(t0, t1));
+      tMax = MIN(tMax, MAX(t0, t1));
+   }
+
+   return tMin <= tMax;
+}
+
+bool
+C_BspTree::LineHitsLeaf(const C_BspNode *leaf, const C_Vertex *start, const C_Vertex *end)
+{
+   const bspTriangleRecords_t *rec = &triangleRecords;
+   int first = leaf->triangles - leafTriangles;
+   queryLine_t line;
+
+   assert(rec->storage);
+
+   line.s[0] = start->x;
+   line.s[1] = start->y;
+   line.s[2] = start->z;
+   line.d[0] = end->x - start->x;
+   line.d[1] = end->y - start->y;
+   line.d[2] = end->z - start->z;
+
+   int root = rec->leafBvh[leaf->leafIndex];
+   if(root < 0) {
+      for(int i = first; i < first + leaf->nTriangles; i++) {
+         if(LineHitsRecord(rec, i, &line)) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   for(int k = 0; k < 3; k++) {
+      line.invD[k] = InverseDirection(line.d[k]);
+   }
+
+   int stack[64], nStack = 0;
+   stack[nStack++] = root;
+   while(nStack) {
+      const bspTriangleBvhNode_t *node = &rec->bvhNodes[stack[--nStack]];
+      if(!LineHitsBox(node, &line)) {
+         continue;
+      }
+
+      if(node->count) {
+         for(int i = node->first; i < node->first + node->count; i++) {
+            if(LineHitsRecord(rec, i, &line)) {
+               return true;
+            }
+         }
+      } else {
+         assert(nStack + 2 <= 64);
+         stack[nStack++] = node->first;
+         stack[nStack++] = node - rec->bvhNodes + 1;
+      }
+   }
+
+   return false;
+}
+
+/// Points tested together, one per lane
+typedef struct {
+   packetFloat_t  x, y, z;
+} pointPacket_t;
+
+/// Loads points first .. first + RAY_PACKET_SIZE - 1. Returns the lanes holding a point,
+/// unused lanes repeat the last point
+static unsigned int
+LoadPointPacket(pointPacket_t *packet, const C_Vertex *points, int first, int nPoints)
+{
+   int nLanes = MIN(nPoints - first, RAY_PACKET_SIZE);
+
+   for(int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+      const C_Vertex *point = &points[first + MIN(lane, nLanes - 1)];
+      packet->x[lane] = point->x;
+      packet->y[lane] = point->y;
+      packet->z[lane] = point->z;
+   }
+
+   return ALL_LANES >> (RAY_PACKET_SIZE - nLanes);
+}
+
+/// Returns the active lanes whose point lies on one of records first .. first + count - 1.
+/// Same arithmetic as PointInTriangle
+static unsigned int
+PacketPointsOnRecords(const bspTriangleRecords_t *rec, int first, int count, const pointPacket_t *packet, unsigned int active)
+{
+   unsigned int on = 0;
+
+   for(int i = first; i < first + count && on != active; i++) {
+      packetFloat_t dist = rec->plane[0][i] * packet->x + rec->plane[1][i] * packet->y + rec->plane[2][i] * packet->z + rec->plane[3][i];
+
+      packetFloat_t px = packet->x - rec->v0[0][i];
+      packetFloat_t py = packet->y - rec->v0[1][i];
+      packetFloat_t pz = packet->z - rec->v0[2][i];
+      packetFloat_t dot02 = rec->e2[0][i] * px + rec->e2[1][i] * py + rec->e2[2][i] * pz;
+      packetFloat_t dot12 = rec->e1[0][i] * px + rec->e1[1][i] * py + rec->e1[2][i] * pz;
+      packetFloat_t u = (rec->dot11[i] * dot02 - rec->dot01[i] * dot12) * rec->invDenom[i];
+      packetFloat_t v = (rec->dot00[i] * dot12 - rec->dot01[i] * dot02) * rec->invDenom[i];
+      packetFloat_t uv = u + v - 1.0f;
+
+      packetInt_t hit = (dist < EPSILON) & (dist > -EPSILON) &
+                        (u > -EPSILON) & (v > -EPSILON) & (uv < EPSILON);
+
+      on |= laneBits(&hit) & active;
+   }
+
+   return on;
+}
+
+static unsigned int
+PacketPointsInBox(const float *min, const float *max, const pointPacket_t *packet)
+{
+   packetInt_t inside = (packet->x >= min[0]) & (packet->x <= max[0]) &
+                        (packet->y >= min[1]) & (packet->y <= max[1]) &
+                        (packet->z >= min[2]) & (packet->z <= max[2]);
+
+   return laneBits(&inside);
+}
+
+void
+C_BspTree::PointsOnLeafGeometry(const C_BspNode *leaf, const C_Vertex *points, int nPoints, unsigned char *onGeometry)
+{
+   const bspTriangleRecords_t *rec = &triangleRecords;
+   int root = rec->leafBvh[leaf->leafIndex];
+   pointPacket_t packet;
+
+   assert(rec->storage);
+
+   for(int first = 0; first < nPoints; first += RAY_PACKET_SIZE) {
+      unsigned int active = LoadPointPacket(&packet, points, first, nPoints);
+      unsigned int on = 0;
+
+      if(root < 0) {
+         on = PacketPointsOnRecords(rec, leaf->triangles - leafTriangles, leaf->nTriangles, &packet, active);
+      } else {
+         int stack[64], nStack = 0;
+
+         stack[nStack++] = root;
+         while(nStack && on != active) {
+            const bspTriangleBvhNode_t *node = &rec->bvhNodes[stack[--nStack]];
+            unsigned int lanes = PacketPointsInBox(node->min, node->max, &packet) & active & ~on;
+            if(!lanes) {
+               continue;
+            }
+
+            if(node->count) {
+               on |= PacketPointsOnRecords(rec, node->first, node->count, &packet, lanes);
+            } else {
+               assert(nStack + 2 <= 64);
+               stack[nStack++] = node->first;
+               stack[nStack++] = node - rec->bvhNodes + 1;
+            }
+         }
+      }
+
+      for(int lane = 0; lane < RAY_PACKET_SIZE && first + lane < nPoints; lane++) {
+         onGeometry[first + lane] |= (on >> lane) & 1;
+      }
+   }
+}
+
+void
+PointsOutsideBBox(C_BBox *bbox, const C_Vertex *points, int nPoints, unsigned char *outside)
+{
+   float min[3], max[3];
+   pointPacket_t packet;
+
+   bbox->GetMin(&min[0], &min[1], &min[2]);
+   bbox->GetMax(&max[0], &max[1], &max[2]);
+
+   for(int first = 0; first < nPoints; first += RAY_PACKET_SIZE) {
+      unsigned int active = LoadPointPacket(&packet, points, first, nPoints);
+
+      /// Same tolerance as C_BBox::IsInside
+      packetInt_t insideMask = (packet.x - min[0] > -EPSILON) & (packet.x - max[0] < EPSILON) &
+                               (packet.y - min[1] > -EPSILON) & (packet.y - max[1] < EPSILON) &
+                               (packet.z - min[2] > -EPSILON) & (packet.z - max[2] < EPSILON);
+      unsigned int inside = laneBits(&insideMask);
+
+      for(int lane = 0; lane < RAY_PACKET_SIZE && first + lane < nPoints; lane++) {
+         outside[first + lane] |= ((active & ~inside) >> lane) & 1;
+      }
+   }
+}
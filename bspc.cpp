@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/sysinfo.h>
+#include <sys/time.h>
+
+#include "bspTree.h"
+#include "bspNode.h"
+#include "bspHelperFunctions.h"
+#include "threadPool.h"
+#include "dungeonGenerator.h"
+
+/**
+ * bspc: offline map compiler.
+ * Runs the whole map pipeline (bsp tree, leaf holes, tessellation, PVS) once and
+ * writes a compiled map that the game loads as is.
+ * Links only the bsp, PVS and math code so it can run on machines without any
+ * graphics libraries.
+ */
+
+char MAX_THREADS = 0;
+
+static void
+usage(const char *program)
+{
+   printf("Usage: %s [-d depth] [-t threads] [-p] [-b] [-r step] [-g XxY [-e density] [-c length] [-s seed]] <map.bsp> [map.cbsp]\n", program);
+   printf("\t-d depth     Maximum bsp tree depth (default 6)\n");
+   printf("\t-t threads   Number of threads to use (default all cpu cores)\n");
+   printf("\t-p           Build the PVS from the portals between the leaves instead of casting rays\n");
+   printf("\t-b           Build the PVS with both methods, compare them and exit\n");
+   printf("\t-r step      Same as -b, also checking both against a brute force reference that casts\n");
+   printf("\t             rays between points laid every step units in the leaves\n");
+   printf("\t-g XxY       Generate a dungeon of XxY tiles into map.bsp and map.txt first\n");
+   printf("\t-e density   Chance (0 - 1) of every cell of the generated dungeon to hold a room (default 0.5)\n");
+   printf("\t-c length    Length of the generated dungeon's corridors in tiles (default 4)\n");
+   printf("\t-s seed      Seed of the generated dungeon (default 1)\n");
+   printf("The ray sampled PVS is read from/written to the .pvs file next to the .bsp file.\n");
+   printf("If no output file is given the .bsp extension is replaced by .cbsp\n");
+}
+
+static double
+elapsedSeconds(const timeval *start)
+{
+   timeval end;
+   gettimeofday(&end, NULL);
+
+   return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/// Brute force reference visibility. Task data for a single leaf
+typedef struct {
+   C_BspTree               *tree;
+   /// Grid points lying in every leaf
+   const vector<C_Vertex>  *leafPoints;
+   /// Leaves' bboxes, padded by EPSILON
+   const C_Vertex          *boxMin;
+   const C_Vertex          *boxMax;
+   int                     leaf;
+   /// Leaves with a greater index visible from leaf
+   C_BitSet                visible;
+} referenceTask_t;
+
+/// True if the segment start + t * dir, 0 <= t <= 1, crosses the box
+static bool
+segmentHitsBox(const C_Vertex *start, const C_Vertex *invDir, const C_Vertex *boxMin, const C_Vertex *boxMax)
+{
+   float tMin = 0.0f, tMax = 1.0f;
+   const float s[3] = { start->x, start->y, start->z };
+   const float inv[3] = { invDir->x, invDir->y, invDir->z };
+   const float lo[3] = { boxMin->x, boxMin->y, boxMin->z };
+   const float hi[3] = { boxMax->x, boxMax->y, boxMax->z };
+
+   for(int axis = 0; axis < 3; axis++) {
+      float t0 = (lo[axis] - s[axis]) * inv[axis];
+      float t1 = (hi[axis] - s[axis]) * inv[axis];
+      tMin = MAX(tMin, MIN(t0, t1));
+      tMax = MIN(tMax, MAX(t0, t1));
+   }
+
+   return tMin <= tMax;
+}
+
+/// True if the segment start + t * dir, 0 < t < 1, crosses the triangle. Edges are included
+/// (within EPSILON) so rays don't leak between the triangles of a wall
+static bool
+segmentHitsTriangle(const C_Vertex *start, const C_Vertex *dir, const triangle_vn *triangle)
+{
+   const C_Vertex *v0 = &triangle->vertex0;
+   C_Vertex e1 = { triangle->vertex1.x - v0->x, triangle->vertex1.y - v0->y, triangle->vertex1.z - v0->z };
+   C_Vertex e2 = { triangle->vertex2.x - v0->x, triangle->vertex2.y - v0->y, triangle->vertex2.z - v0->z };
+   C_Vertex p = math::CrossProduct(dir, &e2);
+
+   float det = C_Vector3::DotProduct(&e1, &p);
+   if(fabs(det) < 1.0e-12f) {
+      return false;
+   }
+
+   C_Vertex t = { start->x - v0->x, start->y - v0->y, start->z - v0->z };
+   float u = C_Vector3::DotProduct(&t, &p) / det;
+   if(u < -EPSILON || u > 1.0f + EPSILON) {
+      return false;
+   }
+
+   C_Vertex q = math::CrossProduct(&t, &e1);
+   float v = C_Vector3::DotProduct(dir, &q) / det;
+   if(v < -EPSILON || u + v > 1.0f + EPSILON) {
+      return false;
+   }
+
+   float dist = C_Vector3::DotProduct(&e2, &q) / det;
+   return dist > EPSILON && dist < 1.0f - EPSILON;
+}
+
+static bool
+segmentBlocked(const referenceTask_t *data, const C_Vertex *start, const C_Vertex *end)
+{
+   C_BspTree *tree = data->tree;
+   C_Vertex dir = { end->x - start->x, end->y - start->y, end->z - start->z };
+   C_Vertex invDir = { InverseDirection(dir.x), InverseDirection(dir.y), InverseDirection(dir.z) };
+
+   for(int l = 0; l < tree->nLeaves; l++) {
+      if(!segmentHitsBox(start, &invDir, &data->boxMin[l], &data->boxMax[l])) {
+         continue;
+      }
+
+      const C_BspNode *leaf = tree->leaves[l];
+      for(int i = 0; i < leaf->nTriangles; i++) {
+         if(segmentHitsTriangle(start, &dir, &leaf->triangles[i])) {
+            return true;
+         }
+      }
+   }
+
+   return false;
+}
+
+/// Finds the leaves following data->leaf visible from it. Only writes its own bit set
+static void
+referenceVisibility_Task(void *data_, int tid)
+{
+   referenceTask_t *data = (referenceTask_t *)data_;
+   const vector<C_Vertex> &points1 = data->leafPoints[data->leaf];
+
+   for(int l = data->leaf + 1; l < data->tree->nLeaves; l++) {
+      const vector<C_Vertex> &points2 = data->leafPoints[l];
+      bool visible = false;
+
+      for(unsigned int p1 = 0; p1 < points1.size() && !visible; p1++) {
+         for(unsigned int p2 = 0; p2 < points2.size() && !visible; p2++) {
+            visible = !segmentBlocked(data, &points1[p1], &points2[p2]);
+         }
+      }
+
+      if(visible) {
+         data->visible.Set(l);
+      }
+   }
+}
+
+/**
+ * Dense visibility reference: points are laid on a grid of the given step over the whole map
+ * and go to the leaf FindLeaf puts them in, the leaf the camera would be drawn from. Two
+ * leaves see each other if any segment between their points crosses no triangle.
+ * Every triangle is tested, nothing is shared with the PVS code but FindLeaf and the
+ * PointsOnLeafGeometry test dropping the points lying on walls.
+ * Returns the number of leaves left without points. Those see nothing.
+ */
+static int
+referencePVS(C_BspTree *tree, float step, C_BitSet *reference)
+{
+   int i, j, nLeaves = tree->nLeaves;
+   vector<C_Vertex> *leafPoints = new vector<C_Vertex>[nLeaves];
+   C_Vertex *boxMin = new C_Vertex[nLeaves];
+   C_Vertex *boxMax = new C_Vertex[nLeaves];
+   C_Vertex mapMin, mapMax;
+
+   tree->bbox.GetMin(&mapMin);
+   tree->bbox.GetMax(&mapMax);
+
+   /// Cell centers, so points don't fall on the walls lying on round coordinates
+   for(float x = mapMin.x + step / 2.0f; x < mapMax.x; x += step) {
+      for(float y = mapMin.y + step / 2.0f; y < mapMax.y; y += step) {
+         for(float z = mapMin.z + step / 2.0f; z < mapMax.z; z += step) {
+            C_Vector3 point(x, y, z);
+            int node = tree->FindLeaf(&point);
+            if(node >= 0) {
+               C_Vertex vertex = { x, y, z };
+               int leaf = tree->flatNodes[node].leaf;
+
+               /// Space around the leaf's geometry is outside the map
+               if(tree->leaves[leaf]->bbox.IsInside(&vertex)) {
+                  leafPoints[leaf].push_back(vertex);
+               }
+            }
+         }
+      }
+   }
+
+   for(i = 0; i < nLeaves; i++) {
+      tree->leaves[i]->bbox.GetMin(&boxMin[i]);
+      tree->leaves[i]->bbox.GetMax(&boxMax[i]);
+      boxMin[i].x -= EPSILON; boxMin[i].y -= EPSILON; boxMin[i].z -= EPSILON;
+      boxMax[i].x += EPSILON; boxMax[i].y += EPSILON; boxMax[i].z += EPSILON;
+   }
+
+   /// Centers still fall on walls when the step doesn't divide the wall spacing (with a step of 8
+   /// the center of [16, 24] is on a wall at 20) and they would see through them. Drop the points
+   /// lying on the geometry of their leaf or of the leaves touching it, as CleanUpPointSet does
+   tree->PrepareTriangleRecords();
+
+   int nPoints = 0, unsampled = 0;
+   for(i = 0; i < nLeaves; i++) {
+      vector<C_Vertex> &points = leafPoints[i];
+      vector<unsigned char> onGeometry(points.size(), 0);
+
+      for(j = 0; j < nLeaves && points.size(); j++) {
+         if(boxMin[j].x <= boxMax[i].x && boxMax[j].x >= boxMin[i].x &&
+            boxMin[j].y <= boxMax[i].y && boxMax[j].y >= boxMin[i].y &&
+            boxMin[j].z <= boxMax[i].z && boxMax[j].z >= boxMin[i].z) {
+            tree->PointsOnLeafGeometry(tree->leaves[j], &points[0], points.size(), &onGeometry[0]);
+         }
+      }
+
+      int kept = 0;
+      for(unsigned int p = 0; p < points.size(); p++) {
+         if(!onGeometry[p]) {
+            points[kept++] = points[p];
+         }
+      }
+      points.resize(kept);
+
+      nPoints += points.size();
+      unsampled += points.empty();
+   }
+
+   tree->ReleaseTriangleRecords();
+
+   printf("\nBrute force reference: %d points (step %.2f)...", nPoints, step);
+   fflush(stdout);
+
+   timeval start;
+   gettimeofday(&start, NULL);
+
+   referenceTask_t *tasks = new referenceTask_t[nLeaves];
+   C_ThreadPool *pool = MAX_THREADS > 1 ? new C_ThreadPool(MAX_THREADS) : NULL;
+
+   for(i = 0; i < nLeaves; i++) {
+      tasks[i].tree = tree;
+      tasks[i].leafPoints = leafPoints;
+      tasks[i].boxMin = boxMin;
+      tasks[i].boxMax = boxMax;
+      tasks[i].leaf = i;
+      tasks[i].visible.Resize(nLeaves);
+
+      if(pool) {
+         pool->addTask(referenceVisibility_Task, &tasks[i]);
+      } else {
+         referenceVisibility_Task(&tasks[i], 0);
+      }
+   }
+
+   if(pool) {
+      pool->wait();
+      delete pool;
+   }
+
+   printf(" Done (%.2f s)\n", elapsedSeconds(&start));
+
+   for(i = 0; i < nLeaves; i++) {
+      reference[i].Resize(nLeaves);
+   }
+
+   for(i = 0; i < nLeaves; i++) {
+      for(j = tasks[i].visible.NextSetBit(0); j >= 0; j = tasks[i].visible.NextSetBit(j + 1)) {
+         reference[i].Set(j);
+         reference[j].Set(i);
+      }
+   }
+
+   delete[] tasks;
+   delete[] leafPoints;
+   delete[] boxMin;
+   delete[] boxMax;
+
+   return unsampled;
+}
+
+/// Prints how a PVS compares to the reference. Leaves always see themselves so the diagonal is skipped
+static void
+comparePVS(const char *method, const C_BitSet *pvs, const C_BitSet *reference, int nLeaves)
+{
+   int falseNegatives = 0, leavesMissing = 0, extra = 0;
+
+   for(int i = 0; i < nLeaves; i++) {
+      int missing = 0;
+
+      for(int j = 0; j < nLeaves; j++) {
+         if(i == j) {
+            continue;
+         }
+
+         missing += reference[i].Test(j) && !pvs[i].Test(j);
+         extra += !reference[i].Test(j) && pvs[i].Test(j);
+      }
+
+      falseNegatives += missing;
+      leavesMissing += missing > 0;
+   }
+
+   printf("\t%-14s %16d %16d %14d\n", method, falseNegatives, leavesMissing, extra);
+}
+
+/**
+ * Builds the PVS with both methods and prints their build times and sizes.
+ * Rays are always traced (the .pvs file is not used) so that the times can be compared.
+ * If referenceStep is greater than 0 both are checked against referencePVS.
+ */
+static void
+benchmarkPVS(C_BspTree *tree, float referenceStep)
+{
+   int i, j;
+   timeval start;
+   int nLeaves = tree->nLeaves;
+   C_BitSet *portalPVS = new C_BitSet[nLeaves];
+
+   gettimeofday(&start, NULL);
+   tree->BuildPVS(NULL, PVS_PORTAL_FLOW);
+   double portalTime = elapsedSeconds(&start);
+
+   for(i = 0; i < nLeaves; i++) {
+      portalPVS[i].Resize(nLeaves);
+      portalPVS[i].Or(&tree->leaves[i]->PVS);
+      tree->leaves[i]->PVS.ClearAll();
+   }
+
+   gettimeofday(&start, NULL);
+   tree->BuildPVS(NULL, PVS_RAY_SAMPLING);
+   double rayTime = elapsedSeconds(&start);
+
+   int raySize = 0, portalSize = 0, onlyRays = 0, onlyPortals = 0;
+   for(i = 0; i < nLeaves; i++) {
+      C_BitSet *rays = &tree->leaves[i]->PVS;
+
+      raySize += rays->Count();
+      portalSize += portalPVS[i].Count();
+
+      for(j = 0; j < nLeaves; j++) {
+         onlyRays += rays->Test(j) && !portalPVS[i].Test(j);
+         onlyPortals += !rays->Test(j) && portalPVS[i].Test(j);
+      }
+   }
+
+   const pvsBuildTimes_t *times = &tree->pvsTimes;
+   float pairs = (float)nLeaves * nLeaves / 100.0f;
+
+   printf("\nPVS benchmark (%d leaves, %lu portals)\n", nLeaves, (unsigned long)tree->portals.size());
+   printf("\t%-14s %10s %14s %12s %10s\n", "method", "time (s)", "visible pairs", "avg / leaf", "density");
+   printf("\t%-14s %10.3f %14d %12.2f %9.2f%%\n", "ray sampling", rayTime, raySize, (float)raySize / nLeaves, raySize / pairs);
+   printf("\t%-14s %10.3f %14d %12.2f %9.2f%%\n", "portal flow", portalTime, portalSize, (float)portalSize / nLeaves, portalSize / pairs);
+   printf("\tSeen only by ray sampling: %d\n", onlyRays);
+   printf("\tSeen only by portal flow: %d\n", onlyPortals);
+
+   printf("\nRay sampling phases (s)\n");
+   printf("\t%-24s %8.3f\n", "triangle records", times->triangleRecords);
+   printf("\t%-24s %8.3f\n", "sample distribution", times->sampleDistribution);
+   printf("\t%-24s %8.3f\n", "connected leaves", times->connectedLeaves);
+   printf("\t%-24s %8.3f\n", "point clean up", times->pointCleanup);
+   printf("\t%-24s %8.3f\n", "tracing", times->tracing);
+
+   if(referenceStep > 0.0f) {
+      C_BitSet *reference = new C_BitSet[nLeaves];
+      C_BitSet *rayPVS = new C_BitSet[nLeaves];
+      int unsampled = referencePVS(tree, referenceStep, reference);
+
+      int referenceSize = 0;
+      for(i = 0; i < nLeaves; i++) {
+         referenceSize += reference[i].Count();
+         rayPVS[i].Resize(nLeaves);
+         rayPVS[i].Or(&tree->leaves[i]->PVS);
+      }
+
+      printf("\t%d visible pairs (not counting leaves seeing themselves), density %.2f%%, %d leaves without points\n",
+             referenceSize, referenceSize / pairs, unsampled);
+      printf("\t%-14s %16s %16s %14s\n", "method", "false negatives", "leaves affected", "not visible");
+      comparePVS("ray sampling", rayPVS, reference, nLeaves);
+      comparePVS("portal flow", portalPVS, reference, nLeaves);
+
+      delete[] reference;
+      delete[] rayPVS;
+   }
+
+   delete[] portalPVS;
+}
+
+/// Replaces fileName's extension (if any) with ext
+static string
+replaceExtension(const char *fileName, const char *ext)
+{
+   string name(fileName);
+   size_t dot = name.find_last_of('.');
+   size_t slash = name.find_last_of('/');
+
+   if(dot != string::npos && (slash == string::npos || dot > slash)) {
+      name.erase(dot);
+   }
+
+   return name + ext;
+}
+
+int
+main(int argc, char *argv[])
+{
+   int depth = 6;
+   int threads = get_nprocs();
+   bool portals = false;
+   bool benchmark = false;
+   float referenceStep = 0.0f;
+   const char *inFile = NULL;
+   const char *outFile = NULL;
+   bool generate = false;
+   dungeonSettings_t dungeon = {0, 0, 0.5f, 4, 1};
+
+   for(int i = 1; i < argc; i++) {
+      if(!strcmp(argv[i], "-d") && i + 1 < argc) {
+         depth = atoi(argv[++i]);
+      } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+         threads = atoi(argv[++i]);
+      } else if(!strcmp(argv[i], "-p")) {
+         portals = true;
+      } else if(!strcmp(argv[i], "-b")) {
+         benchmark = true;
+      } else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+         benchmark = true;
+         referenceStep = atof(argv[++i]);
+      } else if(!strcmp(argv[i], "-g") && i + 1 < argc) {
+         generate = sscanf(argv[++i], "%dx%d", &dungeon.tilesOnX, &dungeon.tilesOnY) == 2;
+         if(!generate) {
+            usage(argv[0]);
+            return 1;
+         }
+      } else if(!strcmp(argv[i], "-e") && i + 1 < argc) {
+         dungeon.roomDensity = atof(argv[++i]);
+      } else if(!strcmp(argv[i], "-c") && i + 1 < argc) {
+         dungeon.corridorLength = atoi(argv[++i]);
+      } else if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+         dungeon.seed = strtoul(argv[++i], NULL, 10);
+      } else if(argv[i][0] == '-') {
+         usage(argv[0]);
+         return 1;
+      } else if(!inFile) {
+         inFile = argv[i];
+      } else if(!outFile) {
+         outFile = argv[i];
+      } else {
+         usage(argv[0]);
+         return 1;
+      }
+   }
+
+   if(!inFile || depth <= 0 || threads <= 0 || referenceStep < 0.0f) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   MAX_THREADS = MIN(threads, 127);
+
+   string pvsFile = replaceExtension(inFile, ".pvs");
+   string cbspFile = outFile ? string(outFile) : replaceExtension(inFile, ".cbsp");
+
+   if(generate) {
+      C_Dungeon generator;
+      string tileFile = replaceExtension(inFile, ".txt");
+      timeval start;
+
+      gettimeofday(&start, NULL);
+      if(!generator.Generate(&dungeon) || !generator.WriteTileMap(tileFile.c_str()) ||
+         !generator.WriteGeometryFile(inFile)) {
+         printf("Failed to generate the dungeon\n");
+         return 1;
+      }
+      printf("Dungeon generated in %.3f s\n", elapsedSeconds(&start));
+   }
+
+   printf("Compiling \"%s\" using %d threads.\n", inFile, MAX_THREADS);
+
+   C_BspTree tree(depth);
+   if(!tree.ReadGeometryFile(inFile)) {
+      return 1;
+   }
+
+   tree.BuildBspTree();
+
+   if(benchmark) {
+      benchmarkPVS(&tree, referenceStep);
+      return 0;
+   }
+
+   tree.BuildPVS(pvsFile.c_str(), portals ? PVS_PORTAL_FLOW : PVS_RAY_SAMPLING);
+
+   if(!tree.WriteCompiledMap(cbspFile.c_str(), inFile)) {
+      printf("Failed to write \"%s\"\n", cbspFile.c_str());
+      return 1;
+   }
+
+   printf("Done.\n");
+
+   return 0;
+}
@@ -0,0 +1,316 @@
+#include "dungeonGenerator.h"
+#include "math.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define VOID_TILE       packTile(TILE_0, AREA_VOID)
+#define WALKABLE_TILE   packTile(TILE_0, AREA_WALKABLE)
+#define WALL_TILE       packTile(TILE_WALL, AREA_WALL)
+
+C_Dungeon::C_Dungeon(void)
+{
+   tilesOnX = tilesOnY = 0;
+   tiles = NULL;
+   startX = startY = -1;
+   randomState = 1;
+}
+
+C_Dungeon::~C_Dungeon(void)
+{
+   if(tiles) {
+      delete[] tiles;
+      tiles = NULL;
+   }
+}
+
+int
+C_Dungeon::Random(int range)
+{
+   assert(range > 0);
+
+   randomState = randomState * 1664525u + 1013904223u;
+   return (int)((randomState >> 8) % (unsigned int)range);
+}
+
+bool
+C_Dungeon::Generate(const dungeonSettings_t *settings)
+{
+   const int cellSize = DUNGEON_MAX_ROOM_SIZE + settings->corridorLength;
+   int i, cx, cy;
+
+   /// A one tile border is left for the walls
+   if(settings->tilesOnX < DUNGEON_MIN_ROOM_SIZE + 2 || settings->tilesOnY < DUNGEON_MIN_ROOM_SIZE + 2 ||
+      settings->corridorLength < 1 || settings->roomDensity < 0.0f || settings->roomDensity > 1.0f) {
+      printf("%s: Invalid dungeon settings\n", __FUNCTION__);
+      return false;
+   }
+
+   tilesOnX = settings->tilesOnX;
+   tilesOnY = settings->tilesOnY;
+   randomState = settings->seed;
+
+   delete[] tiles;
+   tiles = new tile_t[tilesOnX * tilesOnY];
+   memset(tiles, VOID_TILE, tilesOnX * tilesOnY * sizeof(tile_t));
+   rooms.clear();
+
+   /// n cells need n * DUNGEON_MAX_ROOM_SIZE + (n - 1) * corridorLength tiles
+   const int cellsX = MAX(1, (tilesOnX - 2 + settings->corridorLength) / cellSize);
+   const int cellsY = MAX(1, (tilesOnY - 2 + settings->corridorLength) / cellSize);
+   const int chance = (int)(settings->roomDensity * 1000.0f);
+   int *cellRooms = new int[cellsX * cellsY];
+
+   /// Place the rooms
+   for(cx = 0; cx < cellsX; cx++) {
+      for(cy = 0; cy < cellsY; cy++) {
+         cellRooms[cx * cellsY + cy] = -1;
+
+         /// There must be at least one room
+         if(Random(1000) >= chance && (cx < cellsX - 1 || cy < cellsY - 1 || rooms.size())) {
+            continue;
+         }
+
+         dungeonRoom_t room;
+         int originX = 1 + cx * cellSize, originY = 1 + cy * cellSize;
+         int spaceX = MIN(DUNGEON_MAX_ROOM_SIZE, tilesOnX - 1 - originX);
+         int spaceY = MIN(DUNGEON_MAX_ROOM_SIZE, tilesOnY - 1 - originY);
+
+         /// MIN evaluates its arguments twice
+         room.sizeX = DUNGEON_MIN_ROOM_SIZE + Random(DUNGEON_MAX_ROOM_SIZE - DUNGEON_MIN_ROOM_SIZE + 1);
+         room.sizeY = DUNGEON_MIN_ROOM_SIZE + Random(DUNGEON_MAX_ROOM_SIZE - DUNGEON_MIN_ROOM_SIZE + 1);
+         room.sizeX = MIN(spaceX, room.sizeX);
+         room.sizeY = MIN(spaceY, room.sizeY);
+         room.x = originX + Random(spaceX - room.sizeX + 1);
+         room.y = originY + Random(spaceY - room.sizeY + 1);
+
+         cellRooms[cx * cellsY + cy] = rooms.size();
+         rooms.push_back(room);
+         CarveRoom(&room);
+      }
+   }
+
+   /// Chain the rooms in a serpentine order so that every one of them can be reached...
+   int previous = -1;
+   for(cx = 0; cx < cellsX; cx++) {
+      for(i = 0; i < cellsY; i++) {
+         cy = (cx & 1) ? cellsY - 1 - i : i;
+
+         int current = cellRooms[cx * cellsY + cy];
+         if(current < 0) {
+            continue;
+         }
+
+         if(previous >= 0) {
+            CarveCorridor(&rooms[previous], &rooms[current]);
+         }
+         previous = current;
+      }
+   }
+
+   /// ...and make some loops
+   for(cx = 0; cx < cellsX - 1; cx++) {
+      for(cy = 0; cy < cellsY; cy++) {
+         int current = cellRooms[cx * cellsY + cy];
+         int next = cellRooms[(cx + 1) * cellsY + cy];
+
+         if(current >= 0 && next >= 0 && Random(2)) {
+            CarveCorridor(&rooms[current], &rooms[next]);
+         }
+      }
+   }
+
+   delete[] cellRooms;
+
+   BuildWalls();
+
+   startX = rooms[0].x + rooms[0].sizeX / 2;
+   startY = rooms[0].y + rooms[0].sizeY / 2;
+   tiles[startX * tilesOnY + startY] = packTile(TILE_4, AREA_WALKABLE);
+
+   int nWalkable = 0, nWalls = 0;
+   for(i = 0; i < tilesOnX * tilesOnY; i++) {
+      nWalkable += tileArea(tiles[i]) == AREA_WALKABLE;
+      nWalls += tileType(tiles[i]) == TILE_WALL;
+   }
+
+   printf("Dungeon %dx%d (seed %u): %d rooms in %dx%d cells, %d walkable and %d wall tiles\n",
+          tilesOnX, tilesOnY, settings->seed, (int)rooms.size(), cellsX, cellsY, nWalkable, nWalls);
+
+   return true;
+}
+
+void
+C_Dungeon::CarveRoom(const dungeonRoom_t *room)
+{
+   for(int x = room->x; x < room->x + room->sizeX; x++) {
+      for(int y = room->y; y < room->y + room->sizeY; y++) {
+         tiles[x * tilesOnY + y] = WALKABLE_TILE;
+      }
+   }
+}
+
+void
+C_Dungeon::CarveCorridor(const dungeonRoom_t *from, const dungeonRoom_t *to)
+{
+   int x0 = from->x + from->sizeX / 2, y0 = from->y + from->sizeY / 2;
+   int x1 = to->x + to->sizeX / 2, y1 = to->y + to->sizeY / 2;
+   int x, y;
+
+   /// Bend at (x1, y0) or at (x0, y1)
+   int bendX = x1, bendY = y0;
+   if(Random(2)) {
+      bendX = x0;
+      bendY = y1;
+   }
+
+   for(x = MIN(x0, bendX); x <= MAX(x0, bendX); x++) tiles[x * tilesOnY + y0] = WALKABLE_TILE;
+   for(y = MIN(y0, bendY); y <= MAX(y0, bendY); y++) tiles[x0 * tilesOnY + y] = WALKABLE_TILE;
+   for(x = MIN(bendX, x1); x <= MAX(bendX, x1); x++) tiles[x * tilesOnY + y1] = WALKABLE_TILE;
+   for(y = MIN(bendY, y1); y <= MAX(bendY, y1); y++) tiles[x1 * tilesOnY + y] = WALKABLE_TILE;
+}
+
+void
+C_Dungeon::BuildWalls(void)
+{
+   for(int x = 0; x < tilesOnX; x++) {
+      for(int y = 0; y < tilesOnY; y++) {
+         if(IsWalkable(x, y)) {
+            continue;
+         }
+
+         for(int nx = x - 1; nx <= x + 1; nx++) {
+            for(int ny = y - 1; ny <= y + 1; ny++) {
+               if(IsWalkable(nx, ny)) {
+                  tiles[x * tilesOnY + y] = WALL_TILE;
+               }
+            }
+         }
+      }
+   }
+}
+
+/**
+ * Finds the walls between walkable and not walkable tiles, merging the ones in line.
+ * Tile x runs along the world's z axis and tile y along the world's x axis (see C_Map::placeObjects).
+ * The walls face the walkable tiles
+ */
+void
+C_Dungeon::FindWalls(vector<dungeonWall_t> *walls)
+{
+   dungeonWall_t wall;
+   int x, y, side, runStart;
+
+   /// Walls on the tiles' x sides run along y
+   for(x = 0; x < tilesOnX; x++) {
+      for(side = -1; side <= 1; side += 2) {
+         runStart = -1;
+         for(y = 0; y <= tilesOnY; y++) {
+            bool edge = y < tilesOnY && IsWalkable(x, y) && !IsWalkable(x + side, y);
+
+            if(edge && runStart < 0) {
+               runStart = y;
+            } else if(!edge && runStart >= 0) {
+               wall.z0 = wall.z1 = (side < 0 ? x : x + 1) * TILE_SIZE;
+               wall.x0 = (side < 0 ? y : runStart) * TILE_SIZE;
+               wall.x1 = (side < 0 ? runStart : y) * TILE_SIZE;
+               walls->push_back(wall);
+               runStart = -1;
+            }
+         }
+      }
+   }
+
+   /// Walls on the tiles' y sides run along x
+   for(y = 0; y < tilesOnY; y++) {
+      for(side = -1; side <= 1; side += 2) {
+         runStart = -1;
+         for(x = 0; x <= tilesOnX; x++) {
+            bool edge = x < tilesOnX && IsWalkable(x, y) && !IsWalkable(x, y + side);
+
+            if(edge && runStart < 0) {
+               runStart = x;
+            } else if(!edge && runStart >= 0) {
+               wall.x0 = wall.x1 = (side < 0 ? y : y + 1) * TILE_SIZE;
+               wall.z0 = (side < 0 ? runStart : x) * TILE_SIZE;
+               wall.z1 = (side < 0 ? x : runStart) * TILE_SIZE;
+               walls->push_back(wall);
+               runStart = -1;
+            }
+         }
+      }
+   }
+}
+
+/**
+ * Same format as the level editor's map.txt: the size on x and y and the number of tiles,
+ * then one "x y type area [parameter]" line per tile
+ */
+bool
+C_Dungeon::WriteTileMap(const char *fileName)
+{
+   FILE *fd;
+
+   if((fd = fopen(fileName, "w")) == NULL) {
+      printf("Couldn't open \"%s\"\n", fileName);
+      return false;
+   }
+
+   fprintf(fd, "%d\n%d\n%d\n", tilesOnX, tilesOnY, tilesOnX * tilesOnY);
+
+   for(int x = 0; x < tilesOnX; x++) {
+      for(int y = 0; y < tilesOnY; y++) {
+         tile_t tile = tiles[x * tilesOnY + y];
+
+         fprintf(fd, "%d %d %d %d%s\n", x, y, tileType(tile), tileArea(tile),
+                 x == startX && y == startY ? " STARTPOINT" : "");
+      }
+   }
+
+   bool ok = !ferror(fd);
+   fclose(fd);
+
+   return ok;
+}
+
+/**
+ * Same format C_BspTree::ReadGeometryFile reads: the number of polygons and brushes, then for every
+ * brush its number of polygons and for every polygon its number of vertices and the vertices.
+ * All walls go in one brush, TILE_SIZE high and centered on y = 0 like the level editor does
+ */
+bool
+C_Dungeon::WriteGeometryFile(const char *fileName)
+{
+   vector<dungeonWall_t> walls;
+   FILE *fd;
+
+   FindWalls(&walls);
+
+   if((fd = fopen(fileName, "wb")) == NULL) {
+      printf("Couldn't open \"%s\"\n", fileName);
+      return false;
+   }
+
+   int nPolys = walls.size(), nBrushes = 1, nVertices = 4;
+   fwrite(&nPolys, sizeof(int), 1, fd);
+   fwrite(&nBrushes, sizeof(int), 1, fd);
+   fwrite(&nPolys, sizeof(int), 1, fd);
+
+   for(unsigned int i = 0; i < walls.size(); i++) {
+      const float bottom = -TILE_SIZE / 2.0f, top = TILE_SIZE / 2.0f;
+      float quad[4][3] = {{walls[i].x0, bottom, walls[i].z0},
+                          {walls[i].x1, bottom, walls[i].z1},
+                          {walls[i].x1, top,    walls[i].z1},
+                          {walls[i].x0, top,    walls[i].z0}};
+
+      fwrite(&nVertices, sizeof(int), 1, fd);
+      fwrite(quad, sizeof(quad), 1, fd);
+   }
+
+   bool ok = !ferror(fd);
+   fclose(fd);
+
+   printf("%d walls written to \"%s\"\n", nPolys, fileName);
+
+   return ok;
+}
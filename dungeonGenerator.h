@@ -0,0 +1,78 @@
+#ifndef _DUNGEON_GENERATOR_H_
+#define _DUNGEON_GENERATOR_H_
+
+#include "globals.h"
+#include "tile.h"
+
+#include <vector>
+
+#define DUNGEON_MIN_ROOM_SIZE          3     /// Rooms are 3x3 to 8x8 tiles
+#define DUNGEON_MAX_ROOM_SIZE          8
+
+typedef struct {
+   /// Map size in tiles
+   int tilesOnX, tilesOnY;
+   /// Chance (0 - 1) of every cell of the dungeon's grid to hold a room
+   float roomDensity;
+   /// Tiles between two neighbouring cells. That's the length of the corridors between adjacent rooms
+   int corridorLength;
+   /// The same settings and seed always give the same dungeon
+   unsigned int seed;
+} dungeonSettings_t;
+
+typedef struct {
+   int x, y;            /// First tile
+   int sizeX, sizeY;
+} dungeonRoom_t;
+
+/// A wall quad's base line, on the xz plane. Walls face to the left of (x0, z0) -> (x1, z1)
+typedef struct {
+   float x0, z0;
+   float x1, z1;
+} dungeonWall_t;
+
+/**
+ * Procedural dungeon generator.
+ * The map is split in a grid of cells DUNGEON_MAX_ROOM_SIZE + corridorLength tiles wide.
+ * Every cell gets a room with a chance of roomDensity. The rooms are chained with L shaped
+ * corridors in a serpentine order through the grid (so all of them are reachable), and some
+ * are also linked to the room right below to make loops. Every tile next to a walkable one
+ * becomes a wall.
+ * The dungeon is written in the same two files the level editor makes: the tile map (.txt)
+ * and the walls extruded to quads (.bsp), so it can be fed to bspc and the game.
+ */
+class C_Dungeon {
+public:
+   C_Dungeon(void);
+   ~C_Dungeon(void);
+
+   bool Generate(const dungeonSettings_t *settings);
+
+   bool WriteTileMap(const char *fileName);
+   bool WriteGeometryFile(const char *fileName);
+
+   int tilesOnX, tilesOnY;
+   /// Same layout as C_Map's tiles: tile (x, y) is at tiles[x * tilesOnY + y]
+   tile_t *tiles;
+   vector<dungeonRoom_t> rooms;
+   /// The start point is in the middle of the first room
+   int startX, startY;
+
+private:
+   unsigned int randomState;
+
+   /// Own generator so that a seed gives the same dungeon on every platform
+   int Random(int range);
+
+   inline bool IsWalkable(int x, int y) const
+   {
+      return x >= 0 && x < tilesOnX && y >= 0 && y < tilesOnY && tileArea(tiles[x * tilesOnY + y]) == AREA_WALKABLE;
+   }
+
+   void CarveRoom(const dungeonRoom_t *room);
+   void CarveCorridor(const dungeonRoom_t *from, const dungeonRoom_t *to);
+   void BuildWalls(void);
+   void FindWalls(vector<dungeonWall_t> *walls);
+};
+
+#endif
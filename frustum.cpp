@@ -1,5 +1,7 @@
 #include "frustum.h"
+#include "bspPacket.h"
 #include <GL/glut.h>
+#include <string.h>
 
 C_Frustum::C_Frustum(void)
 {
@@ -205,3 +207,85 @@ int C_Frustum::cubeInFrustum2(const C_BBox* box) const
 
    return 0;
 }
+
+bool C_Frustum::boxInFrustum(const float *min , const float *max , unsigned int *planeMask) const
+{
+   for(int i = 0 ; i < 6 ; i++) {
+      if(!(*planeMask & (1u << i))) {
+         continue;
+      }
+
+      const C_Plane *plane = frustumPlanes[i];
+
+      //The box's corners farthest in front of and behind the plane
+      float px = plane->a >= 0.0f ? max[0] : min[0];
+      float py = plane->b >= 0.0f ? max[1] : min[1];
+      float pz = plane->c >= 0.0f ? max[2] : min[2];
+      float nx = plane->a >= 0.0f ? min[0] : max[0];
+      float ny = plane->b >= 0.0f ? min[1] : max[1];
+      float nz = plane->c >= 0.0f ? min[2] : max[2];
+
+      if(plane->a * px + plane->b * py + plane->c * pz + plane->d < 0.0f) {
+         return false;
+      }
+
+      if(plane->a * nx + plane->b * ny + plane->c * nz + plane->d >= 0.0f) {
+         *planeMask &= ~(1u << i);
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Batched box test.
+ * A box is outside a plane if its center is farther behind it than the box's radius projected
+ * on the plane's normal (|a| * extentX + |b| * extentY + |c| * extentZ), and inside it if the center
+ * is that far in front of it. That's the same as testing the corners farthest along and against
+ * the normal (see boxInFrustum), without having to pick them per box.
+ */
+void C_Frustum::boxesInFrustum(const frustumBoxes_t *boxes , signed char *results) const
+{
+   const int nBoxes = boxes->centerX.size();
+   float a[6], b[6], c[6], d[6];
+   int i, p;
+
+   for(p = 0 ; p < 6 ; p++) {
+      a[p] = frustumPlanes[p]->a;
+      b[p] = frustumPlanes[p]->b;
+      c[p] = frustumPlanes[p]->c;
+      d[p] = frustumPlanes[p]->d;
+   }
+
+   for(int first = 0 ; first < nBoxes ; first += RAY_PACKET_SIZE) {
+      const int n = MIN(RAY_PACKET_SIZE, nBoxes - first);
+      packetFloat_t cx, cy, cz, ex, ey, ez;
+
+      //The last packet's unused lanes are empty boxes at the origin. Their results are dropped
+      if(n < RAY_PACKET_SIZE) {
+         memset(&cx, 0, sizeof(cx)); memset(&cy, 0, sizeof(cy)); memset(&cz, 0, sizeof(cz));
+         memset(&ex, 0, sizeof(ex)); memset(&ey, 0, sizeof(ey)); memset(&ez, 0, sizeof(ez));
+      }
+
+      memcpy(&cx, &boxes->centerX[first], n * sizeof(float));
+      memcpy(&cy, &boxes->centerY[first], n * sizeof(float));
+      memcpy(&cz, &boxes->centerZ[first], n * sizeof(float));
+      memcpy(&ex, &boxes->extentX[first], n * sizeof(float));
+      memcpy(&ey, &boxes->extentY[first], n * sizeof(float));
+      memcpy(&ez, &boxes->extentZ[first], n * sizeof(float));
+
+      packetInt_t outside = {}, intersect = {};
+
+      for(p = 0 ; p < 6 ; p++) {
+         packetFloat_t dist = a[p] * cx + b[p] * cy + c[p] * cz + d[p];
+         packetFloat_t radius = fabsf(a[p]) * ex + fabsf(b[p]) * ey + fabsf(c[p]) * ez;
+
+         outside |= dist + radius < 0.0f;
+         intersect |= dist - radius < 0.0f;
+      }
+
+      for(i = 0 ; i < n ; i++) {
+         results[first + i] = outside[i] ? FRUSTUM_OUTSIDE : (intersect[i] ? FRUSTUM_INTERSECT : FRUSTUM_INSIDE);
+      }
+   }
+}
@@ -6,6 +6,40 @@
 #include "bbox.h"
 #include "vectors.h"
 
+#include <vector>
+
+/// Plane mask with all 6 frustum planes set (see boxInFrustum)
+#define FRUSTUM_ALL_PLANES    0x3f
+
+/// boxesInFrustum results. Same as cubeInFrustum2's
+#define FRUSTUM_OUTSIDE       -1
+#define FRUSTUM_INTERSECT     0
+#define FRUSTUM_INSIDE        1
+
+/// Boxes as centers and half extents, one array per component (see boxesInFrustum)
+typedef struct {
+   vector<float> centerX, centerY, centerZ;
+   vector<float> extentX, extentY, extentZ;
+} frustumBoxes_t;
+
+static inline void
+addFrustumBox(frustumBoxes_t *boxes, const C_Vector3 *min, const C_Vector3 *max)
+{
+   boxes->centerX.push_back((min->x + max->x) * 0.5f);
+   boxes->centerY.push_back((min->y + max->y) * 0.5f);
+   boxes->centerZ.push_back((min->z + max->z) * 0.5f);
+   boxes->extentX.push_back((max->x - min->x) * 0.5f);
+   boxes->extentY.push_back((max->y - min->y) * 0.5f);
+   boxes->extentZ.push_back((max->z - min->z) * 0.5f);
+}
+
+static inline void
+clearFrustumBoxes(frustumBoxes_t *boxes)
+{
+   boxes->centerX.clear(); boxes->centerY.clear(); boxes->centerZ.clear();
+   boxes->extentX.clear(); boxes->extentY.clear(); boxes->extentZ.clear();
+}
+
 class C_Frustum
 {
 private:
@@ -36,6 +70,12 @@ public:
    bool cubeInFrustum(const C_BBox* box) const;
    //Can tell if the CUBE/BOX INTERSECTS with the frustum
    int cubeInFrustum2(const C_BBox* box) const;
+   //Box test for hierarchies. Only the planes set in planeMask are tested and the ones the
+   //box is fully inside of are cleared, so that the box's children can skip them
+   bool boxInFrustum(const float *min , const float *max , unsigned int *planeMask) const;
+   //Tests RAY_PACKET_SIZE boxes at a time. results gets one of FRUSTUM_OUTSIDE, FRUSTUM_INTERSECT
+   //or FRUSTUM_INSIDE per box
+   void boxesInFrustum(const frustumBoxes_t *boxes , signed char *results) const;
 };
 
 #endif
@@ -4,7 +4,19 @@
 #define DRAW_BSP_GEOMETRY              false
 #define DRAW_TREE_MESHES               true
 #define ENABLE_MESH_FRUSTUM_CULLING    true
+/// Draw all visible copies of a tree static object's mesh with one instanced draw call
+#define ENABLE_INSTANCING              true
+/// Queue the tree static objects and draw them sorted by shader, textures and mesh (see renderQueue.cpp)
+#define USE_RENDER_QUEUE               true
 #define ENABLE_BSP_FRUSTUM_CULLING     true
+/// Skip the static objects hidden behind the bsp geometry (software depth buffer, see occlusionBuffer.cpp)
+#define ENABLE_OCCLUSION_CULLING       true
+#define OCCLUSION_BUFFER_WIDTH         256
+#define OCCLUSION_BUFFER_HEIGHT        128
+/// Objects less than this far behind an occluder are never culled
+#define OCCLUSION_DEPTH_SLACK          5.0f
+/// Boxes that close to the camera are never occlusion queried (USE_OCCLUSION_QUERIES). The near plane would cut them
+#define OCCLUSION_QUERY_CAMERA_MARGIN  1.0f
 //#define USE_PVS                        true
 
 #define ENABLE_COLLISION_DETECTION     true
@@ -12,6 +24,17 @@
 
 #define PRINT_TREE_STATISTICS          false
 
+/// Build independent bsp subtrees on MAX_THREADS worker threads
+#define PARALLEL_BSP_BUILD             true
+/// Build the PVS out of the portals between the leaves instead of casting rays
+#define PORTAL_PVS                     false
+/// Portal flow steps a source leaf may take. Past them whatever its chains might still reach is taken as visible
+#define PORTAL_FLOW_MAX_STEPS          200000
+/// If the PVS file is missing start right away and trace the PVS in the background
+#define LAZY_PVS                       false
+/// Rays (or points) tested together while building the PVS (4, 8 or 16)
+#define RAY_PACKET_SIZE                8
+
 #define ROTATE_MESH_BBOXES             true
 
 //#define JNI_COMPATIBLE
@@ -32,7 +55,10 @@
 #	include <stdint.h>
 #	include <string>
 #	include <limits>
-#	include <GL/glew.h>
+/// The offline map compiler (bspc) doesn't need a GL stack
+#	ifndef BSP_COMPILER
+#		include <GL/glew.h>
+#	endif
 
 #  ifdef DISABLE_ASSERTS
 #     define assert(cond)
@@ -71,8 +97,9 @@ typedef struct {
 	UINT p0 , p1 , p2;
 } C_TriIndices;
 
+/// float is GLfloat. Same layout as GL's matrices
 typedef struct {
-    GLfloat   m[4][4];
+    float   m[4][4];
 } ESMatrix;
 
 struct triangle_vn {
@@ -152,6 +179,7 @@ class C_InputHandler;
 class C_Mob;
 class C_Mesh;
 class C_MeshGroup;
+class C_RenderQueue;
 
 /// -------------------------
 /// Global variables
@@ -165,6 +193,8 @@ extern C_GLShader          *basicShader;
 extern C_GLShader          *pointShader;
 extern C_GLShader          *wallShader;
 extern C_GLShader          *simple_texture_shader;
+extern C_GLShader          *wallInstancedShader;
+extern C_GLShader          *simple_texture_instanced_shader;
 extern C_Vertex            lightPosition;
 extern char                MAX_THREADS;
 extern C_Camera            camera;
@@ -185,5 +215,6 @@ extern    C_MeshGroup corner_outer;
 extern char g_glMajorVersion;
 extern char g_glMinorVersion;
 extern bool USE_PVS;
+extern bool USE_OCCLUSION_QUERIES;
 
 #endif // _GLOBALS_H_
@@ -217,6 +217,7 @@ C_GLShader::C_GLShader(void)
 	normalsAttribLocation = -1;
 	texCoordsAttribLocation = -1;
 	colorsAttribLocation = -1;
+	modelMatrixAttribLocation = -1;
 
 	if(glslAvailable) {
 		programObject = glCreateProgram();
@@ -299,6 +300,8 @@ bool C_GLShader::Link(void)
 	}
 
 	isLinked = true;
+	UpdateUniformTable();
+
 	return true;
 }
 
@@ -380,15 +383,40 @@ void C_GLShader::printAttribInfo(GLint attrib)
 	LOGI("\tname: %s\n", name);
 }
 
+void C_GLShader::enableAttribArrays(bool enable)
+{
+   const GLint locations[] = {verticesAttribLocation, colorsAttribLocation,
+                              texCoordsAttribLocation, normalsAttribLocation,
+                              binormalsAttribLocation, tangetsAttribLocation};
+
+   for(unsigned int i = 0; i < sizeof(locations) / sizeof(GLint); i++) {
+      if(locations[i] < 0) {
+         continue;
+      }
+
+      if(enable) {
+         glEnableVertexAttribArray(locations[i]);
+      } else {
+         glDisableVertexAttribArray(locations[i]);
+      }
+   }
+}
+
 bool C_GLShader::setUniform1f(const char* varname, GLfloat v0)
+{
+	return setUniform1f(GetUniformHandle(varname), v0);
+}
+
+bool C_GLShader::setUniform1f(uniformHandle_t handle, GLfloat v0)
 {
 	if(!glslAvailable) { return false; }  // GLSL not available
-//    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
-	glUniform1f(loc, v0);
+	if(UniformChanged(handle, &v0, sizeof(v0))) {
+		glUniform1f(loc, v0);
+	}
 
 	return true;
 }
@@ -398,23 +426,36 @@ bool C_GLShader::setUniform2f(const char* varname, GLfloat v0, GLfloat v1)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //   if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform2f(loc, v0, v1);
 
 	return true;
 }
 
 bool C_GLShader::setUniform3f(const char* varname, GLfloat v0, GLfloat v1, GLfloat v2)
+{
+	setUniform3f(GetUniformHandle(varname), v0, v1, v2);
+
+	return glslAvailable;
+}
+
+bool C_GLShader::setUniform3f(uniformHandle_t handle, GLfloat v0, GLfloat v1, GLfloat v2)
 {
 	if(!glslAvailable) { return false; }  // GLSL not available
-//    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
-//	if(loc == -1) { assert(0); return false; } // can't find variable
+	GLint loc = GetUniLoc(handle);
+	if(loc == -1) { return false; } // can't find variable
 
-	glUniform3f(loc, v0, v1, v2);
+	const GLfloat value[3] = {v0, v1, v2};
+	if(UniformChanged(handle, value, sizeof(value))) {
+		glUniform3f(loc, v0, v1, v2);
+	}
 
 	return true;
 }
@@ -422,25 +463,45 @@ bool C_GLShader::setUniform3f(const char* varname, GLfloat v0, GLfloat v1, GLflo
 bool C_GLShader::setUniform4f(const char* varname, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3)
 {
 	if(!glslAvailable) { return false; }  // GLSL not available
-//    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	if(handle < 0) { assert(0); return false; } // can't find variable
+
+	return setUniform4f(handle, v0, v1, v2, v3);
+}
+
+bool C_GLShader::setUniform4f(uniformHandle_t handle, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3)
+{
+	if(!glslAvailable) { return false; }  // GLSL not available
+
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { assert(0); return false; } // can't find variable
 
-	glUniform4f(loc, v0, v1, v2, v3);
+	const GLfloat value[4] = {v0, v1, v2, v3};
+	if(UniformChanged(handle, value, sizeof(value))) {
+		glUniform4f(loc, v0, v1, v2, v3);
+	}
 
 	return true;
 }
 
 bool C_GLShader::setUniform1i(const char* varname, GLint v0)
+{
+	setUniform1i(GetUniformHandle(varname), v0);
+
+	return glslAvailable;
+}
+
+bool C_GLShader::setUniform1i(uniformHandle_t handle, GLint v0)
 {
 	if(!glslAvailable) { return false; }  // GLSL not available
-//    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
-//	if(loc == -1) { assert(0); return false; } // can't find variable
+	GLint loc = GetUniLoc(handle);
+	if(loc == -1) { return false; } // can't find variable
 
-	glUniform1i(loc, v0);
+	if(UniformChanged(handle, &v0, sizeof(v0))) {
+		glUniform1i(loc, v0);
+	}
 
 	return true;
 }
@@ -450,9 +511,13 @@ bool C_GLShader::setUniform2i(const char* varname, GLint v0, GLint v1)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform2i(loc, v0, v1);
 
 
@@ -464,9 +529,13 @@ bool C_GLShader::setUniform3i(const char* varname, GLint v0, GLint v1, GLint v2)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform3i(loc, v0, v1, v2);
 
 	return true;
@@ -477,9 +546,13 @@ bool C_GLShader::setUniform4i(const char* varname, GLint v0, GLint v1, GLint v2,
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform4i(loc, v0, v1, v2, v3);
 
 	return true;
@@ -490,9 +563,13 @@ bool C_GLShader::setUniform1fv(const char* varname, GLsizei count, GLfloat *valu
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform1fv(loc, count, value);
 
 	return true;
@@ -503,9 +580,13 @@ bool C_GLShader::setUniform2fv(const char* varname, GLsizei count, GLfloat *valu
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform2fv(loc, count, value);
 
 	return true;
@@ -516,9 +597,13 @@ bool C_GLShader::setUniform3fv(const char* varname, GLsizei count, GLfloat *valu
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform3fv(loc, count, value);
 
 	return true;
@@ -529,9 +614,13 @@ bool C_GLShader::setUniform4fv(const char* varname, GLsizei count, GLfloat *valu
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform4fv(loc, count, value);
 
 	return true;
@@ -542,9 +631,13 @@ bool C_GLShader::setUniform1iv(const char* varname, GLsizei count, GLint *value)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform1iv(loc, count, value);
 
 	return true;
@@ -555,9 +648,13 @@ bool C_GLShader::setUniform2iv(const char* varname, GLsizei count, GLint *value)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform2iv(loc, count, value);
 
 	return true;
@@ -568,9 +665,13 @@ bool C_GLShader::setUniform3iv(const char* varname, GLsizei count, GLint *value)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform3iv(loc, count, value);
 
 	return true;
@@ -581,9 +682,13 @@ bool C_GLShader::setUniform4iv(const char* varname, GLsizei count, GLint *value)
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniform4iv(loc, count, value);
 
 	return true;
@@ -594,9 +699,13 @@ bool C_GLShader::setUniformMatrix2fv(const char* varname, GLsizei count, GLboole
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniformMatrix2fv(loc, count, transpose, value);
 
 	return true;
@@ -607,23 +716,37 @@ bool C_GLShader::setUniformMatrix3fv(const char* varname, GLsizei count, GLboole
 	if(!glslAvailable) { return false; }  // GLSL not available
 //    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	uniformHandle_t handle = GetUniformHandle(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { return false; } // can't find variable
 
+	/// Not cached
+	uniforms[handle].cached = false;
+
 	glUniformMatrix3fv(loc, count, transpose, value);
 
 	return true;
 }
 
 bool C_GLShader::setUniformMatrix4fv(const char* varname, GLsizei count, GLboolean transpose, GLfloat *value)
+{
+	return setUniformMatrix4fv(GetUniformHandle(varname), count, transpose, value);
+}
+
+bool C_GLShader::setUniformMatrix4fv(uniformHandle_t handle, GLsizei count, GLboolean transpose, GLfloat *value)
 {
 	if(!glslAvailable) { assert(0); return false; }  // GLSL not available
-//    if (!_noshader) return true;
 
-	GLint loc = GetUniLoc(varname);
+	GLint loc = GetUniLoc(handle);
 	if(loc == -1) { assert(0); return false; } // can't find variable
 
-	glUniformMatrix4fv(loc, count, transpose, value);
+	/// Transposed matrices are rare, they are always uploaded
+	if(count > 1 || transpose != GL_FALSE) {
+		uniforms[handle].cached = false;
+		glUniformMatrix4fv(loc, count, transpose, value);
+	} else if(UniformChanged(handle, value, 16 * sizeof(GLfloat))) {
+		glUniformMatrix4fv(loc, count, transpose, value);
+	}
 
 	return true;
 }
@@ -633,7 +756,7 @@ void C_GLShader::GetUniformfv(char* name, GLfloat* values)
 	if(!glslAvailable) { return; }
 	GLint loc;
 
-	loc = glGetUniformLocation(programObject, name);
+	loc = GetUniLoc(name);
 	if(loc == -1) {
 		LOGE("Error: can't find uniform variable \"%s\"\n", name);
 	}
@@ -648,7 +771,7 @@ void C_GLShader::GetUniformiv(char* name, GLint* values)
 
 	GLint loc;
 
-	loc = glGetUniformLocation(programObject, name);
+	loc = GetUniLoc(name);
 	if(loc == -1) {
 		LOGE("Error: can't find uniform variable \"%s\"\n", name);
 	}
@@ -666,14 +789,105 @@ void C_GLShader::UpdateAttribLocations(void)
    colorsAttribLocation       = getAttribLocation(VERTEX_ATTRIBUTE_VARIABLE_NAME_COLORS);
    tangetsAttribLocation      = getAttribLocation(VERTEX_ATTRIBUTE_VARIABLE_NAME_TANGENTS);
    binormalsAttribLocation    = getAttribLocation(VERTEX_ATTRIBUTE_VARIABLE_NAME_BINORMALS);
+   modelMatrixAttribLocation  = getAttribLocation(VERTEX_ATTRIBUTE_VARIABLE_NAME_MODEL_MATRIX);
+
+   textureUniformLocation_0   = GetUniLoc(UNIFORM_TEXTURE_0);
+   textureUniformLocation_1   = GetUniLoc(UNIFORM_TEXTURE_1);
+   textureUniformLocation_2   = GetUniLoc(UNIFORM_TEXTURE_2);
+
+   textureDiffuseLocation_0   = GetUniLoc(UNIFORM_TEXTURE_DIFFUSE);
+   textureNormalMapLocation_1 = GetUniLoc(UNIFORM_TEXTURE_NORMAL_MAP);
+   textureSpecularLocation_2  = GetUniLoc(UNIFORM_TEXTURE_SPECULAR);
+}
 
-   textureUniformLocation_0   = GetUniLoc(UNIFORM_VARIABLE_NAME_TEXTURE_0);
-   textureUniformLocation_1   = GetUniLoc(UNIFORM_VARIABLE_NAME_TEXTURE_1);
-   textureUniformLocation_2   = GetUniLoc(UNIFORM_VARIABLE_NAME_TEXTURE_2);
+/**
+ * Looks up the standard uniforms and every other active uniform of the program.
+ * Called every time the program is linked. Linking resets the uniforms' values so the cache starts empty
+ */
+void C_GLShader::UpdateUniformTable(void)
+{
+   static const char *standardNames[N_STANDARD_UNIFORMS] = {
+      UNIFORM_VARIABLE_NAME_MODELVIEW_MATRIX,
+      UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX,
+      UNIFORM_VARIABLE_NAME_MVP_MATRIX,
+      UNIFORM_VARIABLE_NAME_MODEL_MATRIX,
+      UNIFORM_VARIABLE_NAME_VIEW_MATRIX,
+      UNIFORM_VARIABLE_NAME_TEXTURE_0,
+      UNIFORM_VARIABLE_NAME_TEXTURE_1,
+      UNIFORM_VARIABLE_NAME_TEXTURE_2,
+      UNIFORM_VARIABLE_NAME_TEXTURE_DIFFUSE,
+      UNIFORM_VARIABLE_NAME_TEXTURE_NORMAL_MAP,
+      UNIFORM_VARIABLE_NAME_TEXTURE_SPECULAR,
+      UNIFORM_VARIABLE_LIGHT_POSITION,
+      UNIFORM_VARIABLE_NAME_COLOR
+   };
 
-   textureDiffuseLocation_0   = GetUniLoc(UNIFORM_VARIABLE_NAME_TEXTURE_DIFFUSE);
-   textureNormalMapLocation_1 = GetUniLoc(UNIFORM_VARIABLE_NAME_TEXTURE_NORMAL_MAP);
-   textureSpecularLocation_2  = GetUniLoc(UNIFORM_VARIABLE_NAME_TEXTURE_SPECULAR);
+   assert(isLinked);
+
+   shaderUniform_t uniform;
+   uniform.cached = false;
+
+   uniforms.clear();
+   for(int i = 0; i < N_STANDARD_UNIFORMS; i++) {
+      uniform.name = standardNames[i];
+      uniform.location = glGetUniformLocation(programObject, standardNames[i]);
+      uniforms.push_back(uniform);
+   }
+
+   GLint nActive = 0, maxLength = 0;
+   glGetProgramiv(programObject, GL_ACTIVE_UNIFORMS, &nActive);
+   glGetProgramiv(programObject, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+   char *name = new char[maxLength + 1];
+   for(GLint i = 0; i < nActive; i++) {
+      GLsizei length;
+      GLint size;
+      GLenum type;
+
+      glGetActiveUniform(programObject, i, maxLength + 1, &length, &size, &type, name);
+
+      /// Arrays are reported as name[0]
+      char *bracket = strchr(name, '[');
+      if(bracket) {
+         *bracket = '\0';
+      }
+
+      if(GetUniformHandle(name) >= 0) {
+         continue;
+      }
+
+      uniform.name = name;
+      uniform.location = glGetUniformLocation(programObject, name);
+      uniforms.push_back(uniform);
+   }
+   delete[] name;
+}
+
+uniformHandle_t C_GLShader::GetUniformHandle(const char *name) const
+{
+   for(unsigned int i = 0; i < uniforms.size(); i++) {
+      if(uniforms[i].name == name) {
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+bool C_GLShader::UniformChanged(uniformHandle_t handle, const void *value, size_t bytes)
+{
+   shaderUniform_t *uniform = &uniforms[handle];
+
+   assert(bytes <= sizeof(uniform->value));
+
+   if(uniform->cached && !memcmp(&uniform->value, value, bytes)) {
+      return false;
+   }
+
+   memcpy(&uniform->value, value, bytes);
+   uniform->cached = true;
+
+   return true;
 }
 
 C_GLShaderManager::C_GLShaderManager(void)
@@ -743,11 +957,19 @@ C_GLShader *C_GLShaderManager::shaderExists(const C_GLShaderObject *shaderObject
 
 void C_GLShaderManager::pushShader(C_GLShader *shader)
 {
-   /// XXX: Optimization: Check if shader being pushed is already at the
-   ///      top of the stack.
-   /// Deactivate current shader
-   if(activeShader.size())
-      activeShader[activeShader.size() - 1]->End();
+   if(activeShader.size()) {
+      C_GLShader *current = activeShader[activeShader.size() - 1];
+
+      /// Already in use
+      if(current == shader) {
+         activeShader.push_back(shader);
+         return;
+      }
+
+      /// The new program replaces it, no need to unbind it first
+      current->inUse = false;
+   }
+
    /// Place new shader on top of stack
    activeShader.push_back(shader);
    shader->Begin();
@@ -758,12 +980,20 @@ void C_GLShaderManager::popShader(void)
    if(!activeShader.size())
       return;
 
-   /// XXX: Optimization: If shader stack is not empty skip calling End() on shader
-   ///      that is on top of stack, and activate immediately next shader
-   activeShader[activeShader.size() - 1]->End();
+   C_GLShader *current = activeShader[activeShader.size() - 1];
    activeShader.pop_back();
-   if(activeShader.size())
-      activeShader[activeShader.size() - 1]->Begin();
+
+   if(!activeShader.size()) {
+      current->End();
+      return;
+   }
+
+   /// Activate the next shader right away unless it's the same one
+   C_GLShader *next = activeShader[activeShader.size() - 1];
+   if(next != current) {
+      current->inUse = false;
+      next->Begin();
+   }
 }
 
 #ifndef JNI_COMPATIBLE
@@ -19,6 +19,9 @@
 #include <iostream>
 #include <vector>
 #include <string.h>
+#include <string>
+
+using namespace std;
 
 #define VERTEX_ATTRIBUTE_VARIABLE_NAME_VERTICES    "a_vertices"
 #define VERTEX_ATTRIBUTE_VARIABLE_NAME_NORMALS     "a_normals"
@@ -26,6 +29,7 @@
 #define VERTEX_ATTRIBUTE_VARIABLE_NAME_COLORS      "a_colors"
 #define VERTEX_ATTRIBUTE_VARIABLE_NAME_TANGENTS    "a_tangents"
 #define VERTEX_ATTRIBUTE_VARIABLE_NAME_BINORMALS   "a_binormals"
+#define VERTEX_ATTRIBUTE_VARIABLE_NAME_MODEL_MATRIX "a_modelMatrix"
 
 #define UNIFORM_VARIABLE_NAME_MODELVIEW_MATRIX     "u_modelviewMatrix"
 #define UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX    "u_projectionMatrix"
@@ -42,8 +46,44 @@
 #define UNIFORM_VARIABLE_NAME_TEXTURE_SPECULAR     "u_texture_specular"
 
 #define UNIFORM_VARIABLE_LIGHT_POSITION            "u_lightPosition_es"
+#define UNIFORM_VARIABLE_NAME_COLOR                "u_v4_color"
+
+/// Uniforms looked up in every shader when it's linked. Their handles are the same in all shaders
+typedef enum {
+   UNIFORM_MODELVIEW_MATRIX = 0,
+   UNIFORM_PROJECTION_MATRIX,
+   UNIFORM_MVP_MATRIX,
+   UNIFORM_MODEL_MATRIX,
+   UNIFORM_VIEW_MATRIX,
+   UNIFORM_TEXTURE_0,
+   UNIFORM_TEXTURE_1,
+   UNIFORM_TEXTURE_2,
+   UNIFORM_TEXTURE_DIFFUSE,
+   UNIFORM_TEXTURE_NORMAL_MAP,
+   UNIFORM_TEXTURE_SPECULAR,
+   UNIFORM_LIGHT_POSITION,
+   UNIFORM_COLOR,
+
+   N_STANDARD_UNIFORMS
+} standardUniform_t;
+
+/// Index in a shader's uniform table. -1 if the shader has no such uniform
+typedef int uniformHandle_t;
+
+/// Largest uniform value cached (mat4)
+#define UNIFORM_CACHE_FLOATS        16
+
+typedef struct {
+   string   name;
+   GLint    location;
+   /// Last value uploaded. Values of arrays are not cached
+   bool     cached;
+   union {
+      GLfloat  f[UNIFORM_CACHE_FLOATS];
+      GLint    i[UNIFORM_CACHE_FLOATS];
+   } value;
+} shaderUniform_t;
 
-using namespace std;
 class C_GLShader;
 typedef enum {NO_SHADER, VERTEX_SHADER, FRAGMENT_SHADER} shader_type_t;
 
@@ -93,9 +133,22 @@ public:
    void Begin(void);
    void End(void);
 
-   inline GLint GetUniLoc(const GLcharARB *name) { return glGetUniformLocation(programObject, name); }
-
-   /// Uniform Variables
+   /// Uniforms are looked up once when the shader is linked, no GL calls here
+   uniformHandle_t GetUniformHandle(const char *name) const;
+   inline GLint GetUniLoc(uniformHandle_t handle) const
+   {
+      return handle >= 0 && handle < (int)uniforms.size() ? uniforms[handle].location : -1;
+   }
+   inline GLint GetUniLoc(const char *name) const { return GetUniLoc(GetUniformHandle(name)); }
+
+   /// Uniform Variables by handle. A value equal to the last one uploaded isn't uploaded again
+   bool setUniform1f(uniformHandle_t handle, GLfloat v0);
+   bool setUniform3f(uniformHandle_t handle, GLfloat v0, GLfloat v1, GLfloat v2);
+   bool setUniform4f(uniformHandle_t handle, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3);
+   bool setUniform1i(uniformHandle_t handle, GLint v0);
+   bool setUniformMatrix4fv(uniformHandle_t handle, GLsizei count, GLboolean transpose, GLfloat *value);
+
+   /// Uniform Variables by name
    bool setUniform1f(const char* varname, GLfloat v0);  //!< set float uniform to program
    bool setUniform2f(const char* varname, GLfloat v0, GLfloat v1); //!< set vec2 uniform to program
    bool setUniform3f(const char* varname, GLfloat v0, GLfloat v1, GLfloat v2); //!< set vec3 uniform to program
@@ -127,9 +180,15 @@ public:
    void GetUniformiv(char* name, GLint* values);
 
    void printAttribInfo(GLint attrib);
+   /// Enables or disables the arrays of the default vertex attributes the shader uses
+   void enableAttribArrays(bool enable);
+
+   inline GLuint GetProgramObject(void) const { return programObject; }
 
    GLint verticesAttribLocation, normalsAttribLocation, texCoordsAttribLocation, colorsAttribLocation;
    GLint tangetsAttribLocation, binormalsAttribLocation;
+   /// Per instance model matrix of the instanced shaders. Takes this and the next 3 locations
+   GLint modelMatrixAttribLocation;
    GLint textureUniformLocation_0, textureUniformLocation_1, textureUniformLocation_2;
    GLint textureDiffuseLocation_0, textureNormalMapLocation_1, textureSpecularLocation_2;
 
@@ -137,6 +196,9 @@ protected:
    void              AddShader(C_GLShaderObject* shader);      /// Add a vertex or fragment shader
    bool              Link(void);                               /// Link shaders
    void              UpdateAttribLocations(void);
+   void              UpdateUniformTable(void);
+   /// Compares value with the cached one and keeps it. Returns false if it doesn't have to be uploaded
+   bool              UniformChanged(uniformHandle_t handle, const void *value, size_t bytes);
    inline bool       GetisLinked(void) { return isLinked; }
 
    char              *linkerLog;
@@ -145,6 +207,8 @@ private:
    C_GLShaderObject  *shaderList[MAX_SHADERS];                 /// Holds all the shaders
    int               nShaders;
    GLuint            programObject;                            /// Shader ID returned from glCreatePrograms
+   /// The N_STANDARD_UNIFORMS first, in standardUniform_t order, then the rest of the active uniforms
+   vector<shaderUniform_t> uniforms;
    bool              isLinked;
    bool              inUse;
 };
@@ -38,6 +38,8 @@ using namespace std;
 
 int mapPolys;
 static C_Map map;
+/// Map loaded from the maps folder. Can be given as the first argument (ie. a dungeon made by bspc -g)
+static const char *mapName = "map";
 C_Vertex lightPosition;
 C_MeshGroup cube;
 
@@ -55,6 +57,8 @@ C_GLShader *basicShader = NULL;
 C_GLShader *pointShader = NULL;
 C_GLShader *wallShader = NULL;
 C_GLShader *simple_texture_shader = NULL;
+C_GLShader *wallInstancedShader = NULL;
+C_GLShader *simple_texture_instanced_shader = NULL;
 
 /// Camera and frustum
 C_Camera camera;
@@ -85,6 +89,7 @@ static int fps = 60.0f;
 #define FPS (1000.0f / timePerFrame)
 
 bool USE_PVS = true;
+bool USE_OCCLUSION_QUERIES = false;
 
 //AUDIO!!!
 sf::SoundBuffer bufIntro;
@@ -158,13 +163,19 @@ Initializations(void)
     simple_texture_shader = shaderManager->LoadShaderProgram("shaders/simple_texture.vert", "shaders/simple_texture.frag");
     assert(simple_texture_shader->verticesAttribLocation >= 0);
 
+    wallInstancedShader = shaderManager->LoadShaderProgram("shaders/shader1_instanced.vert", "shaders/shader1.frag");
+    assert(wallInstancedShader->modelMatrixAttribLocation >= 0);
+
+    simple_texture_instanced_shader = shaderManager->LoadShaderProgram("shaders/simple_texture_instanced.vert", "shaders/simple_texture.frag");
+    assert(simple_texture_instanced_shader->modelMatrixAttribLocation >= 0);
+
     /// Texture manager
     textureManager = C_TextureManager::getSingleton();
 
     /// Sound manager
     soundManager = C_SoundManager::GetSingleton();
 
-    map.createMap("map");
+    map.createMap(mapName);
 
     int tileStartx, tileStarty;
     C_Vertex cameraPosition = map.cameraStartPosition(&tileStartx, &tileStarty);
@@ -319,6 +330,11 @@ hande_simple_keys(unsigned char key , int x , int y)
             USE_PVS = !USE_PVS;
             break;
 
+        case '1':
+            USE_OCCLUSION_QUERIES = !USE_OCCLUSION_QUERIES;
+            printf("Occlusion queries: %s\n", USE_OCCLUSION_QUERIES ? "on" : "off");
+            break;
+
         default:
             cout << int (key) << '\n';
             break;
@@ -390,6 +406,10 @@ main(int argc, char* argv[])
 #ifndef JNI_COMPATIBLE
     glutInit(&argc, argv);
 
+    if(argc > 1) {
+        mapName = argv[1];
+    }
+
     /// Double buffering with depth buffer
     glutInitDisplayMode(/*GLUT_DOUBLE | */GLUT_RGB | GLUT_DEPTH);
 
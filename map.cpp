@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/time.h>
 #include "map.h"
+#include "renderQueue.h"
 
 C_MeshGroup wallMesh;
 C_MeshGroup wallMesh2;
@@ -17,24 +21,41 @@ C_Map::C_Map(void)
    PRINT_FUNC_ENTRY;
 
    bspTree = NULL;
+   tiles = NULL;
+   tilesOnX = tilesOnY = 0;
+}
 
-   for(int x = 0; x < TILES_ON_X; x++) {
-		for(int y = 0; y < TILES_ON_Y; y++) {
-		   tiles[x][y].setCoordX(x);
-		   tiles[x][y].setCoordY(y);
-		   tiles[x][y].setArea(AREA_NAN);
-		   tiles[x][y].hasParameter = false;
-		}
-	}
+static bool
+tileParameterLess(const tileParameter_t &parameter, int tileIndex)
+{
+   return parameter.tileIndex < tileIndex;
 }
 
-tile *
+static bool
+tileParameterOrder(const tileParameter_t &a, const tileParameter_t &b)
+{
+   return a.tileIndex < b.tileIndex;
+}
+
+tile_t
 C_Map::getTile(int x, int y)
 {
-   assert(x >= 0 && x < TILES_ON_X);
-   assert(y >= 0 && y < TILES_ON_Y);
+   assert(x >= 0 && x < tilesOnX);
+   assert(y >= 0 && y < tilesOnY);
 
-   return &tiles[x][y];
+   return tileAt(x, y);
+}
+
+const char *
+C_Map::getTileParameter(int x, int y)
+{
+   assert(x >= 0 && x < tilesOnX);
+   assert(y >= 0 && y < tilesOnY);
+
+   int tileIndex = x * tilesOnY + y;
+   vector<tileParameter_t>::const_iterator it = lower_bound(tileParameters.begin(), tileParameters.end(), tileIndex, tileParameterLess);
+
+   return it != tileParameters.end() && it->tileIndex == tileIndex ? it->parameter.c_str() : NULL;
 }
 
 C_Vertex
@@ -44,9 +65,9 @@ C_Map::cameraStartPosition(int *x_, int *y_)
    bool found = false;
    int x, y;
 
-   for(x = 0; x < TILES_ON_X && !found; x++) {
-		for(y = 0; y < TILES_ON_Y && !found; y++) {
-		   if(tiles[x][y].getType() == TILE_4)
+   for(x = 0; x < tilesOnX && !found; x++) {
+		for(y = 0; y < tilesOnY && !found; y++) {
+		   if(tileType(tileAt(x, y)) == TILE_4)
 		      found = true;
 		}
    }
@@ -71,10 +92,9 @@ C_Map::~C_Map()
       bspTree = NULL;
    }
 
-   for(int x = 0; x < TILES_ON_X; x++) {
-		for(int y = 0; y < TILES_ON_Y; y++) {
-         tiles[x][y].~tile();
-      }
+   if(tiles) {
+      delete[] tiles;
+      tiles = NULL;
    }
 }
 
@@ -94,25 +114,46 @@ C_Map::createMap(const string &filename)
       return false;
    }
 
-   bspTree = new C_BspTree(6);
+   /// Load the map compiled by bspc
+   string compiledFile = std::string("maps/") + filename;
+   compiledFile.append(".cbsp\0");
+   string sourceFile = std::string("maps/") + filename;
+   sourceFile.append(".bsp\0");
 
-   /// Read bsp geometry and build the bsp tree
-   mapFile = std::string("maps/") + filename;
-   mapFile.append(".bsp\0");
+   bspTree = new C_BspTree(6);
 
-   bspTree->ReadGeometryFile(mapFile.c_str());
-   bspTree->BuildBspTree();
+   pvsMethod_t pvsMethod = PORTAL_PVS ? PVS_PORTAL_FLOW : PVS_RAY_SAMPLING;
+   if(!bspTree->ReadCompiledMap(compiledFile.c_str(), sourceFile.c_str(), pvsMethod)) {
+      /// No usable compiled map. Run the whole pipeline and keep the result for the next time.
+      /// Read bsp geometry and build the bsp tree
+      bspTree->ReadGeometryFile(sourceFile.c_str());
+      bspTree->BuildBspTree();
+
+      /// Read pvs file
+      mapFile = std::string("maps/") + filename;
+      mapFile.append(".pvs\0");
+      if(LAZY_PVS && !PORTAL_PVS) {
+         bspTree->BuildLazyPVS(mapFile.c_str());
+      } else {
+         bspTree->BuildPVS(mapFile.c_str(), pvsMethod);
+      }
 
-   /// Read pvs file
-   mapFile = std::string("maps/") + filename;
-   mapFile.append(".pvs\0");
-   bspTree->BuildPVS(mapFile.c_str());
+      /// A PVS still being traced is written to the pvs file once done.
+      /// The map gets compiled the next time it's loaded
+      if(bspTree->IsPVSComplete()) {
+         bspTree->WriteCompiledMap(compiledFile.c_str(), sourceFile.c_str());
+      }
+   }
 
    /// Load 3d meshes
    load3DObjects();
 
    /// Position the walls
+   timeval start, end;
+   gettimeofday(&start, NULL);
    placeObjects();
+   gettimeofday(&end, NULL);
+   printf("Objects placed in %.3f s\n", (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
 
    return true;
 }
@@ -127,12 +168,13 @@ C_Map::placeObjects(void)
    static float scale2 = 1.13f;
 
    ESMatrix mat;
-   for(int x = 0; x < TILES_ON_X; x++) {
-      for(int y = 0; y < TILES_ON_Y; y++) {
+   for(int x = 0; x < tilesOnX; x++) {
+      for(int y = 0; y < tilesOnY; y++) {
+         tile_t tile = tileAt(x, y);
 
-         if(tiles[x][y].getType() == TILE_WALL) {
+         if(tileType(tile) == TILE_WALL) {
             /// Left wall
-            if(x > 0 && tiles[x-1][y].getArea() == AREA_WALKABLE) {
+            if(x > 0 && tileArea(tileAt(x-1, y)) == AREA_WALKABLE) {
                if((rand()%2)) {
                   esMatrixLoadIdentity(&mat);
 
@@ -158,7 +200,7 @@ C_Map::placeObjects(void)
             }
 
             /// Upper wall
-            if(y < TILES_ON_Y - 1 && tiles[x][y+1].getArea() == AREA_WALKABLE) {
+            if(y < tilesOnY - 1 && tileArea(tileAt(x, y+1)) == AREA_WALKABLE) {
                if((rand()%2)) {
                   esMatrixLoadIdentity(&mat);
 
@@ -184,7 +226,7 @@ C_Map::placeObjects(void)
             }
 
             /// Right wall
-            if(x < TILES_ON_X - 1 && tiles[x+1][y].getArea() == AREA_WALKABLE) {
+            if(x < tilesOnX - 1 && tileArea(tileAt(x+1, y)) == AREA_WALKABLE) {
                if((rand()%2)) {
                   esMatrixLoadIdentity(&mat);
 
@@ -207,7 +249,7 @@ C_Map::placeObjects(void)
             }
 
             /// Bottom wall
-            if(y > 0 && tiles[x][y-1].getArea() == AREA_WALKABLE) {
+            if(y > 0 && tileArea(tileAt(x, y-1)) == AREA_WALKABLE) {
                if((rand()%2)) {
                   esMatrixLoadIdentity(&mat);
 
@@ -231,7 +273,7 @@ C_Map::placeObjects(void)
                   bspTree->insertStaticObject(&wallMesh, &mat);
                }
             }
-         } else if(tiles[x][y].getArea() == AREA_WALKABLE) {
+         } else if(tileArea(tile) == AREA_WALKABLE) {
             esMatrixLoadIdentity(&mat);
 
             /// Choose randomly between all floor tiles
@@ -283,24 +325,31 @@ C_Map::load3DObjects(void)
 
    wallMesh.loadFromFile("wallMeshes/wall_01.obj");
    wallMesh.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   wallMesh.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
    wallMesh2.loadFromFile("wallMeshes/wall_02.obj");
    wallMesh2.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   wallMesh2.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
    floorMesh.loadFromFile("wallMeshes/floor_01.obj");
    floorMesh.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   floorMesh.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
    floorMesh2.loadFromFile("wallMeshes/floor_02.obj");
    floorMesh2.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   floorMesh2.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
    floorMesh3.loadFromFile("wallMeshes/floor_03.obj");
    floorMesh3.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   floorMesh3.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
    floorMesh4.loadFromFile("wallMeshes/floor_04.obj");
    floorMesh4.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   floorMesh4.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
    grating.loadFromFile("wallMeshes/grating.obj");
    grating.shader = USE_HIGH_QUALITY_SHADERS ? wallShader : simple_texture_shader;
+   grating.instancedShader = USE_HIGH_QUALITY_SHADERS ? wallInstancedShader : simple_texture_instanced_shader;
 
 //   corner_inner.loadFromFile("wallMeshes/corner_inner.obj");
 //   corner_inner.shader = wallShader;
@@ -467,15 +516,26 @@ C_Map::draw(C_Camera *camera)
 
       camera->PrintText(0, lineHeight * line++,
                    1.0f, 1.0f, 0.0f, 0.6f,
-                   "total leaves: %d. Drawn: %d" , bspTree->statistics.totalLeaves, bspTree->statistics.leavesDrawn);
+                   "total leaves: %d. Drawn: %d. Bsp triangles: %d. Queries: %d" , bspTree->statistics.totalLeaves, bspTree->statistics.leavesDrawn,
+                   bspTree->statistics.bspTrianglesDrawn, bspTree->statistics.occlusionQueries);
 
       camera->PrintText(0, lineHeight * line++,
                    1.0f, 1.0f, 0.0f, 0.6f,
-                   "total objects: %d. Drawn: %d" , bspTree->statistics.totalStaticObjects, bspTree->statistics.staticObjectsDrawn);
+                   "total objects: %d. Drawn: %d. Occluded: %d. Draw calls: %d" , bspTree->statistics.totalStaticObjects, bspTree->statistics.staticObjectsDrawn,
+                   bspTree->statistics.staticObjectsOccluded, bspTree->statistics.meshDrawCalls);
 
       camera->PrintText(0, lineHeight * line++,
                    1.0f, 1.0f, 0.0f, 0.6f,
                    "total triangles: %d. Drawn: %d" , bspTree->statistics.totalTriangles, bspTree->statistics.trianglesDrawn);
+
+      if(USE_RENDER_QUEUE && bspTree->renderQueue) {
+         const renderQueueStatistics_t *queueStats = &bspTree->renderQueue->statistics;
+
+         camera->PrintText(0, lineHeight * line++,
+                      1.0f, 1.0f, 0.0f, 0.6f,
+                      "queued: %d. Shader changes: %d. Texture binds: %d. Mesh binds: %d. Draw calls: %d" , queueStats->items,
+                      queueStats->shaderChanges, queueStats->textureChanges, queueStats->vertexBufferChanges, queueStats->drawCalls);
+      }
    }
 }
 
@@ -486,7 +546,7 @@ C_Map::readMap(const char *filename)
    printf("Reading map file \"%s\"\n", filename);
 
 	int _xTiles, _yTiles, type, area, nTiles, _x, _y;
-	int i, c, sum = 0, nWalkable = 0, nVoid = 0;
+	int i, sum = 0, nWalkable = 0, nVoid = 0;
 	char buf[MAX_PARAMETER_LENGTH];
 	int counters[N_TILE_TYPES] = {0};
 
@@ -495,29 +555,42 @@ C_Map::readMap(const char *filename)
 	if((fd = fopen(filename, "r")) == NULL)
 		return false;
 
-	c = fscanf(fd, "%d", &_xTiles);		/// Read size on x.
-	c = fscanf(fd, "%d", &_yTiles);		/// Read size on y.
-	c = fscanf(fd, "%d", &nTiles);		   /// Read number of tiles stored in file.
+	if(fscanf(fd, "%d %d %d", &_xTiles, &_yTiles, &nTiles) != 3 ||		/// Size on x and y and number of tiles stored in file.
+	   _xTiles <= 0 || _yTiles <= 0 || nTiles != _xTiles * _yTiles) {
+	   printf("Invalid map size in \"%s\"\n", filename);
+	   fclose(fd);
+	   return false;
+	}
 
-   assert(_xTiles == TILES_ON_X);
-   assert(_yTiles == TILES_ON_Y);
-   assert(nTiles == TILES_ON_X * TILES_ON_Y);
+	tilesOnX = _xTiles;
+	tilesOnY = _yTiles;
+	delete[] tiles;
+	tiles = new tile_t[nTiles];
+	memset(tiles, packTile(TILE_0, AREA_NAN), nTiles * sizeof(tile_t));
+	tileParameters.clear();
 
 	for(i = 0; i < nTiles; i++) {
-		c = fscanf(fd, "%d", &_x);			/// Read x coords
-		c = fscanf(fd, "%d", &_y);			/// Read y coords
-		c = fscanf(fd, "%d", &type);	   /// Read tile type
-		c = fscanf(fd, "%d", &area);	/// Read tile area
-
-		assert(_x < TILES_ON_X);
-		assert(_y < TILES_ON_Y);
-		assert(type < N_TILE_TYPES);
-		assert(area < N_AREA_TYPES);
+		/// x and y coords, tile type and tile area
+		if(fscanf(fd, "%d %d %d %d", &_x, &_y, &type, &area) != 4 ||
+		   _x < 0 || _x >= tilesOnX || _y < 0 || _y >= tilesOnY ||
+		   type < 0 || type >= N_TILE_TYPES || area < 0 || area >= N_AREA_TYPES) {
+		   printf("Invalid tile %d in \"%s\"\n", i, filename);
+		   fclose(fd);
+		   return false;
+		}
 
-		tiles[_x][_y].setType((tileTypes_t)type);
-		tiles[_x][_y].setArea((areaTypes_t)area);
-		tiles[_x][_y].setCoordX(_x);
-		tiles[_x][_y].setCoordY(_y);
+		tiles[_x * tilesOnY + _y] = packTile((tileTypes_t)type, (areaTypes_t)area);
+
+		/// Whatever is left on the line is the tile's parameter.
+		/// fgets doesn't stop at white spaces but it stops at '\n'
+		if(fgets(buf, MAX_PARAMETER_LENGTH, fd)) {
+		   tileParameter_t parameter;
+		   parameter.tileIndex = _x * tilesOnY + _y;
+		   parameter.parameter = buf;
+		   if(cleanTileParameter(&parameter.parameter)) {
+		      tileParameters.push_back(parameter);
+		   }
+		}
 
 		/// Count tiles
 		++counters[type];
@@ -527,36 +600,21 @@ C_Map::readMap(const char *filename)
       } else if(area == AREA_WALKABLE) {
          ++nWalkable;
       }
-
-   	/// There's a parameter. Read it.
-		if(!c) {
-		   /// fgets doesn't stop at white spaces but it stops at '\n'
-			fgets(buf, MAX_PARAMETER_LENGTH, fd);
-//			tiles[_x][_y].setParameter(buf);
-
-		   /// One loop is lost everytime a parameter is read.
-         if(area == AREA_VOID) {
-            --nVoid;
-         } else if(area == AREA_WALKABLE) {
-            --nWalkable;
-         }
-
-			--i;
-			--sum;
-         --counters[type];
-		}
 	}
 
 	fclose(fd);
 
+	sort(tileParameters.begin(), tileParameters.end(), tileParameterOrder);
+
 	printf("\tFound:\n");
 	for(int i = 0; i < N_TILE_TYPES; i++) {
 	   if(counters[i])
          printf("\tType %d: %d tiles\n", i, counters[i]);
 	}
 	printf("\t%d walkable and %d void tiles\n", nWalkable, nVoid);
+	printf("\t%d tiles with a parameter\n", (int)tileParameters.size());
 
-	printf("\tTotal %d tiles\n", sum);
+	printf("\tTotal %d tiles (%dx%d)\n", sum, tilesOnX, tilesOnY);
 	printf("Done.\n");
    printf("*********\n");
 
@@ -5,7 +5,12 @@
 #include "bspTree.h"
 #include "globals.h"
 
-#define TILE_SIZE 20.0f
+#include <vector>
+
+typedef struct {
+   int tileIndex;
+   string parameter;
+} tileParameter_t;
 
 typedef enum {
    TILE_X_MINUS,
@@ -25,7 +30,9 @@ public:
    bool createMap(const string &filename);
 
    C_Vertex cameraStartPosition(int *x, int *y);
-   tile *getTile(int x, int y);
+   tile_t getTile(int x, int y);
+   /// Parameter of tile (x, y) read from the map file. NULL if it has none
+   const char *getTileParameter(int x, int y);
 
    void draw(C_Camera *camera);
 
@@ -41,8 +48,16 @@ private:
 //   C_MeshGroup corner_inner;
 //   C_MeshGroup corner_outer;
 
-   /// All map tiles
-   tile tiles[TILES_ON_X][TILES_ON_Y];
+   /// Map size in tiles. Read from the map file
+   int tilesOnX, tilesOnY;
+
+   /// All map tiles, one byte each. Tile (x, y) is at tiles[x * tilesOnY + y]
+   tile_t *tiles;
+
+   /// The few tiles with a parameter, sorted by tile index
+   vector<tileParameter_t> tileParameters;
+
+   inline tile_t tileAt(int x, int y) { return tiles[x * tilesOnY + y]; }
 
    bool readMap(const char *filename);
    bool load3DObjects(void);
@@ -69,6 +69,12 @@ math::Distance(C_Vertex *p1 , C_Vertex *p2)
    return sqrt((p2->x - p1->x) * (p2->x - p1->x) + (p2->y - p1->y) * (p2->y - p1->y) + (p2->z - p1->z) * (p2->z - p1->z));
 }
 
+float
+math::DistanceSquared(const C_Vertex *p1 , const C_Vertex *p2)
+{
+   return (p2->x - p1->x) * (p2->x - p1->x) + (p2->y - p1->y) * (p2->y - p1->y) + (p2->z - p1->z) * (p2->z - p1->z);
+}
+
 C_Vertex
 math::transformPoint(const ESMatrix *matrix, const C_Vertex *point)
 {
@@ -125,7 +131,7 @@ math::transformPoint(const ESMatrix *matrix, const C_Vector3 *point)
 ///
 /// **************************************************************
 void
-esScale(ESMatrix *result, GLfloat sx, GLfloat sy, GLfloat sz)
+esScale(ESMatrix *result, float sx, float sy, float sz)
 {
    result->m[0][0] *= sx;
    result->m[0][1] *= sx;
@@ -144,7 +150,7 @@ esScale(ESMatrix *result, GLfloat sx, GLfloat sy, GLfloat sz)
 }
 
 void
-esTranslate(ESMatrix *result, GLfloat tx, GLfloat ty, GLfloat tz)
+esTranslate(ESMatrix *result, float tx, float ty, float tz)
 {
    result->m[3][0] += (result->m[0][0] * tx + result->m[1][0] * ty + result->m[2][0] * tz);
    result->m[3][1] += (result->m[0][1] * tx + result->m[1][1] * ty + result->m[2][1] * tz);
@@ -153,16 +159,16 @@ esTranslate(ESMatrix *result, GLfloat tx, GLfloat ty, GLfloat tz)
 }
 
 void
-esRotate(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+esRotate(ESMatrix *result, float angle, float x, float y, float z)
 {
-   GLfloat sinAngle, cosAngle;
-   GLfloat mag = sqrtf(x * x + y * y + z * z);
+   float sinAngle, cosAngle;
+   float mag = sqrtf(x * x + y * y + z * z);
 
    sinAngle = sinf ( angle * PI / 180.0f );
    cosAngle = cosf ( angle * PI / 180.0f );
    if ( mag > 0.0f ) {
-      GLfloat xx, yy, zz, xy, yz, zx, xs, ys, zs;
-      GLfloat oneMinusCos;
+      float xx, yy, zz, xy, yz, zx, xs, ys, zs;
+      float oneMinusCos;
       ESMatrix rotMat;
 
       x /= mag;
@@ -236,7 +242,7 @@ esFrustum(ESMatrix *result, float left, float right, float bottom, float top, fl
 void
 esPerspective(ESMatrix *result, float fovy, float aspect, float nearZ, float farZ)
 {
-   GLfloat frustumW, frustumH;
+   float frustumW, frustumH;
 
    frustumH = tanf( fovy / 360.0f * PI ) * nearZ;
    frustumW = frustumH * aspect;
@@ -41,6 +41,7 @@ namespace math {
    void Normalize(C_Vertex *vec);
    float Magnitude(float x , float y , float z);
    float Distance(C_Vertex *p1 , C_Vertex *p2);
+   float DistanceSquared(const C_Vertex *p1 , const C_Vertex *p2);
    C_Vertex transformPoint(const ESMatrix *matrix, const C_Vertex *point);
    C_Vertex transformNormal(const ESMatrix *matrix, const C_Vertex *point);
    C_Vector3 transformPoint(const ESMatrix *matrix, const C_Vector3 *point);
@@ -51,9 +52,9 @@ namespace math {
 extern const ESMatrix Identity;
 
 /// Code ripped from "OpenGL ES 2.0 Programming Guide"
-void esScale(ESMatrix *result, GLfloat sx, GLfloat sy, GLfloat sz);
-void esTranslate(ESMatrix *result, GLfloat tx, GLfloat ty, GLfloat tz);
-void esRotate(ESMatrix *result, GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
+void esScale(ESMatrix *result, float sx, float sy, float sz);
+void esTranslate(ESMatrix *result, float tx, float ty, float tz);
+void esRotate(ESMatrix *result, float angle, float x, float y, float z);
 void esFrustum(ESMatrix *result, float left, float right, float bottom, float top, float nearZ, float farZ);
 void esPerspective(ESMatrix *result, float fovy, float aspect, float nearZ, float farZ);
 void esOrtho(ESMatrix *result, float left, float right, float bottom, float top, float nearZ, float farZ);
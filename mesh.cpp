@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "mesh.h"
+#include "renderQueue.h"
 #include "objreader/objfile.h"
 
 C_BaseMesh::C_BaseMesh(void)
@@ -69,6 +70,7 @@ C_MeshGroup::softCopy(const C_MeshGroup *group)
       nTriangles = group->nTriangles;
       nVertices = group->nVertices;
       shader = group->shader;
+      instancedShader = group->instancedShader;
       bbox = group->bbox;
       position = group->position;
       matrix = group->matrix;
@@ -158,6 +160,7 @@ C_MeshGroup::C_MeshGroup(void)
 
    meshes = NULL;
    nMeshes = 0;
+   instancedShader = NULL;
    matrix = Identity;
    position.x = position.y = position.z = 0.0f;
 
@@ -202,6 +205,7 @@ C_MeshGroup &C_MeshGroup::operator= (const C_MeshGroup &group)
       nTriangles = group.nTriangles;
       nVertices = group.nVertices;
       shader = group.shader;
+      instancedShader = group.instancedShader;
       bbox = group.bbox;
       position = group.position;
       matrix = group.matrix;
@@ -478,81 +482,178 @@ C_MeshGroup::draw(C_Camera *camera)
 	shaderManager->pushShader(shader);
 	ESMatrix mat;
 
+	modelviewMatrix(&mat);
+
+   /// Compute MVP matrix
+	esMatrixMultiply(&globalMVPMatrix, &mat, &globalProjectionMatrix);
+
+   shader->setUniformMatrix4fv(UNIFORM_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
+//   shader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MODEL_MATRIX, 1, GL_FALSE, (GLfloat *)&matrix.m[0][0]);
+//   shader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+   shader->setUniformMatrix4fv(UNIFORM_MVP_MATRIX, 1, GL_FALSE, (GLfloat *)&globalMVPMatrix.m[0][0]);
+
+   if(shader->GetUniLoc(UNIFORM_LIGHT_POSITION) >= 0)
+      shader->setUniform3f(UNIFORM_LIGHT_POSITION, lightPosition.x, lightPosition.y, lightPosition.z);
+
+   shader->enableAttribArrays(true);
+
+   C_Mesh *mesh = meshes;
+   while(mesh) {
+      bindTextures(mesh, shader);
+      mesh->draw(shader);
+      mesh = mesh->next;
+   }
+
+//   bbox.Draw();
+
+   shader->enableAttribArrays(false);
+
+   shaderManager->popShader();
+
+   return true;
+}
+
+void
+C_MeshGroup::modelviewMatrix(ESMatrix *mat)
+{
    /// Apply camera transformation
-	esMatrixMultiply(&mat, &matrix, &globalViewMatrix);
+	esMatrixMultiply(mat, &matrix, &globalViewMatrix);
 	/// Apply model translation
-	esTranslate(&mat, position.x, position.y, position.z);
+	esTranslate(mat, position.x, position.y, position.z);
 	/// Apply model rotation
 	if(rotated) {
 	   ESMatrix rotMat;
 	   rotationQuat.QuaternionToMatrix16(&rotMat);
-   	esMatrixMultiply(&mat, &rotMat, &mat);
+   	esMatrixMultiply(mat, &rotMat, mat);
       rotated = false;
    }
+}
 
-   /// Compute MVP matrix
-	esMatrixMultiply(&globalMVPMatrix, &mat, &globalProjectionMatrix);
-
-   shader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
-//   shader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MODEL_MATRIX, 1, GL_FALSE, (GLfloat *)&matrix.m[0][0]);
-//   shader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
-   shader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MVP_MATRIX, 1, GL_FALSE, (GLfloat *)&globalMVPMatrix.m[0][0]);
+/// Unlike draw there is no frustum culling, only visible groups are queued
+void
+C_MeshGroup::queue(C_RenderQueue *renderQueue)
+{
+   ESMatrix mat, mvp;
 
-   if(shader->GetUniLoc(UNIFORM_VARIABLE_LIGHT_POSITION) >= 0)
-      shader->setUniform3f(UNIFORM_VARIABLE_LIGHT_POSITION, lightPosition.x, lightPosition.y, lightPosition.z);
+   modelviewMatrix(&mat);
+	esMatrixMultiply(&mvp, &mat, &globalProjectionMatrix);
 
-   if(shader->verticesAttribLocation >= 0)   glEnableVertexAttribArray(shader->verticesAttribLocation);
-   if(shader->colorsAttribLocation >= 0)     glEnableVertexAttribArray(shader->colorsAttribLocation);
-   if(shader->texCoordsAttribLocation >= 0)  glEnableVertexAttribArray(shader->texCoordsAttribLocation);
-   if(shader->normalsAttribLocation >= 0)    glEnableVertexAttribArray(shader->normalsAttribLocation);
-   if(shader->binormalsAttribLocation >= 0)  glEnableVertexAttribArray(shader->binormalsAttribLocation);
-   if(shader->tangetsAttribLocation >= 0)    glEnableVertexAttribArray(shader->tangetsAttribLocation);
+   C_Mesh *mesh = meshes;
+   while(mesh) {
+      renderQueue->Add(shader, mesh, &mat, &mvp);
+      mesh = mesh->next;
+   }
+}
 
+void
+C_MeshGroup::queueInstanced(C_RenderQueue *renderQueue, GLuint instanceBuffer, int firstInstance, int nInstances)
+{
    C_Mesh *mesh = meshes;
    while(mesh) {
-      /// If mesh has texture enable it
-      if(mesh->texture_diffuse && shader->textureDiffuseLocation_0 >= 0) {
-         glActiveTexture(GL_TEXTURE0);
-         glBindTexture(GL_TEXTURE_2D, mesh->texture_diffuse->getGLtextureID());
-         shader->setUniform1i(UNIFORM_VARIABLE_NAME_TEXTURE_DIFFUSE, 0);
-      }
+      renderQueue->AddInstanced(instancedShader, mesh, instanceBuffer, firstInstance, nInstances);
+      mesh = mesh->next;
+   }
+}
 
-      if(mesh->texture_normal && shader->textureNormalMapLocation_1 >= 0) {
-         glActiveTexture(GL_TEXTURE1);
-         glBindTexture(GL_TEXTURE_2D, mesh->texture_normal->getGLtextureID());
-         shader->setUniform1i(UNIFORM_VARIABLE_NAME_TEXTURE_NORMAL_MAP, 1);
-      }
+/**
+ * Instanced version of draw. Soft copies of a group share its meshes, so all of them
+ * can be drawn at once, each with its own model matrix.
+ * There is no frustum culling, the instances are expected to be visible already
+ */
+void
+C_MeshGroup::drawInstanced(GLuint instanceBuffer, int nInstances)
+{
+   C_GLShader *shader = instancedShader;
+   assert(shader && shader->modelMatrixAttribLocation >= 0);
 
-      if(mesh->texture_specular && shader->textureSpecularLocation_2 >= 0) {
-         glActiveTexture(GL_TEXTURE2);
-         glBindTexture(GL_TEXTURE_2D, mesh->texture_specular->getGLtextureID());
-         shader->setUniform1i(UNIFORM_VARIABLE_NAME_TEXTURE_SPECULAR, 2);
-      }
+   shaderManager->pushShader(shader);
 
-      if(!mesh->texture_diffuse && !mesh->texture_normal && !mesh->texture_specular) {
-         glBindTexture(GL_TEXTURE_2D, 0);
-      }
+   shader->setUniformMatrix4fv(UNIFORM_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
+   shader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
 
-      mesh->draw(shader);
+   if(shader->GetUniLoc(UNIFORM_LIGHT_POSITION) >= 0)
+      shader->setUniform3f(UNIFORM_LIGHT_POSITION, lightPosition.x, lightPosition.y, lightPosition.z);
+
+   shader->enableAttribArrays(true);
+
+   /// A mat4 attribute takes 4 locations, one per column. They advance once per instance
+   glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+   for(int i = 0; i < 4; i++) {
+      GLint location = shader->modelMatrixAttribLocation + i;
+
+      glEnableVertexAttribArray(location);
+      glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(ESMatrix), (void *)(i * 4 * sizeof(GLfloat)));
+      glVertexAttribDivisor(location, 1);
+   }
+
+   C_Mesh *mesh = meshes;
+   while(mesh) {
+      bindTextures(mesh, shader);
+      mesh->drawInstanced(shader, nInstances);
       mesh = mesh->next;
    }
 
-//   bbox.Draw();
+   for(int i = 0; i < 4; i++) {
+      glVertexAttribDivisor(shader->modelMatrixAttribLocation + i, 0);
+      glDisableVertexAttribArray(shader->modelMatrixAttribLocation + i);
+   }
 
-   if(shader->verticesAttribLocation >= 0)   glDisableVertexAttribArray(shader->verticesAttribLocation);
-   if(shader->colorsAttribLocation >= 0)     glDisableVertexAttribArray(shader->colorsAttribLocation);
-   if(shader->texCoordsAttribLocation >= 0)  glDisableVertexAttribArray(shader->texCoordsAttribLocation);
-   if(shader->normalsAttribLocation >= 0)    glDisableVertexAttribArray(shader->normalsAttribLocation);
-   if(shader->binormalsAttribLocation >= 0)  glDisableVertexAttribArray(shader->binormalsAttribLocation);
-   if(shader->tangetsAttribLocation >= 0)    glDisableVertexAttribArray(shader->tangetsAttribLocation);
+   shader->enableAttribArrays(false);
 
    shaderManager->popShader();
+}
 
-   return true;
+void
+C_MeshGroup::bindTextures(C_Mesh *mesh, C_GLShader *shader)
+{
+   /// If mesh has texture enable it
+   if(mesh->texture_diffuse && shader->textureDiffuseLocation_0 >= 0) {
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, mesh->texture_diffuse->getGLtextureID());
+      shader->setUniform1i(UNIFORM_TEXTURE_DIFFUSE, 0);
+   }
+
+   if(mesh->texture_normal && shader->textureNormalMapLocation_1 >= 0) {
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, mesh->texture_normal->getGLtextureID());
+      shader->setUniform1i(UNIFORM_TEXTURE_NORMAL_MAP, 1);
+   }
+
+   if(mesh->texture_specular && shader->textureSpecularLocation_2 >= 0) {
+      glActiveTexture(GL_TEXTURE2);
+      glBindTexture(GL_TEXTURE_2D, mesh->texture_specular->getGLtextureID());
+      shader->setUniform1i(UNIFORM_TEXTURE_SPECULAR, 2);
+   }
+
+   if(!mesh->texture_diffuse && !mesh->texture_normal && !mesh->texture_specular) {
+      glBindTexture(GL_TEXTURE_2D, 0);
+   }
 }
 
 void
 C_Mesh::draw(C_GLShader *shader)
+{
+   bindVBOS(shader);
+
+   if(!indices) {
+      glDrawArrays(GL_TRIANGLES, 0, nVertices);
+   } else {
+      assert(0);
+      glDrawElements(GL_TRIANGLES, 3 * nTriangles, GL_UNSIGNED_INT, indices);
+   }
+}
+
+void
+C_Mesh::drawInstanced(C_GLShader *shader, int nInstances)
+{
+   assert(!indices);
+
+   bindVBOS(shader);
+   glDrawArraysInstanced(GL_TRIANGLES, 0, nVertices, nInstances);
+}
+
+void
+C_Mesh::bindVBOS(C_GLShader *shader)
 {
    if(shader->verticesAttribLocation >= 0) {
       glBindBuffer(GL_ARRAY_BUFFER, vbos[VERTICES_VBO]);
@@ -583,13 +684,6 @@ C_Mesh::draw(C_GLShader *shader)
       glBindBuffer(GL_ARRAY_BUFFER, vbos[TANGENTS_VBO]);
       glVertexAttribPointer(shader->tangetsAttribLocation,   sizeof(C_Vertex)   / sizeof(float), GL_FLOAT, GL_FALSE, 0, 0);
    }
-
-   if(!indices) {
-      glDrawArrays(GL_TRIANGLES, 0, nVertices);
-   } else {
-      assert(0);
-      glDrawElements(GL_TRIANGLES, 3 * nTriangles, GL_UNSIGNED_INT, indices);
-   }
 }
 
 bool
@@ -62,10 +62,11 @@ public:
    virtual void rotate(C_Vertex *rotation);
 
    void draw(C_GLShader *shader);
+   void drawInstanced(C_GLShader *shader, int nInstances);
    void drawNormals(void);
    void calculateBbox(void);
    void applyTransformationOnVertices(const ESMatrix *mat);
-
+   void bindVBOS(C_GLShader *shader);
 };
 
 class C_MeshGroup : public C_BaseMesh  {
@@ -73,6 +74,8 @@ public:
    C_Mesh         *meshes;                /// Linked list of meshes in group
    int            nMeshes;                /// Number of meshes in group
    C_GLShader     *shader;
+   /// Same as shader but takes the model matrix from a per instance attribute. NULL if the group isn't drawn instanced
+   C_GLShader     *instancedShader;
    C_Vertex       position;
    ESMatrix       matrix;
    bool           applyFrustumCulling;    /// Don't apply frustum culling on low poly meshes
@@ -86,6 +89,11 @@ public:
    C_Mesh *addMesh(void);        /// Creates a new mesh, adds it in the linked list and returns
                                  /// a pointer to it
    bool draw(C_Camera *camera);
+   /// Draws the group once per model matrix in instanceBuffer, with instancedShader
+   void drawInstanced(GLuint instanceBuffer, int nInstances);
+   /// Same as draw and drawInstanced but the meshes are added to a render queue
+   void queue(C_RenderQueue *renderQueue);
+   void queueInstanced(C_RenderQueue *renderQueue, GLuint instanceBuffer, int firstInstance, int nInstances);
    void drawNormals(C_Camera *camera);
    void calculateBbox(void);
    void applyTransformationOnVertices(const ESMatrix *mat);
@@ -102,6 +110,9 @@ public:
 private:
    C_Quaternion   rotationQuat;
    bool           rotated;
+
+   void bindTextures(C_Mesh *mesh, C_GLShader *shader);
+   void modelviewMatrix(ESMatrix *mat);
 };
 
 #endif
@@ -29,6 +29,8 @@ static const char fragmentShaderSource [] = {
 #endif
 
 static grid_vertex edgeVertices[12];
+/// Boxes of the grids tested by GridsInFrustum
+static frustumBoxes_t gridBoxes;
 
 inline float fieldFormula(float q , float r)
 {
@@ -102,13 +104,27 @@ void C_CubeGrid::Constructor(float x, float y, float z)
 	bbox.SetVertices();
 }
 
+void C_CubeGrid::GridsInFrustum(C_CubeGrid *grids , int nGrids , const C_Frustum *frustum , signed char *results)
+{
+	if(nGrids <= 0) {
+		return;
+	}
+
+	clearFrustumBoxes(&gridBoxes);
+	for(int i = 0 ; i < nGrids ; i++) {
+		C_Vector3 bboxMin, bboxMax;
+		grids[i].bbox.GetMin(&bboxMin);
+		grids[i].bbox.GetMax(&bboxMax);
+		addFrustumBox(&gridBoxes, &bboxMin, &bboxMax);
+	}
 
-void C_CubeGrid::Update(C_Metaball *metaballs , int nBalls , C_Frustum *frustum)
+	frustum->boxesInFrustum(&gridBoxes, results);
+}
+
+void C_CubeGrid::Update(C_Metaball *metaballs , int nBalls , signed char frustumResult)
 {
-	if(frustum != NULL) {
-		if(!frustum->cubeInFrustum(&bbox)) {
-			return;
-		}
+	if(frustumResult == FRUSTUM_OUTSIDE) {
+		return;
 	}
 
 	float rad, dist, normalScale;
@@ -247,12 +263,10 @@ void C_CubeGrid::Update(C_Metaball *metaballs , int nBalls , C_Frustum *frustum)
 	}
 }
 
-int C_CubeGrid::Draw(C_Frustum *frustum)
+int C_CubeGrid::Draw(signed char frustumResult)
 {
-	if(frustum != NULL) {
-		if(frustum->cubeInFrustum(&bbox) == false) {
-			return 0;
-		}
+	if(frustumResult == FRUSTUM_OUTSIDE) {
+		return 0;
 	}
 
 	/// Pass matrices to shader
@@ -261,8 +275,8 @@ int C_CubeGrid::Draw(C_Frustum *frustum)
 	ESMatrix mat = globalViewMatrix;
 	esTranslate(&mat, position.x , position.y , position.z);
 
-	bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
-	bspShader->setUniformMatrix4fv(UNIFORM_VARIABLE_NAME_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+	bspShader->setUniformMatrix4fv(UNIFORM_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&mat.m[0][0]);
+	bspShader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
 	/// Vertices
 	glEnableVertexAttribArray(bspShader->verticesAttribLocation);
 	glVertexAttribPointer(bspShader->verticesAttribLocation, 3, GL_FLOAT, GL_FALSE, (3 + 3) * sizeof(float), geometry);
@@ -43,11 +43,15 @@ public:
 	/// Actual geometry
 	triangle_vn *geometry;
 
-	/// Updates ball positions
-	void Update(C_Metaball *metaballs , int nBalls , C_Frustum *frustum);
+	/// Frustum tests the bboxes of all the grids in one C_Frustum::boxesInFrustum call.
+	/// Done once per frame, results[i] is then passed to grids[i]'s Update and Draw
+	static void GridsInFrustum(C_CubeGrid *grids , int nGrids , const C_Frustum *frustum , signed char *results);
+
+	/// Updates ball positions. Skipped if frustumResult is FRUSTUM_OUTSIDE
+	void Update(C_Metaball *metaballs , int nBalls , signed char frustumResult);
 
 	/// Drawing functions
-	int Draw(C_Frustum *frustum);
+	int Draw(signed char frustumResult);
 	void DrawGridCube(void);
 };
 
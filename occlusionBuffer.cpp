@@ -0,0 +1,365 @@
+#include "occlusionBuffer.h"
+#include "threadPool.h"
+#include "bspPacket.h"
+#include "math.h"
+
+#include <math.h>
+#include <string.h>
+
+#if OCCLUSION_BUFFER_WIDTH % OCCLUSION_TILE_SIZE || OCCLUSION_BUFFER_HEIGHT % OCCLUSION_TILE_SIZE || \
+    OCCLUSION_BUFFER_WIDTH % RAY_PACKET_SIZE
+#  error "The occlusion buffer must be made of whole tiles and packets"
+#endif
+
+/// Boxes tested by a single task
+#define BOXES_PER_TASK     64
+
+typedef struct {
+   C_OcclusionBuffer *buffer;
+   int               tileRow;
+} tileRowTask_t;
+
+typedef struct {
+   C_OcclusionBuffer *buffer;
+   const C_BBox      **boxes;
+   int               nBoxes;
+   bool              *visible;
+} boxesTask_t;
+
+/// Row vector times matrix, like math::transformPoint, keeping w
+static inline void
+toClipSpace(const ESMatrix *m, const C_Vertex *p, float *clip)
+{
+   for(int i = 0; i < 4; i++) {
+      clip[i] = p->x * m->m[0][i] + p->y * m->m[1][i] + p->z * m->m[2][i] + m->m[3][i];
+   }
+}
+
+C_OcclusionBuffer::C_OcclusionBuffer(void)
+{
+   depth = new float[OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT];
+   memset(depth, 0, OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT * sizeof(float));
+   memset(tileMin, 0, sizeof(tileMin));
+   memset(tileMax, 0, sizeof(tileMax));
+   viewProjection = Identity;
+
+   pool = MAX_THREADS > 1 ? new C_ThreadPool(MAX_THREADS) : NULL;
+}
+
+C_OcclusionBuffer::~C_OcclusionBuffer(void)
+{
+   delete pool;
+   delete[] depth;
+}
+
+void
+C_OcclusionBuffer::Begin(const ESMatrix *viewProjection)
+{
+   this->viewProjection = *viewProjection;
+   occluders.clear();
+}
+
+void
+C_OcclusionBuffer::AddOccluders(const triangle_vn *triangles, int nTriangles, const ESMatrix *model)
+{
+   ESMatrix mvp;
+   esMatrixMultiply(&mvp, model, &viewProjection);
+
+   for(int t = 0; t < nTriangles; t++) {
+      float clip[3][4];
+      toClipSpace(&mvp, &triangles[t].vertex0, clip[0]);
+      toClipSpace(&mvp, &triangles[t].vertex1, clip[1]);
+      toClipSpace(&mvp, &triangles[t].vertex2, clip[2]);
+
+      /// All three vertices outside the same side of the frustum
+      bool outside = false;
+      for(int axis = 0; axis < 2 && !outside; axis++) {
+         outside = (clip[0][axis] > clip[0][3] && clip[1][axis] > clip[1][3] && clip[2][axis] > clip[2][3]) ||
+                   (clip[0][axis] < -clip[0][3] && clip[1][axis] < -clip[1][3] && clip[2][axis] < -clip[2][3]);
+      }
+      if(outside) {
+         continue;
+      }
+
+      /// Clip against the near plane (z >= -w). A triangle turns into a quad at most
+      float polygon[4][4];
+      int nVertices = 0;
+      for(int i = 0; i < 3; i++) {
+         const float *p = clip[i], *q = clip[(i + 1) % 3];
+         float dp = p[2] + p[3], dq = q[2] + q[3];
+
+         if(dp >= 0.0f) {
+            memcpy(polygon[nVertices++], p, sizeof(float) * 4);
+         }
+
+         if((dp >= 0.0f) != (dq >= 0.0f)) {
+            float s = dp / (dp - dq);
+            for(int k = 0; k < 4; k++) {
+               polygon[nVertices][k] = p[k] + s * (q[k] - p[k]);
+            }
+            nVertices++;
+         }
+      }
+
+      for(int i = 1; i + 1 < nVertices; i++) {
+         const float fan[3][4] = {{polygon[0][0], polygon[0][1], polygon[0][2], polygon[0][3]},
+                                  {polygon[i][0], polygon[i][1], polygon[i][2], polygon[i][3]},
+                                  {polygon[i + 1][0], polygon[i + 1][1], polygon[i + 1][2], polygon[i + 1][3]}};
+         SetupTriangle(fan);
+      }
+   }
+}
+
+void
+C_OcclusionBuffer::SetupTriangle(const float (*clip)[4])
+{
+   float x[3], y[3], z[3];
+   int i;
+
+   for(i = 0; i < 3; i++) {
+      /// On the near plane w can still be 0 if the near distance is
+      if(clip[i][3] <= EPSILON) {
+         return;
+      }
+
+      z[i] = 1.0f / clip[i][3];
+      x[i] = (clip[i][0] * z[i] * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH;
+      y[i] = (clip[i][1] * z[i] * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT;
+   }
+
+   float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+   if(fabs(area) < EPSILON) {
+      return;
+   }
+
+   occluderTriangle_t triangle;
+   float sign = area > 0.0f ? 1.0f : -1.0f;
+   area = fabs(area);
+
+   /// Edge i is the one facing vertex i. It's area at the vertex and 0 on the edge
+   triangle.za = triangle.zb = triangle.zc = 0.0f;
+   for(i = 0; i < 3; i++) {
+      int j = (i + 1) % 3, k = (i + 2) % 3;
+
+      triangle.a[i] = -(y[k] - y[j]) * sign;
+      triangle.b[i] = (x[k] - x[j]) * sign;
+      triangle.c[i] = ((y[k] - y[j]) * x[j] - (x[k] - x[j]) * y[j]) * sign;
+
+      triangle.za += triangle.a[i] * z[i] / area;
+      triangle.zb += triangle.b[i] * z[i] / area;
+      triangle.zc += triangle.c[i] * z[i] / area;
+   }
+
+   /// Pixels whose centres might be inside
+   triangle.minX = MAX(0, (int)floor(MIN(x[0], MIN(x[1], x[2]))));
+   triangle.maxX = MIN(OCCLUSION_BUFFER_WIDTH - 1, (int)floor(MAX(x[0], MAX(x[1], x[2]))));
+   triangle.minY = MAX(0, (int)floor(MIN(y[0], MIN(y[1], y[2]))));
+   triangle.maxY = MIN(OCCLUSION_BUFFER_HEIGHT - 1, (int)floor(MAX(y[0], MAX(y[1], y[2]))));
+
+   if(triangle.minX <= triangle.maxX && triangle.minY <= triangle.maxY) {
+      occluders.push_back(triangle);
+   }
+}
+
+void
+C_OcclusionBuffer::RasterizeTriangle(const occluderTriangle_t *triangle, int firstRow, int lastRow)
+{
+   packetFloat_t lanes;
+   for(int i = 0; i < RAY_PACKET_SIZE; i++) {
+      lanes[i] = i + 0.5f;
+   }
+
+   int startX = triangle->minX & ~(RAY_PACKET_SIZE - 1);
+
+   for(int y = MAX(firstRow, triangle->minY); y <= MIN(lastRow, triangle->maxY); y++) {
+      float py = y + 0.5f;
+      float e0 = triangle->b[0] * py + triangle->c[0];
+      float e1 = triangle->b[1] * py + triangle->c[1];
+      float e2 = triangle->b[2] * py + triangle->c[2];
+      float ez = triangle->zb * py + triangle->zc;
+      float *row = depth + y * OCCLUSION_BUFFER_WIDTH;
+
+      for(int x = startX; x <= triangle->maxX; x += RAY_PACKET_SIZE) {
+         packetFloat_t px = lanes + (float)x;
+         packetInt_t inside = (px * triangle->a[0] + e0 >= 0.0f) &
+                              (px * triangle->a[1] + e1 >= 0.0f) &
+                              (px * triangle->a[2] + e2 >= 0.0f);
+         packetFloat_t z = px * triangle->za + ez;
+         packetFloat_t d;
+
+         memcpy(&d, row + x, sizeof(d));
+         d = (inside & (z > d)) ? z : d;
+         memcpy(row + x, &d, sizeof(d));
+      }
+   }
+}
+
+void
+C_OcclusionBuffer::RasterizeTileRow(int tileRow)
+{
+   int firstRow = tileRow * OCCLUSION_TILE_SIZE;
+   int lastRow = firstRow + OCCLUSION_TILE_SIZE - 1;
+
+   memset(depth + firstRow * OCCLUSION_BUFFER_WIDTH, 0, OCCLUSION_TILE_SIZE * OCCLUSION_BUFFER_WIDTH * sizeof(float));
+
+   for(unsigned int i = 0; i < occluders.size(); i++) {
+      if(occluders[i].maxY >= firstRow && occluders[i].minY <= lastRow) {
+         RasterizeTriangle(&occluders[i], firstRow, lastRow);
+      }
+   }
+
+   for(int tx = 0; tx < OCCLUSION_TILES_X; tx++) {
+      float farthest = GREATEST_FLOAT, nearest = 0.0f;
+
+      for(int y = firstRow; y <= lastRow; y++) {
+         const float *pixel = depth + y * OCCLUSION_BUFFER_WIDTH + tx * OCCLUSION_TILE_SIZE;
+         for(int x = 0; x < OCCLUSION_TILE_SIZE; x++) {
+            farthest = MIN(farthest, pixel[x]);
+            nearest = MAX(nearest, pixel[x]);
+         }
+      }
+
+      tileMin[tileRow * OCCLUSION_TILES_X + tx] = farthest;
+      tileMax[tileRow * OCCLUSION_TILES_X + tx] = nearest;
+   }
+}
+
+void
+C_OcclusionBuffer::RasterizeTileRow_Task(void *data, int tid)
+{
+   tileRowTask_t *task = (tileRowTask_t *)data;
+   task->buffer->RasterizeTileRow(task->tileRow);
+}
+
+void
+C_OcclusionBuffer::Rasterize(void)
+{
+   /// Tile rows don't share any pixels
+   if(pool) {
+      tileRowTask_t tasks[OCCLUSION_TILES_Y];
+
+      for(int i = 0; i < OCCLUSION_TILES_Y; i++) {
+         tasks[i].buffer = this;
+         tasks[i].tileRow = i;
+         pool->addTask(RasterizeTileRow_Task, &tasks[i]);
+      }
+
+      pool->wait();
+   } else {
+      for(int i = 0; i < OCCLUSION_TILES_Y; i++) {
+         RasterizeTileRow(i);
+      }
+   }
+}
+
+bool
+C_OcclusionBuffer::IsVisible(const C_BBox *bbox) const
+{
+   C_Vertex corners[8];
+   float minX = GREATEST_FLOAT, maxX = SMALLEST_FLOAT;
+   float minY = GREATEST_FLOAT, maxY = SMALLEST_FLOAT;
+   float nearestW = GREATEST_FLOAT;
+
+   bbox->GetVertices(corners);
+
+   for(int i = 0; i < 8; i++) {
+      float clip[4];
+      toClipSpace(&viewProjection, &corners[i], clip);
+
+      /// Boxes crossing the near plane are too close to be hidden
+      if(clip[2] < -clip[3] || clip[3] <= EPSILON) {
+         return true;
+      }
+
+      float z = 1.0f / clip[3];
+      float x = (clip[0] * z * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH;
+      float y = (clip[1] * z * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT;
+
+      minX = MIN(minX, x);
+      maxX = MAX(maxX, x);
+      minY = MIN(minY, y);
+      maxY = MAX(maxY, y);
+      nearestW = MIN(nearestW, clip[3]);
+   }
+
+   /// Objects sitting right behind an occluder are kept (the wall meshes are placed on the bsp walls)
+   if(nearestW <= OCCLUSION_DEPTH_SLACK + EPSILON) {
+      return true;
+   }
+   float nearest = 1.0f / (nearestW - OCCLUSION_DEPTH_SLACK);
+
+   /// Off screen. That's for the frustum culling to decide
+   if(maxX < 0.0f || maxY < 0.0f || minX >= OCCLUSION_BUFFER_WIDTH || minY >= OCCLUSION_BUFFER_HEIGHT) {
+      return true;
+   }
+
+   /// Every pixel the box's screen rectangle touches
+   int x0 = MAX(0, (int)floor(minX)), x1 = MIN(OCCLUSION_BUFFER_WIDTH - 1, (int)floor(maxX));
+   int y0 = MAX(0, (int)floor(minY)), y1 = MIN(OCCLUSION_BUFFER_HEIGHT - 1, (int)floor(maxY));
+
+   for(int ty = y0 / OCCLUSION_TILE_SIZE; ty <= y1 / OCCLUSION_TILE_SIZE; ty++) {
+      for(int tx = x0 / OCCLUSION_TILE_SIZE; tx <= x1 / OCCLUSION_TILE_SIZE; tx++) {
+         int tile = ty * OCCLUSION_TILES_X + tx;
+
+         /// Behind every occluder of the tile
+         if(nearest < tileMin[tile]) {
+            continue;
+         }
+
+         /// In front of every occluder of the tile
+         if(nearest >= tileMax[tile]) {
+            return true;
+         }
+
+         int px0 = MAX(x0, tx * OCCLUSION_TILE_SIZE), px1 = MIN(x1, tx * OCCLUSION_TILE_SIZE + OCCLUSION_TILE_SIZE - 1);
+         int py0 = MAX(y0, ty * OCCLUSION_TILE_SIZE), py1 = MIN(y1, ty * OCCLUSION_TILE_SIZE + OCCLUSION_TILE_SIZE - 1);
+
+         for(int y = py0; y <= py1; y++) {
+            const float *row = depth + y * OCCLUSION_BUFFER_WIDTH;
+            for(int x = px0; x <= px1; x++) {
+               if(nearest >= row[x]) {
+                  return true;
+               }
+            }
+         }
+      }
+   }
+
+   return false;
+}
+
+void
+C_OcclusionBuffer::TestBoxes_Task(void *data, int tid)
+{
+   boxesTask_t *task = (boxesTask_t *)data;
+
+   for(int i = 0; i < task->nBoxes; i++) {
+      task->visible[i] = task->buffer->IsVisible(task->boxes[i]);
+   }
+}
+
+void
+C_OcclusionBuffer::TestBoxes(const C_BBox **boxes, int nBoxes, bool *visible)
+{
+   int nTasks = (nBoxes + BOXES_PER_TASK - 1) / BOXES_PER_TASK;
+   boxesTask_t *tasks = new boxesTask_t[nTasks];
+
+   for(int i = 0; i < nTasks; i++) {
+      tasks[i].buffer = this;
+      tasks[i].boxes = boxes + i * BOXES_PER_TASK;
+      tasks[i].nBoxes = MIN(BOXES_PER_TASK, nBoxes - i * BOXES_PER_TASK);
+      tasks[i].visible = visible + i * BOXES_PER_TASK;
+
+      if(pool) {
+         pool->addTask(TestBoxes_Task, &tasks[i]);
+      } else {
+         TestBoxes_Task(&tasks[i], 0);
+      }
+   }
+
+   if(pool) {
+      pool->wait();
+   }
+
+   delete[] tasks;
+}
@@ -0,0 +1,73 @@
+#ifndef _OCCLUSIONBUFFER_H_
+#define _OCCLUSIONBUFFER_H_
+
+#include "globals.h"
+#include "bbox.h"
+
+#include <vector>
+
+#define OCCLUSION_TILE_SIZE            8     /// Pixels on each side of a tile of the min/max hierarchy
+#define OCCLUSION_TILES_X              (OCCLUSION_BUFFER_WIDTH / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_TILES_Y              (OCCLUSION_BUFFER_HEIGHT / OCCLUSION_TILE_SIZE)
+
+class C_ThreadPool;
+
+/// Occluder triangle in screen space, set up for rasterization
+typedef struct {
+   /// Edge functions a * x + b * y + c, positive inside
+   float a[3], b[3], c[3];
+   /// 1 / w plane. Unlike w it interpolates linearly in screen space
+   float za, zb, zc;
+   int minX, maxX, minY, maxY;
+} occluderTriangle_t;
+
+/**
+ * Software occlusion culling.
+ * The occluders (the bsp leaves' triangles) are rasterized into a low resolution depth buffer
+ * on the CPU, the buffer is split in rows of tiles and each row is rasterized by a worker
+ * thread, RAY_PACKET_SIZE pixels at a time (see bspPacket.h).
+ * The buffer keeps 1 / w, so bigger is nearer and 0 is nothing at all. For each tile the farthest
+ * (min) and nearest (max) depths are kept too. A box is hidden if its nearest point is behind the
+ * farthest occluder of every tile it covers, and visible as soon as it's in front of the nearest
+ * occluder of one of them. Only in between are the pixels looked at.
+ */
+class C_OcclusionBuffer {
+public:
+   C_OcclusionBuffer(void);
+   ~C_OcclusionBuffer(void);
+
+   /// Starts a new frame. viewProjection takes world coordinates to clip space
+   void Begin(const ESMatrix *viewProjection);
+   /// Queues triangles to be rasterized. model takes them to world coordinates
+   void AddOccluders(const triangle_vn *triangles, int nTriangles, const ESMatrix *model);
+   /// Rasterizes the queued occluders and builds the min/max tiles
+   void Rasterize(void);
+
+   /// Returns false if the box is hidden behind the occluders
+   bool IsVisible(const C_BBox *bbox) const;
+   /// IsVisible for many boxes on the worker threads
+   void TestBoxes(const C_BBox **boxes, int nBoxes, bool *visible);
+
+   int nOccluders(void) const { return occluders.size(); }
+
+private:
+   ESMatrix viewProjection;
+
+   /// OCCLUSION_BUFFER_WIDTH x OCCLUSION_BUFFER_HEIGHT 1 / w
+   float *depth;
+   float tileMin[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+   float tileMax[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+
+   vector<occluderTriangle_t> occluders;
+
+   C_ThreadPool *pool;
+
+   void SetupTriangle(const float (*clip)[4]);
+   void RasterizeTriangle(const occluderTriangle_t *triangle, int firstRow, int lastRow);
+   void RasterizeTileRow(int tileRow);
+
+   static void RasterizeTileRow_Task(void *data, int tid);
+   static void TestBoxes_Task(void *data, int tid);
+};
+
+#endif
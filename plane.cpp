@@ -15,7 +15,9 @@
 ****************************************/
 
 #include "plane.h"
-#include <GL/glut.h>
+#ifndef BSP_COMPILER
+#  include <GL/glut.h>
+#endif
 
 
 C_Plane::C_Plane(float _a , float _b , float _c , float _d)
@@ -173,6 +175,7 @@ float C_Plane::GetPlaneConstant(void)
 }
 
 
+#ifndef BSP_COMPILER
 void C_Plane::Draw(void)
 {
 	glDisable(GL_TRIANGLES);
@@ -187,3 +190,4 @@ void C_Plane::Draw(void)
 	glColor3f(1.0 , 1.0 , 1.0);
 	glEnable(GL_LIGHTING);
 }
+#endif
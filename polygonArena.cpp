@@ -0,0 +1,82 @@
+#include "polygonArena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGNMENT    16
+
+C_PolygonArena::C_PolygonArena(void)
+{
+   PRINT_FUNC_ENTRY;
+
+   current = NULL;
+   bytesLeft = 0;
+   bytesAllocated = 0;
+}
+
+C_PolygonArena::~C_PolygonArena(void)
+{
+   PRINT_FUNC_ENTRY;
+
+   Release();
+}
+
+void *
+C_PolygonArena::Allocate(size_t size)
+{
+   size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+   if(size > bytesLeft) {
+      /// Requests bigger than a block get a block of their own
+      size_t blockSize = MAX(size, (size_t)POLYGON_ARENA_BLOCK_SIZE);
+
+      current = new char[blockSize];
+      bytesLeft = blockSize;
+      blocks.push_back(current);
+   }
+
+   void *ptr = current;
+   current += size;
+   bytesLeft -= size;
+   bytesAllocated += size;
+
+   return ptr;
+}
+
+poly_t *
+C_PolygonArena::NewPolygon(int nVertices)
+{
+   poly_t *poly = (poly_t *)Allocate(sizeof(poly_t));
+
+   poly->nVertices = nVertices;
+   poly->pVertices = (C_Vertex *)Allocate(nVertices * sizeof(C_Vertex));
+   poly->pNorms = (C_Vertex *)Allocate(nVertices * sizeof(C_Vertex));
+   poly->usedAsDivider = false;
+
+   return poly;
+}
+
+poly_t *
+C_PolygonArena::NewPolygons(int nPolys)
+{
+   return (poly_t *)Allocate(nPolys * sizeof(poly_t));
+}
+
+poly_t **
+C_PolygonArena::NewPolygonList(int nPolys)
+{
+   return (poly_t **)Allocate(nPolys * sizeof(poly_t *));
+}
+
+void
+C_PolygonArena::Release(void)
+{
+   for(unsigned int i = 0; i < blocks.size(); ++i) {
+      delete[] blocks[i];
+   }
+
+   blocks.clear();
+   current = NULL;
+   bytesLeft = 0;
+   bytesAllocated = 0;
+}
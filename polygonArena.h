@@ -0,0 +1,47 @@
+#ifndef _POLYGONARENA_H_
+#define _POLYGONARENA_H_
+
+#include "bspCommon.h"
+
+#include <vector>
+
+using namespace std;
+
+/// Size of each memory block requested from the system
+#define POLYGON_ARENA_BLOCK_SIZE    (256 * 1024)
+
+/**
+ * Bump allocator for bsp polygons.
+ * Polygons, their vertices/normals and the nodes' polygon lists are carved out of big
+ * memory blocks and are never freed one by one. Everything is released at once with
+ * Release() or when the arena is destroyed.
+ * An arena is not thread safe. Each build thread gets its own.
+ */
+class C_PolygonArena {
+public:
+   C_PolygonArena(void);
+   ~C_PolygonArena(void);
+
+   /// Returns size bytes aligned to 16 bytes
+   void *Allocate(size_t size);
+
+   /// Polygon with room for nVertices vertices and normals
+   poly_t *NewPolygon(int nVertices);
+   /// Array of nPolys polygons (vertices are not allocated)
+   poly_t *NewPolygons(int nPolys);
+   /// Array of nPolys polygon pointers
+   poly_t **NewPolygonList(int nPolys);
+
+   /// Frees all memory handed out so far
+   void Release(void);
+
+   inline size_t GetBytesAllocated(void) const { return bytesAllocated; }
+
+private:
+   vector<char *>    blocks;
+   char              *current;
+   size_t            bytesLeft;
+   size_t            bytesAllocated;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "renderQueue.h"
+
+#include <algorithm>
+#include <string.h>
+
+#define RENDER_KEY_MASK(bits)    ((1ull << (bits)) - 1)
+
+static bool
+sortKeyLess(const renderSortKey_t &a, const renderSortKey_t &b)
+{
+   return a.key < b.key;
+}
+
+C_RenderQueue::C_RenderQueue(void)
+{
+   memset((void *)&statistics, 0, sizeof(statistics));
+   memset(boundTextures, 0, sizeof(boundTextures));
+}
+
+void
+C_RenderQueue::Add(C_GLShader *shader, C_Mesh *mesh, const ESMatrix *modelview, const ESMatrix *mvp)
+{
+   renderItem_t item;
+
+   assert(!mesh->indices);
+
+   item.shader = shader;
+   item.mesh = mesh;
+   item.modelview = *modelview;
+   item.mvp = *mvp;
+   item.instanceBuffer = 0;
+   item.firstInstance = 0;
+   item.nInstances = 0;
+
+   items.push_back(item);
+}
+
+void
+C_RenderQueue::AddInstanced(C_GLShader *shader, C_Mesh *mesh, GLuint instanceBuffer, int firstInstance, int nInstances)
+{
+   renderItem_t item;
+
+   assert(shader->modelMatrixAttribLocation >= 0);
+   assert(nInstances > 0);
+   assert(!mesh->indices);
+
+   item.shader = shader;
+   item.mesh = mesh;
+   item.instanceBuffer = instanceBuffer;
+   item.firstInstance = firstInstance;
+   item.nInstances = nInstances;
+
+   items.push_back(item);
+}
+
+/**
+ * The ids are cut to their low bits. Two ids sharing them only sort next to each other,
+ * the binds are decided by the real ids
+ */
+unsigned long long
+C_RenderQueue::MakeKey(const renderItem_t *item) const
+{
+   C_Mesh *mesh = item->mesh;
+   unsigned long long key;
+
+   key = item->shader->GetProgramObject() & RENDER_KEY_MASK(RENDER_KEY_SHADER_BITS);
+   key = (key << RENDER_KEY_TEXTURE_BITS) | ((mesh->texture_diffuse ? mesh->texture_diffuse->getGLtextureID() : 0) & RENDER_KEY_MASK(RENDER_KEY_TEXTURE_BITS));
+   key = (key << RENDER_KEY_TEXTURE_BITS) | ((mesh->texture_normal ? mesh->texture_normal->getGLtextureID() : 0) & RENDER_KEY_MASK(RENDER_KEY_TEXTURE_BITS));
+   key = (key << RENDER_KEY_TEXTURE_BITS) | ((mesh->texture_specular ? mesh->texture_specular->getGLtextureID() : 0) & RENDER_KEY_MASK(RENDER_KEY_TEXTURE_BITS));
+   key = (key << RENDER_KEY_VBO_BITS) | (mesh->vbos[VERTICES_VBO] & RENDER_KEY_MASK(RENDER_KEY_VBO_BITS));
+
+   return key;
+}
+
+void
+C_RenderQueue::BindShader(C_GLShader *shader, C_GLShader *previous)
+{
+   if(previous) {
+      if(previous->modelMatrixAttribLocation >= 0) {
+         for(int i = 0; i < 4; i++) {
+            glVertexAttribDivisor(previous->modelMatrixAttribLocation + i, 0);
+            glDisableVertexAttribArray(previous->modelMatrixAttribLocation + i);
+         }
+      }
+
+      previous->enableAttribArrays(false);
+      shaderManager->popShader();
+   }
+
+   if(!shader) {
+      return;
+   }
+
+   shaderManager->pushShader(shader);
+   statistics.shaderChanges++;
+
+   /// Same for every item drawn with the shader
+   if(shader->GetUniLoc(UNIFORM_VIEW_MATRIX) >= 0)
+      shader->setUniformMatrix4fv(UNIFORM_VIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&globalViewMatrix.m[0][0]);
+   if(shader->GetUniLoc(UNIFORM_PROJECTION_MATRIX) >= 0)
+      shader->setUniformMatrix4fv(UNIFORM_PROJECTION_MATRIX, 1, GL_FALSE, (GLfloat *)&globalProjectionMatrix.m[0][0]);
+
+   shader->setUniform3f(UNIFORM_LIGHT_POSITION, lightPosition.x, lightPosition.y, lightPosition.z);
+   shader->setUniform1i(UNIFORM_TEXTURE_DIFFUSE, 0);
+   shader->setUniform1i(UNIFORM_TEXTURE_NORMAL_MAP, 1);
+   shader->setUniform1i(UNIFORM_TEXTURE_SPECULAR, 2);
+
+   shader->enableAttribArrays(true);
+
+   if(shader->modelMatrixAttribLocation >= 0) {
+      for(int i = 0; i < 4; i++) {
+         glEnableVertexAttribArray(shader->modelMatrixAttribLocation + i);
+         glVertexAttribDivisor(shader->modelMatrixAttribLocation + i, 1);
+      }
+   }
+}
+
+void
+C_RenderQueue::BindTexture(int unit, C_Texture *texture, bool used)
+{
+   unsigned int id = texture ? texture->getGLtextureID() : 0;
+
+   if(!used || boundTextures[unit] == id) {
+      return;
+   }
+
+   glActiveTexture(GL_TEXTURE0 + unit);
+   glBindTexture(GL_TEXTURE_2D, id);
+   boundTextures[unit] = id;
+   statistics.textureChanges++;
+}
+
+void
+C_RenderQueue::Flush(void)
+{
+   unsigned int i;
+
+   memset((void *)&statistics, 0, sizeof(statistics));
+   statistics.items = items.size();
+
+   if(!items.size()) {
+      return;
+   }
+
+   sortKeys.resize(items.size());
+   for(i = 0; i < items.size(); i++) {
+      sortKeys[i].key = MakeKey(&items[i]);
+      sortKeys[i].item = i;
+   }
+   sort(sortKeys.begin(), sortKeys.end(), sortKeyLess);
+
+   /// Anything could have been bound since the last flush
+   memset(boundTextures, 0xff, sizeof(boundTextures));
+
+   C_GLShader *shader = NULL;
+   C_Mesh *mesh = NULL;
+
+   for(i = 0; i < sortKeys.size(); i++) {
+      renderItem_t *item = &items[sortKeys[i].item];
+
+      if(item->shader != shader) {
+         BindShader(item->shader, shader);
+         shader = item->shader;
+         /// Attribute locations differ from shader to shader
+         mesh = NULL;
+      }
+
+      /// Meshes without textures unbind unit 0, like C_MeshGroup::draw does
+      C_Mesh *itemMesh = item->mesh;
+      bool untextured = !itemMesh->texture_diffuse && !itemMesh->texture_normal && !itemMesh->texture_specular;
+      BindTexture(0, itemMesh->texture_diffuse, untextured || (itemMesh->texture_diffuse && shader->textureDiffuseLocation_0 >= 0));
+      BindTexture(1, itemMesh->texture_normal, itemMesh->texture_normal && shader->textureNormalMapLocation_1 >= 0);
+      BindTexture(2, itemMesh->texture_specular, itemMesh->texture_specular && shader->textureSpecularLocation_2 >= 0);
+
+      if(itemMesh != mesh) {
+         itemMesh->bindVBOS(shader);
+         mesh = itemMesh;
+         statistics.vertexBufferChanges++;
+      }
+
+      if(item->nInstances) {
+         glBindBuffer(GL_ARRAY_BUFFER, item->instanceBuffer);
+         for(int column = 0; column < 4; column++) {
+            glVertexAttribPointer(shader->modelMatrixAttribLocation + column, 4, GL_FLOAT, GL_FALSE, sizeof(ESMatrix),
+                                  (void *)(item->firstInstance * sizeof(ESMatrix) + column * 4 * sizeof(GLfloat)));
+         }
+
+         glDrawArraysInstanced(GL_TRIANGLES, 0, mesh->nVertices, item->nInstances);
+      } else {
+         shader->setUniformMatrix4fv(UNIFORM_MODELVIEW_MATRIX, 1, GL_FALSE, (GLfloat *)&item->modelview.m[0][0]);
+         shader->setUniformMatrix4fv(UNIFORM_MVP_MATRIX, 1, GL_FALSE, (GLfloat *)&item->mvp.m[0][0]);
+
+         glDrawArrays(GL_TRIANGLES, 0, mesh->nVertices);
+      }
+
+      statistics.drawCalls++;
+   }
+
+   BindShader(NULL, shader);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glActiveTexture(GL_TEXTURE0);
+
+   items.clear();
+}
@@ -0,0 +1,74 @@
+#ifndef _RENDERQUEUE_H_
+#define _RENDERQUEUE_H_
+
+#include "globals.h"
+#include "mesh.h"
+
+#include <vector>
+
+/// Sort key bits, most expensive state change first: shader | diffuse | normal map | specular texture | vertex buffers
+#define RENDER_KEY_SHADER_BITS      8
+#define RENDER_KEY_TEXTURE_BITS     12
+#define RENDER_KEY_VBO_BITS         20
+
+/// One C_Mesh to draw
+typedef struct {
+   C_GLShader  *shader;
+   C_Mesh      *mesh;
+   /// Not instanced items
+   ESMatrix    modelview;
+   ESMatrix    mvp;
+   /// Instanced items take nInstances model matrices from instanceBuffer, starting at firstInstance.
+   /// nInstances is 0 for the items that aren't instanced
+   GLuint      instanceBuffer;
+   int         firstInstance;
+   int         nInstances;
+} renderItem_t;
+
+typedef struct {
+   unsigned long long key;
+   int item;
+} renderSortKey_t;
+
+/// State changes of the last Flush
+typedef struct {
+   int items;
+   int shaderChanges;
+   int textureChanges;
+   int vertexBufferChanges;
+   int drawCalls;
+} renderQueueStatistics_t;
+
+/**
+ * Render queue.
+ * Instead of drawing the meshes while the tree is walked they are queued with all the state they need,
+ * sorted by a key packing that state and drawn in one go. Sorted items that share a shader, a texture
+ * or a mesh follow each other, so only the state that changes from one item to the next is set.
+ * The textures bound and the mesh whose vertex buffers are bound are tracked to skip the redundant binds.
+ */
+class C_RenderQueue {
+public:
+   C_RenderQueue(void);
+
+   /// modelview and mvp are the matrices C_MeshGroup::draw would set
+   void Add(C_GLShader *shader, C_Mesh *mesh, const ESMatrix *modelview, const ESMatrix *mvp);
+   void AddInstanced(C_GLShader *shader, C_Mesh *mesh, GLuint instanceBuffer, int firstInstance, int nInstances);
+
+   /// Draws everything queued and empties the queue
+   void Flush(void);
+
+   renderQueueStatistics_t statistics;
+
+private:
+   vector<renderItem_t> items;
+   vector<renderSortKey_t> sortKeys;
+
+   /// Texture bound in units 0 - 2
+   unsigned int boundTextures[3];
+
+   unsigned long long MakeKey(const renderItem_t *item) const;
+   void BindShader(C_GLShader *shader, C_GLShader *previous);
+   void BindTexture(int unit, C_Texture *texture, bool used);
+};
+
+#endif
@@ -0,0 +1,47 @@
+attribute vec3 a_vertices;
+attribute vec3 a_normals;
+attribute vec3 a_tangents;
+attribute vec3 a_binormals;
+attribute vec2 a_texCoords;
+/// One per instance
+attribute mat4 a_modelMatrix;
+
+uniform mat4 u_viewMatrix;
+uniform mat4 u_projectionMatrix;
+
+uniform vec3 u_lightPosition_es;
+
+varying vec2 v_texCoords;
+varying vec3 v_lightVec_ts;
+varying vec3 v_eyeDirection_ts;
+varying vec3 v_vertexPosition_es;
+
+void main(void) {
+   mat4 modelviewMatrix = u_viewMatrix * a_modelMatrix;
+
+   vec3 t = vec3(modelviewMatrix * vec4(a_tangents, 0.0));
+   vec3 b = vec3(modelviewMatrix * vec4(a_binormals, 0.0));
+   vec3 n = vec3(modelviewMatrix * vec4(a_normals, 0.0));
+
+   vec3 vertexPosition_es = vec3(modelviewMatrix * vec4(a_vertices, 1.0));
+	vec3 lightDir_es = (u_lightPosition_es - vertexPosition_es);
+
+   v_vertexPosition_es = vertexPosition_es;
+
+   /// Light direction
+   vec3 v;
+	v.x = dot (lightDir_es, t);
+	v.y = dot (lightDir_es, b);
+	v.z = dot (lightDir_es, n);
+	v_lightVec_ts =  v;
+
+	/// Eye direction
+	vertexPosition_es = -vertexPosition_es;
+   v.x = dot (vertexPosition_es, t);
+	v.y = dot (vertexPosition_es, b);
+	v.z = dot (vertexPosition_es, n);
+	v_eyeDirection_ts = v;
+
+   v_texCoords = a_texCoords;
+   gl_Position = u_projectionMatrix * (modelviewMatrix * vec4(a_vertices, 1.0));
+}
@@ -0,0 +1,27 @@
+attribute vec3 a_vertices;
+attribute vec3 a_normals;
+attribute vec2 a_texCoords;
+/// One per instance
+attribute mat4 a_modelMatrix;
+
+uniform mat4 u_viewMatrix;
+uniform mat4 u_projectionMatrix;
+
+uniform vec3 u_lightPosition_es;
+
+varying vec2 v_texCoords;
+varying vec3 v_lightVec_es;
+varying vec3 vertexPosition_es;
+varying vec3 v_normals_es;
+
+void main(void) {
+   mat4 modelviewMatrix = u_viewMatrix * a_modelMatrix;
+
+   vertexPosition_es = vec3(modelviewMatrix * vec4(a_vertices, 1.0));
+
+   v_lightVec_es = normalize(u_lightPosition_es - vertexPosition_es);
+   v_normals_es = vec3(normalize(modelviewMatrix * vec4(a_normals, 0.0)));
+
+   v_texCoords = a_texCoords;
+   gl_Position = u_projectionMatrix * vec4(vertexPosition_es, 1.0);
+}
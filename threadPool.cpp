@@ -0,0 +1,114 @@
+#include "threadPool.h"
+#include "globals.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+C_ThreadPool::C_ThreadPool(int nThreads)
+{
+   PRINT_FUNC_ENTRY;
+
+   if(nThreads < 1)
+      nThreads = 1;
+
+   this->nThreads = nThreads;
+   pendingTasks = 0;
+   shutdown = false;
+
+   pthread_mutex_init(&mutex, NULL);
+   pthread_cond_init(&taskAvailable, NULL);
+   pthread_cond_init(&allDone, NULL);
+
+   threads = new pthread_t[nThreads];
+   workerData = new workerData_t[nThreads];
+
+   for(int i = 0; i < nThreads; i++) {
+      workerData[i].pool = this;
+      workerData[i].tid = i;
+
+      if(pthread_create(&threads[i], NULL, workerThread, (void *)&workerData[i])) {
+         printf("Could not create new thread.\n");
+         abort();
+      }
+   }
+}
+
+C_ThreadPool::~C_ThreadPool(void)
+{
+   PRINT_FUNC_ENTRY;
+
+   pthread_mutex_lock(&mutex);
+   shutdown = true;
+   pthread_cond_broadcast(&taskAvailable);
+   pthread_mutex_unlock(&mutex);
+
+   for(int i = 0; i < nThreads; i++) {
+      pthread_join(threads[i], NULL);
+   }
+
+   delete[] threads;
+   delete[] workerData;
+
+   pthread_cond_destroy(&allDone);
+   pthread_cond_destroy(&taskAvailable);
+   pthread_mutex_destroy(&mutex);
+}
+
+void
+C_ThreadPool::addTask(threadTask_t func, void *data)
+{
+   task_t task;
+   task.func = func;
+   task.data = data;
+
+   pthread_mutex_lock(&mutex);
+   tasks.push_back(task);
+   ++pendingTasks;
+   pthread_cond_signal(&taskAvailable);
+   pthread_mutex_unlock(&mutex);
+}
+
+void
+C_ThreadPool::wait(void)
+{
+   pthread_mutex_lock(&mutex);
+   while(pendingTasks) {
+      pthread_cond_wait(&allDone, &mutex);
+   }
+   pthread_mutex_unlock(&mutex);
+}
+
+void *
+C_ThreadPool::workerThread(void *data_)
+{
+   workerData_t *data = (workerData_t *)data_;
+   C_ThreadPool *pool = data->pool;
+   task_t task;
+
+   while(1) {
+      pthread_mutex_lock(&pool->mutex);
+      while(!pool->tasks.size() && !pool->shutdown) {
+         pthread_cond_wait(&pool->taskAvailable, &pool->mutex);
+      }
+
+      if(!pool->tasks.size()) {
+         /// Shutting down and nothing left to do
+         pthread_mutex_unlock(&pool->mutex);
+         break;
+      }
+
+      task = pool->tasks.back();
+      pool->tasks.pop_back();
+      pthread_mutex_unlock(&pool->mutex);
+
+      task.func(task.data, data->tid);
+
+      pthread_mutex_lock(&pool->mutex);
+      if(!--pool->pendingTasks) {
+         pthread_cond_broadcast(&pool->allDone);
+      }
+      pthread_mutex_unlock(&pool->mutex);
+   }
+
+   return NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+/// A task receives its user data and the id of the worker thread running it
+typedef void (*threadTask_t)(void *data, int tid);
+
+/**
+ * Minimal pthread worker pool.
+ * Tasks are kept in a LIFO queue so that tasks spawned by other tasks
+ * (ie. subtrees while building the bsp tree) are picked up depth first.
+ * Tasks are allowed to queue new tasks from inside a worker.
+ */
+class C_ThreadPool {
+public:
+   C_ThreadPool(int nThreads);
+   ~C_ThreadPool(void);
+
+   /// Queue a new task
+   void addTask(threadTask_t func, void *data);
+
+   /// Blocks until all queued tasks (and the tasks they spawned) have finished
+   void wait(void);
+
+   inline int getnThreads(void) const { return nThreads; }
+
+private:
+   typedef struct {
+      threadTask_t   func;
+      void           *data;
+   } task_t;
+
+   typedef struct {
+      C_ThreadPool   *pool;
+      int            tid;
+   } workerData_t;
+
+   int               nThreads;
+   pthread_t         *threads;
+   workerData_t      *workerData;
+
+   vector<task_t>    tasks;
+   /// Tasks queued or currently running
+   int               pendingTasks;
+   bool              shutdown;
+
+   pthread_mutex_t   mutex;
+   pthread_cond_t    taskAvailable;
+   pthread_cond_t    allDone;
+
+   static void *workerThread(void *data);
+};
+
+#endif
@@ -1,12 +1,11 @@
-#ifndef _TILE_H_
-#define _TILE_H_
+#ifndef _TILE_H_
+#define _TILE_H_
 
 #include "globals.h"
 
-#define MAX_PARAMETER_LENGTH			256   /// Maximum length of a parameter.
+#define TILE_SIZE 20.0f
 
-#define TILES_ON_X                   80
-#define TILES_ON_Y                   50
+#define MAX_PARAMETER_LENGTH			256   /// Maximum length of a parameter.
 
 #define NEIGHBOUR_LEFT                0
 #define NEIGHBOUR_RIGHT               1
@@ -31,44 +30,21 @@ typedef enum {TILE_0,
 
               N_TILE_TYPES} tileTypes_t;
 
-/// RGB colors of the available tile types
-static const float selections[N_TILE_TYPES + 1][3] = { {1.0f,	0.0f,	0.0f},	// Wall
-                                                       {0.0f,	1.0f,	0.0f},	// Staircase
-                                                       {0.0f,	0.0f,	1.0f},	// Door
-                                                       {0.0f,	0.0f,	0.0f},	// Monster (type can be a parameter)
-                                                       {1.0f,	0.0f,	1.0f},	// Whatever
-                                                       {1.0f,	1.0f,	0.0f},
-                                                       {0.0f,	1.0f,	1.0f},
-                                                       {1.0f,	1.0f,	1.0f},
-                                                       /// Tile type 0 with parameter.
-                                                       {0.8f, 0.8f, 0.8f}};
+/// A tile packed in a byte: type in the low 4 bits, area in the high 4 bits.
+/// Tile parameters are kept apart by the map (see C_Map::getTileParameter)
+typedef uint8_t tile_t;
 
-class tile
+static inline tile_t
+packTile(tileTypes_t type, areaTypes_t area)
 {
-private:
-	tileTypes_t type;	      /// tile's type
-	string      parameter;	/// parameter saved to/read from file
-	areaTypes_t area;
-
-public:
-   tile(void);
-	tile(int x, int y);
-	~tile(void);
+   return (tile_t)(type | (area << 4));
+}
 
-	int x, y;			      /// coordinates
+static inline tileTypes_t tileType(tile_t tile)    { return (tileTypes_t)(tile & 0x0f); }
+static inline areaTypes_t tileArea(tile_t tile)    { return (areaTypes_t)(tile >> 4); }
 
-	bool hasParameter;
-	void setParameter(string param);
-
-	void draw(float tileSize);
+/// Cleans up a parameter read from the map file (removes white spaces and new lines).
+/// Returns false if it is not a valid parameter
+bool cleanTileParameter(string *parameter);
 
-   inline void setCoordX(int x)           { this->x = x; }
-   inline void setCoordY(int y)           { this->y = y; }
-   inline void setType(tileTypes_t type)  { this->type = type; area = (type == TILE_WALL) ? AREA_WALL : AREA_NAN; }
-   inline tileTypes_t getType(void)       { return type; }
-   inline void setArea(areaTypes_t area)  { this->area = area; }
-   inline areaTypes_t getArea(void)       { return area; }
-   inline string getParameter(void)       { return parameter; }
-};
-
 #endif